@@ -673,6 +673,19 @@ static int dev_blockio(int rw, struct bufvec *bufvec)
 	return __tux3_volmap_io(rw, bufvec, block, count);
 }
 
+/*
+ * Hint that count blocks from block will be read soon. Only volmap
+ * (index is physical address) is supported. File maps don't need
+ * this, those read the whole extent at once by blockread().
+ */
+void blockreadahead(map_t *map, block_t block, unsigned count)
+{
+	if (map->io == dev_blockio) {
+		devio_readahead(map->dev, block << map->dev->bits,
+				count << map->dev->bits);
+	}
+}
+
 int dev_errio(int rw, struct bufvec *bufvec)
 {
 	assert(0);
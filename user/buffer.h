@@ -158,6 +158,7 @@ unsigned buffer_hash(block_t block);
 struct buffer_head *peekblk(map_t *map, block_t block);
 struct buffer_head *blockget(map_t *map, block_t block);
 struct buffer_head *blockread(map_t *map, block_t block);
+void blockreadahead(map_t *map, block_t block, unsigned count);
 void insert_buffer_hash(struct buffer_head *buffer);
 void remove_buffer_hash(struct buffer_head *buffer);
 void truncate_buffers_range(map_t *map, loff_t lstart, loff_t lend);
@@ -172,6 +173,7 @@ void free_map(map_t *map);
 /* buffer_writeback.c */
 /* Helper for waiting I/O (stub) */
 struct iowait {
+	int err;			/* I/O error */
 };
 
 /* I/O completion callback */
@@ -223,6 +225,8 @@ static inline block_t bufvec_contig_last_index(struct bufvec *bufvec)
 
 void tux3_iowait_init(struct iowait *iowait);
 void tux3_iowait_wait(struct iowait *iowait);
+void tux3_devio_async(int rw, struct sb *sb, loff_t offset, void *data,
+		      unsigned len, struct iowait *iowait);
 void bufvec_init(struct bufvec *bufvec, map_t *map,
 		 struct list_head *head, struct tux3_iattr_data *idata);
 void bufvec_free(struct bufvec *bufvec);
@@ -8,12 +8,22 @@
 
 void tux3_iowait_init(struct iowait *iowait)
 {
+	iowait->err = 0;
 }
 
 void tux3_iowait_wait(struct iowait *iowait)
 {
 }
 
+/* Userland I/O is synchronous, so I/O was completed at return */
+void tux3_devio_async(int rw, struct sb *sb, loff_t offset, void *data,
+		      unsigned len, struct iowait *iowait)
+{
+	int err = devio(rw, sb_dev(sb), offset, data, len);
+	if (err)
+		iowait->err = err;
+}
+
 /*
  * Helper for buffer vector I/O.
  */
@@ -114,6 +124,10 @@ int bufvec_io(int rw, struct bufvec *bufvec, block_t physical, unsigned count)
 	}
 	assert(i > 0);
 
+	/* Count at submission, same with kernel */
+	if (rw & WRITE)
+		sb->commit_counters.buffers += count;
+
 	err = devio_vec(rw, sb_dev(sb), physical << sb->blockbits,
 			iov, iov_count);
 	bufvec_io_done(bufvec, err);
@@ -1,4 +1,5 @@
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <linux/fs.h> // for BLKGETSIZE
@@ -98,6 +99,12 @@ int diskwrite(int fd, void *data, size_t count, off_t offset)
 	return ioabs(fd, data, count, 1, offset);
 }
 
+/* Start asynchronous read of range, to be used later by diskread() */
+int diskreadahead(int fd, size_t count, off_t offset)
+{
+	return -posix_fadvise(fd, offset, count, POSIX_FADV_WILLNEED);
+}
+
 int streamread(int fd, void *data, size_t count)
 {
 	return iorel(fd, data, count, 0);
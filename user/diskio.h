@@ -9,6 +9,7 @@ int iovabs(int fd, struct iovec *iov, int iovcnt, int out, off_t offset);
 int ioabs(int fd, void *data, size_t count, int out, off_t offset);
 int diskread(int fd, void *data, size_t count, off_t offset);
 int diskwrite(int fd, void *data, size_t count, off_t offset);
+int diskreadahead(int fd, size_t count, off_t offset);
 int streamread(int fd, void *data, size_t count);
 int streamwrite(int fd, void *data, size_t count);
 int fdsize64(int fd, loff_t *size);
@@ -119,6 +119,23 @@ static void filemap_clean_endio(struct buffer_head *buffer, int err)
 	blockput(buffer);
 }
 
+/* Fill buffers from inline data without I/O */
+static int filemap_inline_read(struct bufvec *bufvec)
+{
+	struct inode *inode = bufvec_inode(bufvec);
+	struct buffer_head *buffer;
+
+	list_for_each_entry(buffer, &bufvec->contig, link)
+		tux3_inline_read(inode, bufindex(buffer), bufdata(buffer),
+				 bufsize(buffer));
+
+	bufvec->end_io = filemap_read_endio;
+	bufvec_complete_without_io(bufvec, bufvec_contig_count(bufvec));
+	bufvec_free(bufvec);
+
+	return 0;
+}
+
 static int filemap_extent_io(enum map_mode mode, int rw, struct bufvec *bufvec)
 {
 	struct inode *inode = bufvec_inode(bufvec);
@@ -139,11 +156,29 @@ static int filemap_extent_io(enum map_mode mode, int rw, struct bufvec *bufvec)
 		if (err)
 			return err;
 		bufvec_io = &bufvec_ahead;
+
+		if (tux_inode(inode)->inline_data)
+			return filemap_inline_read(bufvec_io);
 	} else {
 		bufvec_io = bufvec;
 	}
 	count = bufvec_contig_count(bufvec_io);
 
+	if (rw & WRITE) {
+		struct buffer_head *buffer = bufvec_contig_buf(bufvec_io);
+
+		err = tux3_inline_write(inode, bufvec_io->idata, index, count,
+					bufdata(buffer));
+		if (err) {
+			if (err < 0)
+				return err;
+			/* Saved as inline data, no I/O */
+			bufvec_io->end_io = clear_buffer_dirty_for_endio;
+			bufvec_complete_without_io(bufvec_io, count);
+			return 0;
+		}
+	}
+
 	struct block_segment seg[10];
 
 	int segs = map_region(inode, index, count, seg, ARRAY_SIZE(seg), mode);
@@ -151,6 +186,9 @@ static int filemap_extent_io(enum map_mode mode, int rw, struct bufvec *bufvec)
 		return segs;
 	assert(segs);
 
+	if (rw & WRITE)
+		tux3_inline_written(inode, index);
+
 	for (int i = 0; i < segs; i++) {
 		block = seg[i].block;
 		count = seg[i].count;
@@ -215,6 +253,10 @@ static int tuxio(struct file *file, void *data, unsigned len, int write)
 	if (write) {
 		tux3_iattrdirty(inode);
 		inode->i_mtime = inode->i_ctime = gettime();
+
+		err = tux3_inline_grow(inode, pos + len);
+		if (err)
+			return err;
 	}
 
 	unsigned bbits = sb->blockbits;
@@ -14,24 +14,73 @@
 #define trace trace_on
 #endif
 
-#define HASH_SHIFT	10
-#define HASH_SIZE	(1 << 10)
-#define HASH_MASK	(HASH_SIZE - 1)
+/*
+ * Inode hash. The table starts with INODE_HASH_SHIFT_MIN bits, and is
+ * doubled when the number of hashed inodes exceeds the number of
+ * buckets.
+ */
+#define INODE_HASH_SHIFT_MIN	10
+#define INODE_HASH_SHIFT_MAX	24
 
-static struct hlist_head inode_hashtable[HASH_SIZE] = {
-	[0 ... (HASH_SIZE - 1)] = HLIST_HEAD_INIT,
-};
+static struct hlist_head inode_hash_initial[1 << INODE_HASH_SHIFT_MIN];
+static struct hlist_head *inode_hashtable = inode_hash_initial;
+static unsigned inode_hash_shift = INODE_HASH_SHIFT_MIN;
+static unsigned long inode_hash_count;
 
-static unsigned long hash(inum_t inum)
+static struct hlist_head *inode_hash_head(inum_t inum)
 {
-	return hash_64(inum, HASH_SHIFT);
+	return inode_hashtable + hash_64(inum, inode_hash_shift);
+}
+
+static void inode_hash_grow(void)
+{
+	unsigned new_shift = inode_hash_shift + 1;
+	struct hlist_head *old = inode_hashtable, *new;
+	unsigned long i;
+
+	if (new_shift > INODE_HASH_SHIFT_MAX)
+		return;
+
+	/* If no memory, just keep using the current table */
+	new = malloc(sizeof(*new) << new_shift);
+	if (!new)
+		return;
+	for (i = 0; i < 1UL << new_shift; i++)
+		INIT_HLIST_HEAD(&new[i]);
+
+	for (i = 0; i < 1UL << inode_hash_shift; i++) {
+		struct inode *inode;
+		struct hlist_node *n;
+
+		hlist_for_each_entry_safe(inode, n, &old[i], i_hash) {
+			inum_t inum = tux_inode(inode)->inum;
+			hlist_del(&inode->i_hash);
+			hlist_add_head(&inode->i_hash,
+				       new + hash_64(inum, new_shift));
+		}
+	}
+
+	trace("inode hash %u -> %u bits, %lu inodes", inode_hash_shift,
+	      new_shift, inode_hash_count);
+	inode_hashtable = new;
+	inode_hash_shift = new_shift;
+	if (old != inode_hash_initial)
+		free(old);
+}
+
+static void inode_hash_add(struct inode *inode, inum_t inum)
+{
+	if (inode_hash_count >= 1UL << inode_hash_shift)
+		inode_hash_grow();
+	hlist_add_head(&inode->i_hash, inode_hash_head(inum));
+	inode_hash_count++;
 }
 
 void inode_leak_check(void)
 {
 	int leaks = 0;
 
-	for (int i = 0; i < HASH_SIZE; i++) {
+	for (unsigned long i = 0; i < 1UL << inode_hash_shift; i++) {
 		struct hlist_head *head = inode_hashtable + i;
 		struct inode *inode;
 		hlist_for_each_entry(inode, head, i_hash) {
@@ -52,14 +101,15 @@ static inline int inode_unhashed(struct inode *inode)
 
 static void insert_inode_hash(struct inode *inode)
 {
-	struct hlist_head *b = inode_hashtable + hash(tux_inode(inode)->inum);
-	hlist_add_head(&inode->i_hash, b);
+	inode_hash_add(inode, tux_inode(inode)->inum);
 }
 
 void remove_inode_hash(struct inode *inode)
 {
-	if (!inode_unhashed(inode))
+	if (!inode_unhashed(inode)) {
 		hlist_del_init(&inode->i_hash);
+		inode_hash_count--;
+	}
 }
 
 static struct inode *new_inode(struct sb *sb)
@@ -169,7 +219,7 @@ static struct inode *find_inode(struct sb *sb, struct hlist_head *head,
 static struct inode *ilookup5_nowait(struct sb *sb, inum_t inum,
 		int (*test)(struct inode *, void *), void *data)
 {
-	struct hlist_head *head = inode_hashtable + hash(inum);
+	struct hlist_head *head = inode_hash_head(inum);
 	struct inode *inode;
 
 	inode = find_inode(sb, head, test, data);
@@ -190,7 +240,7 @@ static struct inode *iget5_locked(struct sb *sb, inum_t inum,
 			   int (*test)(struct inode *, void *),
 			   int (*set)(struct inode *, void *), void *data)
 {
-	struct hlist_head *head = inode_hashtable + hash(inum);
+	struct hlist_head *head = inode_hash_head(inum);
 	struct inode *inode;
 
 	inode = find_inode(sb, head, test, data);
@@ -206,7 +256,7 @@ static struct inode *iget5_locked(struct sb *sb, inum_t inum,
 	}
 
 	inode->i_state = I_NEW;
-	hlist_add_head(&inode->i_hash, head);
+	inode_hash_add(inode, inum);
 
 	return inode;
 }
@@ -214,7 +264,7 @@ static struct inode *iget5_locked(struct sb *sb, inum_t inum,
 static int insert_inode_locked4(struct inode *inode, inum_t inum,
 			 int (*test)(struct inode *, void *), void *data)
 {
-	struct hlist_head *head = inode_hashtable + hash(inum);
+	struct hlist_head *head = inode_hash_head(inum);
 
 	while (1) {
 		struct inode *old = NULL;
@@ -228,7 +278,7 @@ static int insert_inode_locked4(struct inode *inode, inum_t inum,
 		}
 		if (likely(!old)) {
 			inode->i_state |= I_NEW;
-			hlist_add_head(&inode->i_hash, head);
+			inode_hash_add(inode, inum);
 			return 0;
 		}
 		__iget(old);
@@ -252,7 +302,7 @@ void i_size_write(struct inode *inode, loff_t i_size)
 }
 
 /* Truncate partial block. If partial, we have to update last block. */
-static int tux3_truncate_partial_block(struct inode *inode, loff_t newsize)
+int tux3_truncate_partial_block(struct inode *inode, loff_t newsize)
 {
 	unsigned delta = tux3_get_current_delta();
 	struct sb *sb = tux_sb(inode->i_sb);
@@ -280,6 +330,168 @@ static int tux3_truncate_partial_block(struct inode *inode, loff_t newsize)
 	return 0;
 }
 
+/*
+ * Cache of decoded inode attributes.
+ *
+ * When a clean inode is evicted, its decoded attributes, dtree root,
+ * inline data and xcache are kept here, so the next tux3_iget() for
+ * the same inum can skip both the itree probe and decode_attrs().
+ *
+ * An entry only lives while there is no in-core inode for its inum:
+ * it is removed when an inode is instantiated from it, and dirty or
+ * unlinked inodes are never cached. So the itree record can't change
+ * behind the entry.
+ */
+#define IATTR_CACHE_HASH_SHIFT	14
+#define IATTR_CACHE_MAX		(1 << 16)
+
+struct iattr_cache_entry {
+	struct hlist_node hash;		/* link for iattr_cache_hash */
+	struct list_head lru;		/* link for iattr_cache_lru */
+	struct sb *sb;
+	inum_t inum;
+	struct tux3_iattr_data idata;
+	struct root root;		/* dtree root */
+	struct xcache *xcache;		/* xcache moved from inode */
+	void *inline_data;		/* inline data moved from inode */
+	unsigned inline_size;
+};
+
+static struct hlist_head iattr_cache_hash[1 << IATTR_CACHE_HASH_SHIFT];
+static LIST_HEAD(iattr_cache_lru);
+static unsigned iattr_cache_count;
+static unsigned long iattr_cache_hits, iattr_cache_misses;
+
+static struct hlist_head *iattr_cache_head(inum_t inum)
+{
+	return iattr_cache_hash + hash_64(inum, IATTR_CACHE_HASH_SHIFT);
+}
+
+static struct iattr_cache_entry *iattr_cache_lookup(struct sb *sb, inum_t inum)
+{
+	struct iattr_cache_entry *entry;
+
+	hlist_for_each_entry(entry, iattr_cache_head(inum), hash) {
+		if (entry->sb == sb && entry->inum == inum)
+			return entry;
+	}
+	return NULL;
+}
+
+static void iattr_cache_del(struct iattr_cache_entry *entry)
+{
+	hlist_del(&entry->hash);
+	list_del(&entry->lru);
+	iattr_cache_count--;
+	if (entry->xcache)
+		__free_xcache(entry->xcache);
+	if (entry->inline_data)
+		free(entry->inline_data);
+	free(entry);
+}
+
+/* Remember attributes of inode to be evicted */
+static void iattr_cache_save(struct inode *inode)
+{
+	struct sb *sb = tux_sb(inode->i_sb);
+	struct tux3_inode *tuxnode = tux_inode(inode);
+	struct iattr_cache_entry *entry;
+
+	/* Only clean and still linked normal inodes */
+	if (is_bad_inode(inode) || !inode->i_nlink ||
+	    (inode->i_state & I_DIRTY) || !(inode->i_mode & S_IFMT))
+		return;
+
+	assert(!iattr_cache_lookup(sb, tuxnode->inum));
+
+	entry = malloc(sizeof(*entry));
+	if (!entry)
+		return;
+
+	entry->sb		= sb;
+	entry->inum		= tuxnode->inum;
+	entry->idata.present	= tuxnode->present;
+	entry->idata.i_mode	= inode->i_mode;
+	entry->idata.i_uid	= i_uid_read(inode);
+	entry->idata.i_gid	= i_gid_read(inode);
+	entry->idata.i_nlink	= inode->i_nlink;
+	entry->idata.i_rdev	= inode->i_rdev;
+	entry->idata.i_size	= i_size_read(inode);
+	entry->idata.i_mtime	= inode->i_mtime;
+	entry->idata.i_ctime	= inode->i_ctime;
+	entry->idata.i_version	= inode->i_version;
+	entry->root		= tuxnode->btree.root;
+	entry->xcache		= tuxnode->xcache;
+	entry->inline_data	= tuxnode->inline_data;
+	entry->inline_size	= tuxnode->inline_size;
+	tuxnode->xcache = NULL;
+	tuxnode->inline_data = NULL;
+	tuxnode->inline_size = 0;
+
+	hlist_add_head(&entry->hash, iattr_cache_head(entry->inum));
+	list_add(&entry->lru, &iattr_cache_lru);
+	if (++iattr_cache_count > IATTR_CACHE_MAX) {
+		entry = list_entry(iattr_cache_lru.prev,
+				   struct iattr_cache_entry, lru);
+		iattr_cache_del(entry);
+	}
+}
+
+/*
+ * Setup new inode from cached attributes, instead of reading itree.
+ * return value:
+ * 1 - inode was setup from cache
+ * 0 - not cached
+ */
+static int iattr_cache_fill(struct inode *inode)
+{
+	struct sb *sb = tux_sb(inode->i_sb);
+	struct tux3_inode *tuxnode = tux_inode(inode);
+	struct iattr_cache_entry *entry;
+
+	entry = iattr_cache_lookup(sb, tuxnode->inum);
+	if (!entry) {
+		iattr_cache_misses++;
+		return 0;
+	}
+	iattr_cache_hits++;
+
+	tuxnode->present = entry->idata.present;
+	inode->i_mode = entry->idata.i_mode;
+	i_uid_write(inode, entry->idata.i_uid);
+	i_gid_write(inode, entry->idata.i_gid);
+	set_nlink(inode, entry->idata.i_nlink);
+	inode->i_rdev = entry->idata.i_rdev;
+	inode->i_size = entry->idata.i_size;
+	inode->i_mtime = entry->idata.i_mtime;
+	inode->i_ctime = entry->idata.i_ctime;
+	inode->i_version = entry->idata.i_version;
+	init_btree(&tuxnode->btree, sb, entry->root, dtree_ops());
+
+	/* The xcache and inline data are owned by inode now */
+	tuxnode->xcache = entry->xcache;
+	tuxnode->inline_data = entry->inline_data;
+	tuxnode->inline_size = entry->inline_size;
+	entry->xcache = NULL;
+	entry->inline_data = NULL;
+	iattr_cache_del(entry);
+
+	return 1;
+}
+
+/* Forget all cached attributes of sb */
+void iattr_cache_invalidate(struct sb *sb)
+{
+	struct iattr_cache_entry *entry, *n;
+
+	trace("hits %lu, misses %lu", iattr_cache_hits, iattr_cache_misses);
+
+	list_for_each_entry_safe(entry, n, &iattr_cache_lru, lru) {
+		if (entry->sb == sb)
+			iattr_cache_del(entry);
+	}
+}
+
 /* For now, we doesn't cache inode */
 static int generic_drop_inode(struct inode *inode)
 {
@@ -360,6 +572,7 @@ void iput(struct inode *inode)
 			return;
 		}
 
+		iattr_cache_save(inode);
 		tux3_evict_inode(inode);
 
 		remove_inode_hash(inode);
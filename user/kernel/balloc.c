@@ -247,6 +247,19 @@ void bitmap_dump(struct inode *inode, block_t start, block_t count)
 }
 #endif /* !__KERNEL__ */
 
+/* blockdirty() for bitmap block, and count newly dirtied bitmap block */
+static struct buffer_head *bitmap_blockdirty(struct sb *sb,
+					     struct buffer_head *buffer)
+{
+	int dirtied = !buffer_already_dirty(buffer, sb->unify);
+	struct buffer_head *clone;
+
+	clone = blockdirty(buffer, sb->unify);
+	if (!IS_ERR(clone) && dirtied)
+		sb->commit_counters.bitmap_dirty++;
+	return clone;
+}
+
 /*
  * Modify bits on one block, then adjust ->freeblocks.
  */
@@ -263,7 +276,7 @@ static int bitmap_modify_bits(struct sb *sb, struct buffer_head *buffer,
 	 * The bitmap is modified only by backend.
 	 * blockdirty() should never return -EAGAIN.
 	 */
-	clone = blockdirty(buffer, sb->unify);
+	clone = bitmap_blockdirty(sb, buffer);
 	if (IS_ERR(clone)) {
 		int err = PTR_ERR(clone);
 		assert(err != -EAGAIN);
@@ -594,6 +607,89 @@ int bfree_segs(struct sb *sb, struct block_segment *seg, int segs)
 	return 0;
 }
 
+void bfree_unpin(struct buffer_head **pin)
+{
+	if (*pin) {
+		blockput(*pin);
+		*pin = NULL;
+	}
+}
+
+/* Get dirty bitmap block, and keep it in pin for next call */
+static struct buffer_head *bitmap_pin(struct sb *sb, struct buffer_head **pin,
+				      block_t mapblock)
+{
+	struct buffer_head *buffer, *clone;
+
+	if (*pin && bufindex(*pin) == mapblock)
+		return *pin;
+	bfree_unpin(pin);
+
+	buffer = blockread(mapping(sb->bitmap), mapblock);
+	if (!buffer) {
+		tux3_err(sb, "block read failed");
+		return ERR_PTR(-EIO);
+	}
+	/*
+	 * The bitmap is modified only by backend.
+	 * blockdirty() should never return -EAGAIN.
+	 */
+	clone = bitmap_blockdirty(sb, buffer);
+	if (IS_ERR(clone)) {
+		assert(PTR_ERR(clone) != -EAGAIN);
+		blockput(buffer);
+		return clone;
+	}
+	*pin = clone;
+
+	return clone;
+}
+
+/*
+ * Same with bfree(), but the dirtied bitmap block is kept in pin. So
+ * if caller frees extents in sorted order, each bitmap block is read
+ * and dirtied only once. Caller must release pin by bfree_unpin().
+ */
+int bfree_pinned(struct sb *sb, struct buffer_head **pin, block_t start,
+		 unsigned blocks)
+{
+	unsigned mapshift = sb->blockbits + 3;
+	unsigned mapsize = 1 << mapshift;
+	unsigned mapmask = mapsize - 1;
+	unsigned mapoffset = start & mapmask;
+	block_t block = start;
+	unsigned left = blocks;
+
+	assert(tux3_under_backend(sb));
+	assert(blocks > 0);
+	assert(start + blocks <= sb->volblocks);
+	trace("bfree extent [%Lu/%u], ", start, blocks);
+
+	while (left) {
+		struct buffer_head *clone;
+		unsigned len = min(mapsize - mapoffset, left);
+
+		clone = bitmap_pin(sb, pin, block >> mapshift);
+		if (IS_ERR(clone))
+			return PTR_ERR(clone);
+
+		if (!all_set(bufdata(clone), mapoffset, len)) {
+			tux3_fs_error(sb, "double free: start 0x%Lx, count %x",
+				      start, blocks);
+			return -EIO; /* FIXME: error handling */
+		}
+		clear_bits(bufdata(clone), mapoffset, len);
+		mark_buffer_dirty_non(clone);
+		sb->freeblocks += len;
+
+		mapoffset = 0;
+		block += len;
+		left -= len;
+	}
+
+	return countmap_add_segment(sb, start, blocks, 0);
+}
+
 int replay_update_bitmap(struct replay *rp, block_t start, unsigned blocks,
 			 int set)
 {
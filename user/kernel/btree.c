@@ -242,16 +242,45 @@ static inline int alloc_cursor_size(int count)
 	return sizeof(struct cursor) + sizeof(struct path_level) * count;
 }
 
+/*
+ * Cursor is allocated for each btree operation. Cursor for usual
+ * depth of btree is allocated from slab cache, and deeper one is
+ * allocated by malloc.
+ */
+#define CURSOR_CACHE_LEVELS	8
+
+static struct kmem_cache *tux_cursor_cachep;
+
+int __init tux3_init_cursor_cache(void)
+{
+	tux_cursor_cachep = kmem_cache_create("tux3_cursor_cache",
+			alloc_cursor_size(CURSOR_CACHE_LEVELS), 0,
+			SLAB_TEMPORARY, NULL);
+	if (tux_cursor_cachep == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+void tux3_destroy_cursor_cache(void)
+{
+	kmem_cache_destroy(tux_cursor_cachep);
+}
+
 struct cursor *alloc_cursor(struct btree *btree, int extra)
 {
 	int maxlevel = btree->root.depth + extra;
-	struct cursor *cursor = malloc(alloc_cursor_size(maxlevel + 1));
+	struct cursor *cursor;
+
+	if (maxlevel < CURSOR_CACHE_LEVELS)
+		cursor = kmem_cache_alloc(tux_cursor_cachep, GFP_NOFS);
+	else
+		cursor = malloc(alloc_cursor_size(maxlevel + 1));
 
 	if (cursor) {
 		cursor->btree = btree;
 		cursor->level = -1;
-#ifdef CURSOR_DEBUG
 		cursor->maxlevel = maxlevel;
+#ifdef CURSOR_DEBUG
 		for (int i = 0; i <= maxlevel; i++) {
 			cursor->path[i].buffer = FREE_BUFFER; /* for debug */
 			cursor->path[i].next = FREE_NEXT; /* for debug */
@@ -266,7 +295,10 @@ void free_cursor(struct cursor *cursor)
 #ifdef CURSOR_DEBUG
 	assert(cursor->level == -1);
 #endif
-	free(cursor);
+	if (cursor->maxlevel < CURSOR_CACHE_LEVELS)
+		kmem_cache_free(tux_cursor_cachep, cursor);
+	else
+		free(cursor);
 }
 
 /* Lookup the index entry contains key */
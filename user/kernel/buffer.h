@@ -79,6 +79,7 @@ void tux3_invalidate_buffer(struct buffer_head *buffer);
 struct iowait {
 	atomic_t inflight;		/* In-flight I/O count */
 	struct completion done;		/* completion for in-flight I/O */
+	int err;			/* I/O error */
 };
 
 /* Helper for buffer vector I/O */
@@ -133,6 +134,8 @@ static inline block_t bufvec_contig_last_index(struct bufvec *bufvec)
 
 void tux3_iowait_init(struct iowait *iowait);
 void tux3_iowait_wait(struct iowait *iowait);
+void tux3_devio_async(int rw, struct sb *sb, loff_t offset, void *data,
+		      unsigned len, struct iowait *iowait);
 int bufvec_io(int rw, struct bufvec *bufvec, block_t physical, unsigned count);
 int bufvec_contig_add(struct bufvec *bufvec, struct buffer_head *buffer);
 int flush_list(struct inode *inode, struct tux3_iattr_data *idata,
@@ -27,6 +27,7 @@ void tux3_iowait_init(struct iowait *iowait)
 	 */
 	init_completion(&iowait->done);
 	atomic_set(&iowait->inflight, 1);
+	iowait->err = 0;
 }
 
 void tux3_iowait_wait(struct iowait *iowait)
@@ -36,6 +37,38 @@ void tux3_iowait_wait(struct iowait *iowait)
 	wait_for_completion(&iowait->done);
 }
 
+static void devio_async_endio(struct bio *bio, int err)
+{
+	struct iowait *iowait = bio->bi_private;
+
+	bio_put(bio);
+	if (err)
+		iowait->err = err;
+	iowait_inflight_dec(iowait);
+}
+
+/*
+ * Submit I/O of data without waiting. Use tux3_iowait_wait() to wait,
+ * then error is in iowait->err.
+ */
+void tux3_devio_async(int rw, struct sb *sb, loff_t offset, void *data,
+		      unsigned len, struct iowait *iowait)
+{
+	struct bio_vec vec = {
+		.bv_page	= virt_to_page(data),
+		.bv_offset	= offset_in_page(data),
+		.bv_len		= len,
+	};
+	int err;
+
+	iowait_inflight_inc(iowait);
+	err = vecio(rw, sb_dev(sb), offset, 1, &vec, devio_async_endio, iowait);
+	if (err) {
+		iowait->err = err;
+		iowait_inflight_dec(iowait);
+	}
+}
+
 /*
  * Helper for buffer vector I/O.
  */
@@ -550,6 +583,7 @@ static struct page *bufvec_next_buffer_page(struct bufvec *bufvec)
  */
 int bufvec_io(int rw, struct bufvec *bufvec, block_t physical, unsigned count)
 {
+	struct sb *sb = tux_sb(bufvec_inode(bufvec)->i_sb);
 	unsigned int i;
 	int need_check = 0;
 
@@ -602,6 +636,10 @@ int bufvec_io(int rw, struct bufvec *bufvec, block_t physical, unsigned count)
 		}
 	}
 
+	/* Count at submission, completion is asynchronous */
+	if (rw & WRITE)
+		sb->commit_counters.buffers += count;
+
 	/* If no more buffer, submit the pending bio */
 	if (bufvec->bio && !bufvec_next_buffer_page(bufvec))
 		bufvec_submit_bio(rw, bufvec);
@@ -14,6 +14,7 @@
 #endif
 
 static void __delta_transition(struct sb *sb, struct delta_ref *delta_ref);
+static void delta_release(struct delta_ref *delta_ref);
 static void schedule_flush_delta(struct sb *sb);
 
 /*
@@ -25,34 +26,364 @@ static void schedule_flush_delta(struct sb *sb);
  */
 #define ALLOW_FRONTEND_MODIFY
 
-/* Initialize the lock and list */
-static void init_sb(struct sb *sb)
+/*
+ * Delta and unify scheduling
+ *
+ * Delta commit is started when the current delta has enough dirty
+ * blocks or dirty inodes, or when it got old. The age is at least
+ * TUX3_COMMIT_DUTY times of measured commit latency, so slow device
+ * makes bigger deltas instead of spending most time for commit.
+ *
+ * Unify is started when the log blocks of unify cycle are many, or
+ * replay of those log blocks is estimated to take too long. The
+ * replay cost per log block is measured at mount if there was a log
+ * to replay, otherwise TUX3_REPLAY_USECS is used.
+ */
+#define TUX3_DELTA_BLOCKS	4096
+#define TUX3_DELTA_INODES	1024
+#define TUX3_DELTA_MSECS	5000
+#define TUX3_UNIFY_LOGBLOCKS	32
+#define TUX3_UNIFY_REPLAY_MSECS	1000
+#define TUX3_REPLAY_USECS	100
+#define TUX3_FSYNC_WINDOW_USECS	2000
+#define TUX3_COMMIT_DUTY	4
+
+static void init_sched(struct tux3_sched *sched)
+{
+	*sched = (struct tux3_sched){
+		.delta_blocks		= TUX3_DELTA_BLOCKS,
+		.delta_inodes		= TUX3_DELTA_INODES,
+		.delta_msecs		= TUX3_DELTA_MSECS,
+		.unify_logblocks	= TUX3_UNIFY_LOGBLOCKS,
+		.unify_replay_msecs	= TUX3_UNIFY_REPLAY_MSECS,
+		.fsync_window_usecs	= TUX3_FSYNC_WINDOW_USECS,
+		.delta_start		= tux3_time_usecs(),
+		.replay_usecs		= TUX3_REPLAY_USECS,
+	};
+}
+
+/* Replay of logcount log blocks took usecs */
+void tux3_sched_replay_time(struct sb *sb, unsigned logcount, u64 usecs)
+{
+	if (logcount)
+		sb->sched.replay_usecs = max_t(u64, 1, usecs / logcount);
+}
+
+/* Delta commit took usecs, update average */
+static void sched_commit_time(struct sb *sb, u64 usecs)
+{
+	struct tux3_sched *sched = &sb->sched;
+
+	usecs = min_t(u64, usecs, UINT_MAX);
+	if (!sched->commit_usecs)
+		sched->commit_usecs = usecs;
+	else
+		sched->commit_usecs = (sched->commit_usecs * 7 + usecs) / 8;
+}
+
+static int need_delta(struct sb *sb)
+{
+	struct tux3_sched *sched = &sb->sched;
+	/* Racy read of current delta is fine, this is only a hint */
+	unsigned delta = rcu_dereference_check(sb->current_delta, 1)->delta;
+	struct sb_delta_dirty *s_ddc = tux3_sb_ddc(sb, delta);
+	unsigned blocks = atomic_read(&s_ddc->nr_blocks);
+	unsigned inodes = s_ddc->nr_inodes;
+	u64 age, min_age;
+
+	if (!blocks && !inodes)
+		return 0;
+
+	if (sched->delta_blocks && blocks >= sched->delta_blocks)
+		return 1;
+	if (sched->delta_inodes && inodes >= sched->delta_inodes)
+		return 1;
+
+	if (sched->delta_msecs) {
+		min_age = (u64)sched->delta_msecs * 1000;
+		min_age = max_t(u64, min_age,
+				(u64)sched->commit_usecs * TUX3_COMMIT_DUTY);
+		age = tux3_time_usecs() - sched->delta_start;
+		if (age >= min_age)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int need_unify(struct sb *sb)
+{
+	struct tux3_sched *sched = &sb->sched;
+	/* Log blocks to replay if we don't unify at this delta */
+	u64 logblocks = be32_to_cpu(sb->super.logcount) + sb->lognext;
+
+	if (sched->unify_logblocks && logblocks >= sched->unify_logblocks)
+		return 1;
+	if (sched->unify_replay_msecs &&
+	    logblocks * sched->replay_usecs >=
+	    (u64)sched->unify_replay_msecs * 1000)
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Commit flight recorder
+ *
+ * do_commit() records the time of each phase, and the difference of
+ * ->commit_counters while the commit, into a ring of the last
+ * TUX3_COMMIT_RECORDS commits. With this, we can see which phase made
+ * a slow commit (e.g. write stall), without tracing.
+ */
+
+static void init_commit_recorder(struct sb *sb)
+{
+	struct commit_recorder *recorder = &sb->commit_recorder;
+
+	memset(&sb->commit_counters, 0, sizeof(sb->commit_counters));
+	spin_lock_init(&recorder->lock);
+	recorder->nr_commits = 0;
+}
+
+static void commit_record_start(struct sb *sb, struct commit_record *rec,
+				unsigned delta, u64 *time)
+{
+	*time = tux3_time_usecs();
+	*rec = (struct commit_record){
+		.delta		= delta,
+		.start_usecs	= *time,
+		/* Snapshot, this is replaced by difference at end */
+		.counters	= sb->commit_counters,
+	};
+}
+
+/* Account the time from *time to phase */
+static void commit_record_phase(struct commit_record *rec, int phase,
+				u64 *time)
+{
+	u64 now = tux3_time_usecs();
+	rec->phase_usecs[phase] += now - *time;
+	*time = now;
+}
+
+static void commit_record_end(struct sb *sb, struct commit_record *rec,
+			      int err)
+{
+	struct commit_recorder *recorder = &sb->commit_recorder;
+	struct commit_counters *now = &sb->commit_counters;
+	struct commit_counters *start = &rec->counters;
+
+	rec->err = err;
+	rec->total_usecs = min_t(u64, tux3_time_usecs() - rec->start_usecs,
+				 UINT_MAX);
+	start->inodes		= now->inodes - start->inodes;
+	start->buffers		= now->buffers - start->buffers;
+	start->logblocks	= now->logblocks - start->logblocks;
+	start->bitmap_dirty	= now->bitmap_dirty - start->bitmap_dirty;
+	start->defree		= now->defree - start->defree;
+
+	spin_lock(&recorder->lock);
+	recorder->records[recorder->nr_commits % TUX3_COMMIT_RECORDS] = *rec;
+	recorder->nr_commits++;
+	spin_unlock(&recorder->lock);
+}
+
+/* Copy the records in recorder to stat, in commit order */
+void tux3_commitstat(struct sb *sb, struct tux3_commitstat *stat)
+{
+	struct commit_recorder *recorder = &sb->commit_recorder;
+	u64 first;
+	unsigned i;
+
+	memset(stat, 0, sizeof(*stat));
+
+	spin_lock(&recorder->lock);
+	stat->nr_commits = recorder->nr_commits;
+	stat->nr_records = min_t(u64, recorder->nr_commits,
+				 TUX3_COMMIT_RECORDS);
+	first = recorder->nr_commits - stat->nr_records;
+	for (i = 0; i < stat->nr_records; i++) {
+		unsigned index = (first + i) % TUX3_COMMIT_RECORDS;
+		stat->records[i] = recorder->records[index];
+	}
+	spin_unlock(&recorder->lock);
+}
+
+/*
+ * The refcount of delta. This is percpu_ref, so frontend entry/exit
+ * only touch the counter of own cpu. The refcount is switched to
+ * atomic mode only when the delta is killed by delta transition.
+ *
+ * Kernel older than 3.18 doesn't have PERCPU_REF_INIT_DEAD and
+ * percpu_ref_reinit(), so it uses atomic_t instead.
+ */
+#ifdef TUX3_DELTA_PERCPU_REF
+static void delta_ref_release(struct percpu_ref *refcount)
+{
+	delta_release(container_of(refcount, struct delta_ref, refcount));
+}
+
+static int delta_ref_init(struct delta_ref *delta_ref)
+{
+	/* Dead until __delta_transition() makes it current */
+	return percpu_ref_init(&delta_ref->refcount, delta_ref_release,
+			       PERCPU_REF_INIT_DEAD, GFP_KERNEL);
+}
+
+static void delta_ref_exit(struct delta_ref *delta_ref)
+{
+	percpu_ref_exit(&delta_ref->refcount);
+}
+
+static int delta_ref_tryget(struct delta_ref *delta_ref)
+{
+	return percpu_ref_tryget_live(&delta_ref->refcount);
+}
+
+static void delta_ref_put(struct delta_ref *delta_ref)
+{
+	percpu_ref_put(&delta_ref->refcount);
+}
+
+static int delta_ref_is_zero(struct delta_ref *delta_ref)
+{
+	return percpu_ref_is_zero(&delta_ref->refcount);
+}
+
+static void delta_ref_reinit(struct delta_ref *delta_ref)
+{
+	percpu_ref_reinit(&delta_ref->refcount);
+}
+
+/* Stop new references, and switch to atomic mode to detect last put */
+static void delta_ref_kill(struct delta_ref *delta_ref)
+{
+	percpu_ref_kill(&delta_ref->refcount);
+}
+#else /* !TUX3_DELTA_PERCPU_REF */
+static int delta_ref_init(struct delta_ref *delta_ref)
+{
+	atomic_set(&delta_ref->refcount, 0);
+	return 0;
+}
+
+static void delta_ref_exit(struct delta_ref *delta_ref)
+{
+}
+
+static int delta_ref_tryget(struct delta_ref *delta_ref)
+{
+	return atomic_inc_not_zero(&delta_ref->refcount);
+}
+
+static void delta_ref_put(struct delta_ref *delta_ref)
+{
+	if (atomic_dec_and_test(&delta_ref->refcount))
+		delta_release(delta_ref);
+}
+
+static int delta_ref_is_zero(struct delta_ref *delta_ref)
+{
+	return atomic_read(&delta_ref->refcount) == 0;
+}
+
+static void delta_ref_reinit(struct delta_ref *delta_ref)
+{
+	atomic_set(&delta_ref->refcount, 1);
+}
+
+/* Release initial refcount */
+static void delta_ref_kill(struct delta_ref *delta_ref)
+{
+	delta_ref_put(delta_ref);
+}
+#endif /* !TUX3_DELTA_PERCPU_REF */
+
+/* Release delta refcounts initialized by init_delta_refs() */
+static void exit_delta_refs(struct sb *sb)
 {
 	int i;
 
+	for (i = 0; i < ARRAY_SIZE(sb->delta_refs); i++) {
+		struct delta_ref *delta_ref = &sb->delta_refs[i];
+
+		/* ->sb tells whether this refcount was initialized */
+		if (delta_ref->sb) {
+			delta_ref_exit(delta_ref);
+			delta_ref->sb = NULL;
+		}
+	}
+}
+
+static int init_delta_refs(struct sb *sb)
+{
+	int i, err;
+
+	/*
+	 * setup_sb() or load_sb() can be called again without
+	 * put_super() (e.g. failed mount), so release previous ones.
+	 */
+	exit_delta_refs(sb);
+
+	for (i = 0; i < ARRAY_SIZE(sb->delta_refs); i++) {
+		struct delta_ref *delta_ref = &sb->delta_refs[i];
+
+		err = delta_ref_init(delta_ref);
+		if (err) {
+			exit_delta_refs(sb);
+			return err;
+		}
+		delta_ref->sb = sb;
+	}
+
+	return 0;
+}
+
+/* Initialize the lock and list */
+static int init_sb(struct sb *sb)
+{
+	int i, err;
+
 	/* Initialize sb */
-	for (i = 0; i < ARRAY_SIZE(sb->delta_refs); i++)
-		atomic_set(&sb->delta_refs[0].refcount, 0);
+	err = init_delta_refs(sb);
+	if (err)
+		return err;
 
 #if TUX3_FLUSHER == TUX3_FLUSHER_SYNC
 	init_rwsem(&sb->delta_lock);
+#endif
+#if TUX3_FLUSHER == TUX3_FLUSHER_ASYNC_OWN && !defined(__KERNEL__)
+	pthread_mutex_init(&sb->frontend_lock, NULL);
 #endif
 	init_waitqueue_head(&sb->delta_event_wq);
 	INIT_LIST_HEAD(&sb->orphan_add);
 	INIT_LIST_HEAD(&sb->orphan_del);
 	stash_init(&sb->defree);
 	stash_init(&sb->deunify);
+	stash_init(&sb->decommit);
 	INIT_LIST_HEAD(&sb->unify_buffers);
+	sb->commit_inflight = 0;
 
 	INIT_LIST_HEAD(&sb->alloc_inodes);
+	inum_map_init(&sb->inum_map);
 	spin_lock_init(&sb->countmap_lock);
 	spin_lock_init(&sb->forked_buffers_lock);
 	init_link_circular(&sb->forked_buffers);
 	spin_lock_init(&sb->dirty_inodes_lock);
 
 	/* Initialize sb_delta_dirty */
-	for (i = 0; i < ARRAY_SIZE(sb->s_ddc); i++)
+	for (i = 0; i < ARRAY_SIZE(sb->s_ddc); i++) {
 		INIT_LIST_HEAD(&sb->s_ddc[i].dirty_inodes);
+		sb->s_ddc[i].nr_inodes = 0;
+		atomic_set(&sb->s_ddc[i].nr_blocks, 0);
+		atomic_set(&sb->s_ddc[i].nr_fsync, 0);
+		atomic_set(&sb->s_ddc[i].nr_sync, 0);
+	}
+
+	init_sched(&sb->sched);
+	init_commit_recorder(sb);
+
+	return 0;
 }
 
 static void setup_roots(struct sb *sb, struct disksuper *super)
@@ -108,8 +439,9 @@ static void __setup_sb(struct sb *sb, struct disksuper *super)
 	      sb->volblocks, sb->freeblocks, sb->freeinodes, sb->nextblock);
 	trace("atom_dictsize %Lu, freeatom %u, atomgen %u",
 	      (s64)sb->atomdictsize, sb->freeatom, sb->atomgen);
-	trace("logchain %Lu, logcount %u",
-	      be64_to_cpu(super->logchain), be32_to_cpu(super->logcount));
+	trace("logchain %Lu (contig %u), logcount %u",
+	      logchain_block(super->logchain), logchain_count(super->logchain),
+	      be32_to_cpu(super->logcount));
 
 	setup_roots(sb, super);
 }
@@ -117,7 +449,8 @@ static void __setup_sb(struct sb *sb, struct disksuper *super)
 /* Initialize and setup sb by on-disk super block */
 void setup_sb(struct sb *sb, struct disksuper *super)
 {
-	init_sb(sb);
+	int err = init_sb(sb);
+	assert(!err);	/* userland init_sb() never fails */
 	__setup_sb(sb, super);
 }
 
@@ -128,7 +461,9 @@ int load_sb(struct sb *sb)
 	int err;
 
 	/* At least initialize sb, even if load is failed */
-	init_sb(sb);
+	err = init_sb(sb);
+	if (err)
+		return err;
 
 	err = devio(READ, sb_dev(sb), SB_LOC, super, SB_LEN);
 	if (err)
@@ -141,7 +476,8 @@ int load_sb(struct sb *sb)
 	return 0;
 }
 
-int save_sb(struct sb *sb)
+/* Update on-disk super block image by sb */
+static void update_disksuper(struct sb *sb)
 {
 	struct disksuper *super = &sb->super;
 
@@ -156,8 +492,13 @@ int save_sb(struct sb *sb)
 	super->freeatom = cpu_to_be32(sb->freeatom);
 	super->atomgen = cpu_to_be32(sb->atomgen);
 	/* logchain and logcount are written to super directly */
+}
 
-	return devio(WRITE_SYNC | REQ_META, sb_dev(sb), SB_LOC, super, SB_LEN);
+int save_sb(struct sb *sb)
+{
+	update_disksuper(sb);
+	return devio(WRITE_SYNC | REQ_META, sb_dev(sb), SB_LOC, &sb->super,
+		     SB_LEN);
 }
 
 /* Delta transition */
@@ -233,8 +574,10 @@ static int unify_log(struct sb *sb)
 	/*
 	 * Re-logging defered bfree blocks after unify as defered
 	 * bfree (LOG_BFREE_RELOG) after delta.  With this, we can
-	 * obsolete log records on previous unify.
+	 * obsolete log records on previous unify. Sorted order makes
+	 * batched log records small.
 	 */
+	sort_defer_bfree(&sb->deunify);
 	unstash(sb, &sb->deunify, relog_as_bfree);
 
 	/*
@@ -338,25 +681,91 @@ static int write_log(struct sb *sb)
 {
 	/* Finish to logging in this delta */
 	log_finish(sb);
+	sb->commit_counters.logblocks += sb->lognext;
 	log_finish_cycle(sb, 0);
 
 	return tux3_flush_inode_internal(sb->logmap, TUX3_INIT_DELTA, REQ_META);
 }
 
-static int apply_defered_bfree(struct sb *sb, u64 val)
+/*
+ * Pipelined commit block
+ *
+ * The commit block is submitted after all I/O of delta was done, but
+ * if nobody is waiting the delta for data integrity, backend doesn't
+ * wait it. So the next delta can be staged and written while the
+ * commit block is in flight.
+ *
+ * The in-flight commit block is waited before anything depending on
+ * it, i.e. before unify (obsoletes the log of previous delta), and
+ * before the next commit block. The defered bfree of the delta is
+ * moved to ->decommit, and applied only after the commit block was
+ * completed.
+ */
+static int wait_commit_block(struct sb *sb)
 {
-	return bfree(sb, val & ~(-1ULL << 48), val >> 48);
+	if (!sb->commit_inflight)
+		return 0;
+	sb->commit_inflight = 0;
+
+	tux3_iowait_wait(&sb->commit_iowait);
+	if (sb->commit_iowait.err)
+		return sb->commit_iowait.err; /* FIXME: error handling */
+
+	/* Commit was finished, apply defered bfree. */
+	return apply_defer_bfree(sb, &sb->decommit);
 }
 
-static int commit_delta(struct sb *sb)
+static int commit_delta(struct sb *sb, int sync)
 {
-	trace("commit %i logblocks", be32_to_cpu(sb->super.logcount));
-	int err = save_sb(sb);
+	struct stash defree;
+	int err;
+
+	trace("commit %i logblocks, sync %d",
+	      be32_to_cpu(sb->super.logcount), sync);
+
+	/* Previous commit block must be written before this */
+	err = wait_commit_block(sb);
 	if (err)
 		return err;
 
-	/* Commit was finished, apply defered bfree. */
-	return unstash(sb, &sb->defree, apply_defered_bfree);
+	/* Next delta can change sb->super while commit block is in flight */
+	update_disksuper(sb);
+	sb->commit_super = sb->super;
+
+	/* Defered bfree of this delta waits this commit block */
+	defree = sb->decommit;
+	sb->decommit = sb->defree;
+	sb->defree = defree;
+
+	/* Flush delta blocks to media before commit block */
+	tux3_iowait_init(&sb->commit_iowait);
+	sb->commit_inflight = 1;
+	/*
+	 * The commit block is written from the snapshot, and no delta
+	 * transition can happen until this delta finished. So frontend
+	 * can run while the (synchronous in userland) write is going.
+	 */
+	tux3_flusher_unlock(sb);
+	tux3_devio_async(WRITE_FLUSH_FUA | REQ_META, sb, SB_LOC,
+			 &sb->commit_super, SB_LEN, &sb->commit_iowait);
+	tux3_flusher_lock(sb);
+
+	if (sync)
+		return wait_commit_block(sb);
+	return 0;
+}
+
+/* Wait in-flight commit block I/O at umount */
+void tux3_exit_commit(struct sb *sb)
+{
+	if (sb->commit_inflight) {
+		sb->commit_inflight = 0;
+		tux3_iowait_wait(&sb->commit_iowait);
+	}
+	/* Freed blocks are in log of committed delta, so just discard */
+	destroy_defer_bfree(&sb->decommit);
+
+	exit_delta_refs(sb);
 }
 
 static void post_commit(struct sb *sb, unsigned delta)
@@ -370,12 +779,6 @@ static void post_commit(struct sb *sb, unsigned delta)
 	tux3_clear_dirty_inodes(sb, delta);
 }
 
-static int need_unify(struct sb *sb)
-{
-	static unsigned crudehack;
-	return !(++crudehack % 3);
-}
-
 enum unify_flags { NO_UNIFY, ALLOW_UNIFY, FORCE_UNIFY, };
 
 /* For debugging */
@@ -400,10 +803,13 @@ int tux3_under_backend(struct sb *sb)
 static int do_commit(struct sb *sb, enum unify_flags unify_flag)
 {
 	unsigned delta = sb->marshal_delta;
+	struct commit_record rec;
 	struct iowait iowait;
-	int err = 0;
+	int sync, err = 0;
+	u64 time;
 
 	trace(">>>>>>>>> commit delta %u", delta);
+	commit_record_start(sb, &rec, delta, &time);
 	/* further changes of frontend belong to the next delta */
 	tux3_start_backend(sb);
 
@@ -427,34 +833,46 @@ static int do_commit(struct sb *sb, enum unify_flags unify_flag)
 	 *   still dirty, but parent was already cleaned.)
 	 */
 	err = stage_delta(sb, delta);
+	commit_record_phase(&rec, COMMIT_PHASE_STAGE, &time);
 	if (err)
 		goto error; /* FIXME: error handling */
 
 	if ((unify_flag == ALLOW_UNIFY && need_unify(sb)) ||
 	    unify_flag == FORCE_UNIFY) {
+		/* Unify obsoletes previous log, so it must be committed */
+		err = wait_commit_block(sb);
+		if (err)
+			goto error; /* FIXME: error handling */
+
 		err = unify_log(sb);
 		if (err)
 			goto error; /* FIXME: error handling */
 
 		/* Add delta log for debugging. */
 		log_delta(sb);
+
+		rec.flags |= COMMIT_RECORD_UNIFY;
+		commit_record_phase(&rec, COMMIT_PHASE_UNIFY, &time);
 	}
 
 	write_btree(sb, delta);
+	commit_record_phase(&rec, COMMIT_PHASE_BTREE, &time);
 	write_log(sb);
+	commit_record_phase(&rec, COMMIT_PHASE_LOG, &time);
 
 	/* Wait I/O was submitted */
 	tux3_iowait_wait(&iowait);
+	commit_record_phase(&rec, COMMIT_PHASE_IOWAIT, &time);
 
 	/*
-	 * Commit last block (for now, this is sync I/O).
-	 *
-	 * FIXME: If this is not data integrity write, we don't have
-	 * to wait the commit block. The commit block just have to
-	 * written before next block block. (But defree must be after
-	 * commit block.)
+	 * Commit last block. If this is not data integrity write, we
+	 * don't wait the commit block (see wait_commit_block()).
 	 */
-	commit_delta(sb);
+	sync = atomic_read(&tux3_sb_ddc(sb, delta)->nr_sync) > 0;
+	if (sync)
+		rec.flags |= COMMIT_RECORD_SYNC;
+	commit_delta(sb, sync);
+	commit_record_phase(&rec, COMMIT_PHASE_COMMIT, &time);
 error:
 	/* FIXME: what to do if error? */
 	tux3_end_backend();
@@ -462,6 +880,8 @@ error:
 
 	post_commit(sb, delta);
 	trace("<<<<<<<<< post commit done %u", delta);
+	commit_record_phase(&rec, COMMIT_PHASE_POST, &time);
+	commit_record_end(sb, &rec, err);
 
 	return err;
 }
@@ -473,6 +893,7 @@ error:
 static int flush_delta(struct sb *sb)
 {
 	unsigned delta = sb->marshal_delta;
+	u64 start;
 	int err;
 #ifndef UNIFY_DEBUG
 	enum unify_flags unify_flag = ALLOW_UNIFY;
@@ -482,7 +903,16 @@ static int flush_delta(struct sb *sb)
 	sb->pending_delta = NULL;
 #endif
 
+	start = tux3_time_usecs();
 	err = do_commit(sb, unify_flag);
+	sched_commit_time(sb, tux3_time_usecs() - start);
+
+	/*
+	 * Remember the number of fsync callers served by this commit,
+	 * before waking up those. After that, the slot of this delta
+	 * can be reused for new delta.
+	 */
+	sb->sched.fsync_group = atomic_read(&tux3_sb_ddc(sb, delta)->nr_fsync);
 
 	sb->committed_delta = delta;
 	clear_bit(TUX3_COMMIT_RUNNING_BIT, &sb->backend_state);
@@ -502,17 +932,17 @@ static struct delta_ref *delta_get(struct sb *sb)
 {
 	struct delta_ref *delta_ref;
 	/*
-	 * Try to grab reference. If failed, retry.
+	 * Try to grab reference. If delta was killed by transition,
+	 * retry with new current delta.
 	 *
 	 * memory barrier pairs with __delta_transition(). But we never
 	 * free ->current_delta, so we don't need rcu_read_lock().
 	 */
 	do {
 		delta_ref = rcu_dereference_check(sb->current_delta, 1);
-	} while (!atomic_inc_not_zero(&delta_ref->refcount));
+	} while (!delta_ref_tryget(delta_ref));
 
-	trace("delta %u, refcount %u",
-	      delta_ref->delta, atomic_read(&delta_ref->refcount));
+	trace("delta %u", delta_ref->delta);
 
 	return delta_ref;
 }
@@ -520,24 +950,38 @@ static struct delta_ref *delta_get(struct sb *sb)
 /* Release the reference of delta */
 static void delta_put(struct sb *sb, struct delta_ref *delta_ref)
 {
-	if (atomic_dec_and_test(&delta_ref->refcount)) {
-		trace("set TUX3_COMMIT_PENDING_BIT");
-		set_bit(TUX3_COMMIT_PENDING_BIT, &sb->backend_state);
-		schedule_flush_delta(sb);
-	}
+	trace("delta %u", delta_ref->delta);
+	tux3_assert_frontend_locked(sb);
+	delta_ref_put(delta_ref);
+}
+
+/* Called when the last reference of killed delta was released */
+static void delta_release(struct delta_ref *delta_ref)
+{
+	struct sb *sb = delta_ref->sb;
 
-	trace("delta %u, refcount %u",
-	      delta_ref->delta, atomic_read(&delta_ref->refcount));
+	trace("set TUX3_COMMIT_PENDING_BIT");
+	set_bit(TUX3_COMMIT_PENDING_BIT, &sb->backend_state);
+	schedule_flush_delta(sb);
 }
 
 /* Update current delta */
 static void __delta_transition(struct sb *sb, struct delta_ref *delta_ref)
 {
+	struct sb_delta_dirty *s_ddc;
+
 	/* Set the initial refcount is released by try_delta_transition(). */
-	assert(atomic_read(&delta_ref->refcount) == 0);
-	atomic_set(&delta_ref->refcount, 1);
+	assert(delta_ref_is_zero(delta_ref));
+	delta_ref_reinit(delta_ref);
 	/* Assign the delta number */
 	delta_ref->delta = sb->next_delta++;
+	/* Start to count dirty objects for new delta */
+	s_ddc = tux3_sb_ddc(sb, delta_ref->delta);
+	s_ddc->nr_inodes = 0;
+	atomic_set(&s_ddc->nr_blocks, 0);
+	atomic_set(&s_ddc->nr_fsync, 0);
+	atomic_set(&s_ddc->nr_sync, 0);
+	sb->sched.delta_start = tux3_time_usecs();
 #ifdef UNIFY_DEBUG
 	delta_ref->unify_flag = ALLOW_UNIFY;
 #endif
@@ -579,8 +1023,12 @@ static void delta_transition(struct sb *sb)
 	sb->pending_delta = prev;
 #endif
 
-	/* Release initial refcount after updated the current delta. */
-	delta_put(sb, prev);
+	/*
+	 * Release initial refcount after updated the current delta.
+	 * This also stops new references of prev.
+	 */
+	tux3_assert_frontend_locked(sb);
+	delta_ref_kill(prev);
 
 	trace("prev %u, next %u", prev->delta, delta_ref->delta);
 
@@ -611,6 +1059,12 @@ int force_delta(struct sb *sb)
 	return sync_current_delta(sb, NO_UNIFY);
 }
 
+/* Sync for fsync(2), this is coalesced with other fsync callers */
+int fsync_delta(struct sb *sb)
+{
+	return sync_delta_group(sb);
+}
+
 unsigned tux3_get_current_delta(void)
 {
 	struct delta_ref *delta_ref = current->journal_info;
@@ -686,12 +1140,6 @@ void change_end_atomic_nested(struct sb *sb, void *ptr)
 	current->journal_info = ptr;
 }
 
-static int need_delta(struct sb *sb)
-{
-	static unsigned crudehack;
-	return !(++crudehack % 10);
-}
-
 /*
  * Normal version of change_begin/end. If there is no special
  * requirement, we should use this version.
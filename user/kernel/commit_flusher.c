@@ -10,6 +10,7 @@ static void __tux3_init_flusher(struct sb *sb)
 }
 
 #if TUX3_FLUSHER == TUX3_FLUSHER_ASYNC_OWN
+#ifdef __KERNEL__
 static int flush_delta_work(void *data)
 {
 	struct sb *sb = data;
@@ -73,6 +74,140 @@ static void schedule_flush_delta(struct sb *sb)
 	wake_up_process(sb->flush_task);
 }
 
+#else /* !__KERNEL__ */
+/*
+ * Userland flusher thread.
+ *
+ * Userland buffer cache and inode cache are not thread safe. So the
+ * frontend holds sb->frontend_lock while it is using filesystem, and
+ * the flusher runs backend only with holding it. The frontend
+ * releases it while idle (e.g. tux3fuse is waiting next request) or
+ * waiting backend, so the delta N is written while frontend returns
+ * to the caller and can go on to the delta N+1.
+ *
+ * The flusher holds it only while backend touches the state shared
+ * with frontend (buffers, inodes, logs). After the delta was staged
+ * and written, the commit block is written from the snapshot in
+ * ->commit_super, so the flusher releases it around that I/O (see
+ * tux3_flusher_unlock()).
+ */
+
+enum { FLUSHER_NONE, FLUSHER_RUNNING, FLUSHER_STOP, };
+
+static int flush_pending_delta(struct sb *sb);
+
+static void *flush_delta_work(void *data)
+{
+	struct sb *sb = data;
+
+	while (1) {
+		wait_event(sb->delta_event_wq,
+			   test_bit(TUX3_COMMIT_PENDING_BIT, &sb->backend_state) ||
+			   sb->flush_state == FLUSHER_STOP);
+
+		if (!test_bit(TUX3_COMMIT_PENDING_BIT, &sb->backend_state))
+			break;
+
+		pthread_mutex_lock(&sb->frontend_lock);
+		/* FIXME: error handling */
+		flush_pending_delta(sb);
+		pthread_mutex_unlock(&sb->frontend_lock);
+	}
+
+	return NULL;
+}
+
+/* Initialize flusher, and the caller (frontend) owns sb->frontend_lock */
+int tux3_init_flusher(struct sb *sb)
+{
+	int err;
+
+	__tux3_init_flusher(sb);
+
+	pthread_mutex_lock(&sb->frontend_lock);
+	sb->flush_state = FLUSHER_RUNNING;
+	err = pthread_create(&sb->flush_thread, NULL, flush_delta_work, sb);
+	if (err) {
+		sb->flush_state = FLUSHER_NONE;
+		pthread_mutex_unlock(&sb->frontend_lock);
+		return -err;
+	}
+
+	return 0;
+}
+
+/* Stop flusher, and the caller (frontend) releases sb->frontend_lock */
+void tux3_exit_flusher(struct sb *sb)
+{
+	if (sb->flush_state != FLUSHER_RUNNING)
+		return;
+
+	sb->flush_state = FLUSHER_STOP;
+	wake_up_all(&sb->delta_event_wq);
+	pthread_mutex_unlock(&sb->frontend_lock);
+
+	pthread_join(sb->flush_thread, NULL);
+	sb->flush_state = FLUSHER_NONE;
+}
+
+/* Frontend is going to use filesystem */
+void tux3_frontend_lock(struct sb *sb)
+{
+	if (sb->flush_state == FLUSHER_RUNNING)
+		pthread_mutex_lock(&sb->frontend_lock);
+}
+
+/* Frontend is idle, give filesystem to flusher */
+void tux3_frontend_unlock(struct sb *sb)
+{
+	if (sb->flush_state == FLUSHER_RUNNING)
+		pthread_mutex_unlock(&sb->frontend_lock);
+}
+
+/*
+ * Check sb->frontend_lock is held while flusher is running. Userland
+ * percpu_ref has no RCU, so percpu_ref_put() and percpu_ref_kill()
+ * must be serialized by this lock.
+ */
+void tux3_assert_frontend_locked(struct sb *sb)
+{
+#ifdef LOCK_DEBUG
+	if (sb->flush_state == FLUSHER_RUNNING) {
+		int err = pthread_mutex_trylock(&sb->frontend_lock);
+		if (!err)
+			pthread_mutex_unlock(&sb->frontend_lock);
+		assert(err == EBUSY);
+	}
+#endif
+}
+
+/*
+ * Backend is doing I/O which doesn't touch frontend-shared state, let
+ * frontend run. This is only for the flusher thread, the frontend
+ * running backend by itself (no flusher) keeps the lock.
+ */
+void tux3_flusher_unlock(struct sb *sb)
+{
+	if (sb->flush_state != FLUSHER_NONE &&
+	    pthread_equal(pthread_self(), sb->flush_thread))
+		pthread_mutex_unlock(&sb->frontend_lock);
+}
+
+/* Backend is going to touch frontend-shared state again */
+void tux3_flusher_lock(struct sb *sb)
+{
+	if (sb->flush_state != FLUSHER_NONE &&
+	    pthread_equal(pthread_self(), sb->flush_thread))
+		pthread_mutex_lock(&sb->frontend_lock);
+}
+
+static void schedule_flush_delta(struct sb *sb)
+{
+	/* Wake up the flusher, and waiters for pending marshal delta */
+	wake_up_all(&sb->delta_event_wq);
+}
+#endif /* !__KERNEL__ */
+
 #else /* TUX3_FLUSHER != TUX3_FLUSHER_ASYNC_OWN */
 
 int tux3_init_flusher(struct sb *sb)
@@ -90,7 +225,9 @@ static void schedule_flush_delta(struct sb *sb)
 	/* Wake up waiters for pending marshal delta */
 	wake_up_all(&sb->delta_event_wq);
 }
+#endif /* TUX3_FLUSHER != TUX3_FLUSHER_ASYNC_OWN */
 
+#if TUX3_FLUSHER != TUX3_FLUSHER_ASYNC_OWN || !defined(__KERNEL__)
 static int flush_pending_delta(struct sb *sb)
 {
 	int err = 0;
@@ -103,7 +240,7 @@ static int flush_pending_delta(struct sb *sb)
 out:
 	return err;
 }
-#endif /* TUX3_FLUSHER != TUX3_FLUSHER_ASYNC_OWN */
+#endif
 
 /* Try delta transition */
 static void try_delta_transition(struct sb *sb)
@@ -137,11 +274,41 @@ static int try_delta_transition_until_delta(struct sb *sb, unsigned delta)
 	return delta_after_eq(sb->marshal_delta, delta);
 }
 
+#if TUX3_FLUSHER == TUX3_FLUSHER_ASYNC_OWN && !defined(__KERNEL__)
+/*
+ * Wait for backend with releasing sb->frontend_lock. If there is no
+ * flusher thread (e.g. mkfs), run the pending delta by ourself.
+ */
+static int wait_for_backend(struct sb *sb, unsigned delta,
+			    int (*cond)(struct sb *, unsigned))
+{
+	while (1) {
+		unsigned long seq = wait_queue_seq(&sb->delta_event_wq);
+
+		if (cond(sb, delta))
+			break;
+
+		if (sb->flush_state != FLUSHER_RUNNING) {
+			flush_pending_delta(sb);
+			continue;
+		}
+
+		pthread_mutex_unlock(&sb->frontend_lock);
+		wait_queue_sleep(&sb->delta_event_wq, seq);
+		pthread_mutex_lock(&sb->frontend_lock);
+	}
+
+	return 0;
+}
+#else
+#define wait_for_backend(sb, delta, cond)			\
+	wait_event_killable((sb)->delta_event_wq, cond(sb, delta))
+#endif
+
 /* Advance delta transition until specified delta */
 static int wait_for_transition(struct sb *sb, unsigned delta)
 {
-	return wait_event_killable(sb->delta_event_wq,
-				   try_delta_transition_until_delta(sb, delta));
+	return wait_for_backend(sb, delta, try_delta_transition_until_delta);
 }
 
 static int try_flush_pending_until_delta(struct sb *sb, unsigned delta)
@@ -159,8 +326,7 @@ static int try_flush_pending_until_delta(struct sb *sb, unsigned delta)
 
 static int wait_for_commit(struct sb *sb, unsigned delta)
 {
-	return wait_event_killable(sb->delta_event_wq,
-				   try_flush_pending_until_delta(sb, delta));
+	return wait_for_backend(sb, delta, try_flush_pending_until_delta);
 }
 
 static int sync_current_delta(struct sb *sb, enum unify_flags unify_flag)
@@ -178,6 +344,8 @@ static int sync_current_delta(struct sb *sb, enum unify_flags unify_flag)
 	delta_ref->unify_flag = unify_flag;
 #endif
 	delta = delta_ref->delta;
+	/* Tell backend to wait the commit block of this delta */
+	atomic_inc(&tux3_sb_ddc(sb, delta)->nr_sync);
 	delta_put(sb, delta_ref);
 
 	trace("delta %u", delta);
@@ -197,4 +365,57 @@ static int sync_current_delta(struct sb *sb, enum unify_flags unify_flag)
 
 	return err;
 }
+
+/* Sleep to gather other fsync callers into current delta */
+static void fsync_gather(struct sb *sb, unsigned usecs)
+{
+#ifdef __KERNEL__
+	usleep_range(usecs, usecs + usecs / 4);
+#else
+	tux3_frontend_unlock(sb);
+	usleep(usecs);
+	tux3_frontend_lock(sb);
+#endif
+}
+
+/*
+ * Group commit for fsync(2).
+ *
+ * If current delta has no change and all previous deltas were
+ * committed (and the commit block is not in flight), there is nothing
+ * to sync. Otherwise, callers arrived
+ * while commit is running are coalesced into the next delta by
+ * sync_current_delta(), and woken up by one commit.
+ *
+ * If last commit served several fsync callers, there are concurrent
+ * callers. In this case, wait a bit (not longer than the average
+ * commit latency) before delta transition to gather more callers.
+ */
+static int sync_delta_group(struct sb *sb)
+{
+	struct tux3_sched *sched = &sb->sched;
+	struct sb_delta_dirty *s_ddc;
+	struct delta_ref *delta_ref;
+	unsigned delta, window;
+
+	delta_ref = delta_get(sb);
+	delta = delta_ref->delta;
+	s_ddc = tux3_sb_ddc(sb, delta);
+	if (!atomic_read(&s_ddc->nr_blocks) && !s_ddc->nr_inodes &&
+	    delta_after_eq(sb->committed_delta, delta - 1) &&
+	    !sb->commit_inflight) {
+		delta_put(sb, delta_ref);
+		return 0;
+	}
+	atomic_inc(&s_ddc->nr_fsync);
+	delta_put(sb, delta_ref);
+
+	window = min(sched->fsync_window_usecs, sched->commit_usecs);
+	if (window && sched->fsync_group > 1 &&
+	    !test_bit(TUX3_COMMIT_RUNNING_BIT, &sb->backend_state))
+		fsync_gather(sb, window);
+
+	/* flush_delta() records the number of callers to fsync_group */
+	return sync_current_delta(sb, NO_UNIFY);
+}
 #endif /* TUX3_FLUSHER == TUX3_FLUSHER_ASYNC_HACK */
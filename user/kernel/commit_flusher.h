@@ -19,4 +19,23 @@ static inline void tux3_start_periodical_flusher(struct sb *sb) { }
 int tux3_init_flusher(struct sb *sb);
 void tux3_exit_flusher(struct sb *sb);
 
+#if TUX3_FLUSHER == TUX3_FLUSHER_ASYNC_OWN && !defined(__KERNEL__)
+void tux3_frontend_lock(struct sb *sb);
+void tux3_frontend_unlock(struct sb *sb);
+void tux3_assert_frontend_locked(struct sb *sb);
+void tux3_flusher_unlock(struct sb *sb);
+void tux3_flusher_lock(struct sb *sb);
+#else
+/*
+ * No flusher thread. The kernel has real RCU for percpu_ref, and the
+ * userland SYNC flusher runs backend in the frontend thread (from
+ * change_end()), so there is no other thread to serialize with.
+ */
+static inline void tux3_frontend_lock(struct sb *sb) { }
+static inline void tux3_frontend_unlock(struct sb *sb) { }
+static inline void tux3_assert_frontend_locked(struct sb *sb) { }
+static inline void tux3_flusher_unlock(struct sb *sb) { }
+static inline void tux3_flusher_lock(struct sb *sb) { }
+#endif
+
 #endif /* !TUX3_COMMIT_FLUSHER_H */
@@ -85,6 +85,9 @@ static long tux3_wb_writeback(struct bdi_writeback *wb,
 	delta_ref->unify_flag = ALLOW_UNIFY;
 #endif
 	delta = delta_ref->delta;
+	/* Data integrity writeback waits the commit block */
+	if (work->sync_mode == WB_SYNC_ALL)
+		atomic_inc(&tux3_sb_ddc(sb, delta)->nr_sync);
 	delta_put(sb, delta_ref);
 
 	/* Make sure the delta transition was done for current delta */
@@ -608,4 +611,10 @@ static int sync_current_delta(struct sb *sb, enum unify_flags unify_flag)
 	up_read(&vfs_sb(sb)->s_umount);
 	return 0;	/* FIXME: error code */
 }
+
+static int sync_delta_group(struct sb *sb)
+{
+	/* Kernel writeback does grouping of sync requests */
+	return sync_current_delta(sb, NO_UNIFY);
+}
 #endif /* TUX3_FLUSHER != TUX3_FLUSHER_ASYNC_HACK */
@@ -66,11 +66,53 @@ static inline int tux_match(tux_dirent *entry, const char *const name,
 	return !memcmp(name, entry->name, len);
 }
 
+/* Hash of name for in-memory indexes */
+u32 tux_name_hash(const char *name, unsigned len)
+{
+	u32 hash = 0x811c9dc5;		/* FNV-1a */
+
+	while (len--) {
+		hash ^= (unsigned char)*name++;
+		hash *= 0x01000193;
+	}
+	return hash;
+}
+
 static inline tux_dirent *next_entry(tux_dirent *entry)
 {
 	return (void *)entry + tux_rec_len_from_disk(entry->rec_len);
 }
 
+static inline int is_dot_name(const char *name, unsigned len)
+{
+	return (len == 1 && name[0] == '.') ||
+		(len == 2 && name[0] == '.' && name[1] == '.');
+}
+
+/*
+ * Whether the entry is counted as live. ".." is not counted, and "."
+ * is not counted if it points to dir itself.
+ */
+static int tux_dir_counted(struct inode *dir, const char *name, unsigned len,
+			   inum_t inum)
+{
+	if (!is_dot_name(name, len))
+		return 1;
+	/* "." has to point self */
+	return len == 1 && inum != tux_inode(dir)->inum;
+}
+
+/* Update the number of live entries, if it was counted */
+static void tux_dir_count(struct inode *dir, int diff)
+{
+	struct tux3_inode *tuxnode = tux_inode(dir);
+
+	if (tuxnode->dir_entries >= 0) {
+		tuxnode->dir_entries += diff;
+		assert(tuxnode->dir_entries >= 0);
+	}
+}
+
 enum {
 	TUX_UNKNOWN,
 	TUX_REG,
@@ -100,6 +142,8 @@ static unsigned char tux_type_by_mode[S_IFMT >> STAT_SHIFT] = {
 		      "zero length entry at inum %Lu, block %Lu",	\
 		      tux_inode(dir)->inum, block)
 
+#include "dir_index.c"
+
 void tux_set_entry(struct buffer_head *buffer, tux_dirent *entry,
 		   inum_t inum, umode_t mode)
 {
@@ -133,10 +177,18 @@ loff_t tux_alloc_entry(struct inode *dir, const char *name, unsigned len,
 	unsigned reclen = TUX_REC_LEN(len), rec_len, offset;
 	unsigned uninitialized_var(name_len);
 	unsigned blocksize = sb->blocksize;
-	block_t block, blocks = *size >> sb->blockbits;
+	block_t block = 0, blocks = *size >> sb->blockbits;
+	struct dir_index *index;
 	void *olddata;
 
-	for (block = 0; block < blocks; block++) {
+	/* Start from the block which has space, if we have space map */
+	index = dir_index_get(dir, *size);
+	if (index) {
+		u32 found = dir_space_find(index, reclen);
+		block = found == DIR_INDEX_END ? blocks : found;
+	}
+
+	for (; block < blocks; block++) {
 		buffer = blockread(mapping(dir), block);
 		if (!buffer)
 			return -EIO;
@@ -157,6 +209,11 @@ loff_t tux_alloc_entry(struct inode *dir, const char *name, unsigned len,
 			entry = (void *)entry + rec_len;
 		}
 		blockput(buffer);
+		/* Space map says no other blocks have space */
+		if (index) {
+			block = blocks;
+			break;
+		}
 	}
 	entry = NULL;
 	buffer = blockget(mapping(dir), block);
@@ -197,6 +254,8 @@ create:
 	entry->name_len = len;
 	memcpy(entry->name, name, len);
 	offset = (void *)entry - bufdata(clone);
+	dir_index_insert(dir, name, len, block);
+	dir_space_update(dir, block, bufdata(clone));
 
 	*hold = clone;
 	return (block << sb->blockbits) + offset; /* only for xattr create */
@@ -229,7 +288,7 @@ int tux_create_dirent(struct inode *dir, const struct qstr *qstr,
 
 		int is_dir = S_ISDIR(inode->i_mode);
 		unsigned factor = is_dir ? dir_factor : file_factor;
-		inum_t next = sb->nextinum; /* FIXME: racy */
+		inum_t next = ACCESS_ONCE(sb->nextinum); /* only a hint */
 		inum_t base = max(tux_inode(dir)->inum + 1, (inum_t)TUX_NORMAL_INO);
 		inum_t guess = base + ((factor * where) >> sb->blockbits);
 		inum_t goal = (is_dir || abs64(next - guess) > cluster) ? guess : next;
@@ -239,9 +298,10 @@ int tux_create_dirent(struct inode *dir, const struct qstr *qstr,
 		if (err)
 			goto error;
 		inum = tux_inode(inode)->inum;
-		sb->nextinum = inum + 1; /* FIXME: racy */
 	}
 
+	if (tux_dir_counted(dir, name, len, inum))
+		tux_dir_count(dir, 1);
 	/* This releases buffer */
 	tux_set_entry(buffer, entry, inum, inode->i_mode);
 
@@ -268,8 +328,17 @@ tux_dirent *tux_find_entry(struct inode *dir, const char *name, unsigned len,
 	struct sb *sb = tux_sb(dir->i_sb);
 	unsigned reclen = TUX_REC_LEN(len);
 	block_t block, blocks = size >> sb->blockbits;
+	struct dir_index *index;
 	int err = -ENOENT;
 
+	index = dir_index_get(dir, size);
+	if (index) {
+		tux_dirent *entry = dir_index_find(dir, index, name, len, result);
+		if (IS_ERR(entry))
+			*result = NULL;	/* for debug */
+		return entry;
+	}
+
 	for (block = 0; block < blocks; block++) {
 		struct buffer_head *buffer = blockread(mapping(dir), block);
 		if (!buffer) {
@@ -326,10 +395,29 @@ int tux_readdir(struct file *file, void *state, filldir_t filldir)
 	unsigned blockbits = sb->blockbits;
 	block_t block, blocks = dir->i_size >> blockbits;
 	unsigned offset = pos & sb->blockmask;
+	struct dir_index *index;
 
 	assert(!(dir->i_size & sb->blockmask));
 
+	/*
+	 * Use the index only if it is cached. Building it reads the
+	 * whole directory, which is what skipping empty blocks avoids.
+	 */
+	index = tux_inode(dir)->dir_index;
+
 	for (block = pos >> blockbits ; block < blocks; block++) {
+		if (index) {
+			/* Skip empty blocks without reading */
+			block_t live = dir_space_next_live(index, block);
+			if (live != block) {
+				block = min(live, blocks);
+				offset = 0;
+				file->f_pos = block << blockbits;
+				if (block == blocks)
+					break;
+			}
+		}
+
 		struct buffer_head *buffer = blockread(mapping(dir), block);
 		if (!buffer)
 			return -EIO;
@@ -404,11 +492,13 @@ int tux_delete_entry(struct inode *dir, struct buffer_head *buffer,
 	entry = ptr_redirect(entry, olddata, bufdata(clone));
 	prev = ptr_redirect(prev, olddata, bufdata(clone));
 
+	dir_index_remove(dir, entry->name, entry->name_len, bufindex(clone));
 	if (prev)
 		prev->rec_len = tux_rec_len_to_disk((void *)next_entry(entry) - (void *)prev);
 	memset(entry->name, 0, entry->name_len);
 	entry->name_len = entry->type = 0;
 	entry->inum = 0;
+	dir_space_update(dir, bufindex(clone), bufdata(clone));
 
 	mark_buffer_dirty_non(clone);
 	blockput(clone);
@@ -419,10 +509,14 @@ int tux_delete_entry(struct inode *dir, struct buffer_head *buffer,
 int tux_delete_dirent(struct inode *dir, struct buffer_head *buffer,
 		      tux_dirent *entry)
 {
-	int err;
+	int counted, err;
 
+	counted = tux_dir_counted(dir, entry->name, entry->name_len,
+				  be64_to_cpu(entry->inum));
 	err = tux_delete_entry(dir, buffer, entry); /* this releases buffer */
 	if (!err) {
+		if (counted)
+			tux_dir_count(dir, -1);
 		tux3_iattrdirty(dir);
 		dir->i_ctime = dir->i_mtime = gettime();
 		tux3_mark_inode_dirty(dir);
@@ -431,12 +525,13 @@ int tux_delete_dirent(struct inode *dir, struct buffer_head *buffer,
 	return err;
 }
 
-int tux_dir_is_empty(struct inode *dir)
+/* Count live entries of directory, except ".." and "." of self */
+static long tux_dir_count_scan(struct inode *dir)
 {
 	struct sb *sb = tux_sb(dir->i_sb);
 	block_t block, blocks = dir->i_size >> sb->blockbits;
-	__be64 self = cpu_to_be64(tux_inode(dir)->inum);
 	struct buffer_head *buffer;
+	long count = 0;
 
 	for (block = 0; block < blocks; block++) {
 		buffer = blockread(mapping(dir), block);
@@ -453,20 +548,30 @@ int tux_dir_is_empty(struct inode *dir)
 			}
 			if (is_deleted(entry))
 				continue;
-			if (entry->name[0] != '.')
-				goto not_empty;
-			if (entry->name_len > 2)
-				goto not_empty;
-			if (entry->name_len < 2) {
-				if (entry->inum != self)
-					goto not_empty;
-			} else if (entry->name[1] != '.')
-				goto not_empty;
+			/* Same rule with tux_create_dirent() */
+			if (tux_dir_counted(dir, entry->name, entry->name_len,
+					    be64_to_cpu(entry->inum)))
+				count++;
 		}
 		blockput(buffer);
 	}
-	return 0;
-not_empty:
-	blockput(buffer);
-	return -ENOTEMPTY;
+	return count;
+}
+
+/*
+ * Emptiness check. The number of live entries is counted by scan
+ * at first check, then tux_create_dirent() and tux_delete_dirent() keep
+ * it up to date. So, usually this doesn't read directory.
+ */
+int tux_dir_is_empty(struct inode *dir)
+{
+	struct tux3_inode *tuxnode = tux_inode(dir);
+
+	if (tuxnode->dir_entries < 0) {
+		long count = tux_dir_count_scan(dir);
+		if (count < 0)
+			return count;
+		tuxnode->dir_entries = count;
+	}
+	return tuxnode->dir_entries ? -ENOTEMPTY : 0;
 }
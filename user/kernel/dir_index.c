@@ -0,0 +1,547 @@
+/*
+ * Hashed directory index
+ *
+ * Without index, lookup of a name has to scan all dirent blocks. For
+ * large directories, we keep the in-memory hash table of (hash of
+ * name -> dirent block), so lookup is a hash probe and reading the
+ * dirent block of matched hash (usually only one).
+ *
+ * The index is built by scanning the directory at first lookup, and
+ * kept up to date by tux_alloc_entry() and tux_delete_entry() after
+ * that. Lookup trusts the index for negative result, so the index
+ * must have all live names. If we fail to update the index, we drop
+ * it, and it will be rebuilt by next lookup.
+ *
+ * The index is only a cache. Nothing is written to disk, so the first
+ * lookup after each iget (and after the index was dropped) still pays
+ * a full scan of the directory to rebuild it. The index is freed with
+ * the inode.
+ *
+ * Like devel/shard.c, the table is the array of entries chained by
+ * index, instead of pointers, to reduce memory usage and allocations.
+ *
+ * The index also has the free space map of dirent blocks. Each block
+ * is linked to the list of class by the largest record it can hold
+ * (in TUX_DIR_ALIGN units), so tux_alloc_entry() can pick the block
+ * which has space without scanning the directory.
+ *
+ * The bitmap of blocks which have live names lets tux_readdir() skip
+ * empty blocks without reading them, so listing a directory which
+ * shrank costs by the number of live blocks, not by its size. This
+ * works only while the index is cached, readdir doesn't build it.
+ * Empty blocks are not compacted, and readdir cookies stay the byte
+ * offset of the entry, so telldir/seekdir are not affected.
+ *
+ * Caller must hold ->i_mutex of directory.
+ */
+
+#include "tux3.h"
+#include "dir_index.h"
+
+/* Don't index small directories, linear scan is fast enough */
+#define DIR_INDEX_MIN_BLOCKS	4
+#define DIR_INDEX_SHIFT_MIN	8
+#define DIR_INDEX_SHIFT_MAX	30
+#define DIR_INDEX_END		(~0U)
+
+struct dir_index_entry {
+	u32 hash;			/* hash of name */
+	u32 next;			/* next entry in chain, or DIR_INDEX_END */
+	block_t block;			/* dirent block of name */
+};
+
+struct dir_index {
+	unsigned shift;			/* log2 of number of buckets/entries */
+	unsigned used;			/* number of used entries[] */
+	u32 free;			/* free entries[] list */
+	u32 *buckets;			/* head of chain */
+	struct dir_index_entry *entries;
+
+	/* Free space map */
+	unsigned classes;		/* number of classes */
+	u32 blocks;			/* number of blocks in map */
+	u32 capacity;			/* allocated size of per-block arrays */
+	u16 *space;			/* largest free record of block */
+	u32 *space_next, *space_prev;	/* link of blocks in same class */
+	u32 *class_head;		/* first block of class */
+	unsigned long *class_map;	/* bitmap of non-empty classes */
+	unsigned long *live_map;	/* bitmap of blocks with live names */
+};
+
+static u32 *dir_index_head(struct dir_index *index, u32 hash)
+{
+	return index->buckets + hash_32(hash, index->shift);
+}
+
+static void dir_index_destroy(struct dir_index *index)
+{
+	free(index->buckets);
+	free(index->entries);
+	free(index->space);
+	free(index->space_next);
+	free(index->space_prev);
+	free(index->class_head);
+	free(index->class_map);
+	free(index->live_map);
+	free(index);
+}
+
+void tux3_dir_index_free(struct inode *dir)
+{
+	struct tux3_inode *tuxnode = tux_inode(dir);
+
+	if (tuxnode->dir_index) {
+		dir_index_destroy(tuxnode->dir_index);
+		tuxnode->dir_index = NULL;
+	}
+}
+
+/* Allocate tables for 1 << shift entries, and rehash from old tables */
+static int dir_index_resize(struct dir_index *index, unsigned shift)
+{
+	unsigned size = 1U << shift, old_size = 1U << index->shift;
+	struct dir_index_entry *entries;
+	u32 *buckets, *old_buckets = index->buckets;
+	unsigned i;
+
+	if (shift > DIR_INDEX_SHIFT_MAX)
+		return -ENOSPC;
+
+	buckets = malloc(size * sizeof(*buckets));
+	entries = malloc(size * sizeof(*entries));
+	if (!buckets || !entries) {
+		free(buckets);
+		free(entries);
+		return -ENOMEM;
+	}
+	memset(buckets, 0xff, size * sizeof(*buckets));
+
+	index->shift = shift;
+	index->buckets = buckets;
+	if (index->entries) {
+		memcpy(entries, index->entries, old_size * sizeof(*entries));
+		free(index->entries);
+	}
+	index->entries = entries;
+
+	if (old_buckets) {
+		for (i = 0; i < old_size; i++) {
+			u32 this = old_buckets[i];
+
+			while (this != DIR_INDEX_END) {
+				struct dir_index_entry *entry = entries + this;
+				u32 next = entry->next, *head;
+
+				head = dir_index_head(index, entry->hash);
+				entry->next = *head;
+				*head = this;
+				this = next;
+			}
+		}
+		free(old_buckets);
+	}
+
+	return 0;
+}
+
+static int dir_index_add(struct dir_index *index, u32 hash, block_t block)
+{
+	struct dir_index_entry *entry;
+	u32 this, *head;
+
+	if (index->free != DIR_INDEX_END) {
+		this = index->free;
+		index->free = index->entries[this].next;
+	} else {
+		if (index->used == 1U << index->shift) {
+			int err = dir_index_resize(index, index->shift + 1);
+			if (err)
+				return err;
+		}
+		this = index->used++;
+	}
+
+	entry = index->entries + this;
+	head = dir_index_head(index, hash);
+	entry->hash = hash;
+	entry->block = block;
+	entry->next = *head;
+	*head = this;
+
+	return 0;
+}
+
+static void dir_index_del(struct dir_index *index, u32 hash, block_t block)
+{
+	u32 *prev = dir_index_head(index, hash);
+
+	while (*prev != DIR_INDEX_END) {
+		u32 this = *prev;
+		struct dir_index_entry *entry = index->entries + this;
+
+		if (entry->hash == hash && entry->block == block) {
+			*prev = entry->next;
+			entry->next = index->free;
+			index->free = this;
+			return;
+		}
+		prev = &entry->next;
+	}
+	assert(0);
+}
+
+/*
+ * Free space map functions
+ */
+
+/* Largest record which can be added to dirent block, in TUX_DIR_ALIGN */
+static unsigned dir_space_calc(struct sb *sb, void *data)
+{
+	tux_dirent *entry = data;
+	tux_dirent *limit = data + sb->blocksize - TUX_REC_LEN(1);
+	unsigned space = 0;
+
+	for (; entry <= limit; entry = next_entry(entry)) {
+		unsigned rec_len = tux_rec_len_from_disk(entry->rec_len);
+
+		if (!rec_len)
+			return 0;
+		if (!is_deleted(entry))
+			rec_len -= TUX_REC_LEN(entry->name_len);
+		space = max(space, rec_len);
+	}
+
+	return space / TUX_DIR_ALIGN;
+}
+
+static int dir_space_init(struct sb *sb, struct dir_index *index)
+{
+	unsigned classes = sb->blocksize / TUX_DIR_ALIGN + 1;
+
+	index->classes = classes;
+	index->class_head = malloc(classes * sizeof(*index->class_head));
+	index->class_map = malloc(BITS_TO_LONGS(classes) * sizeof(long));
+	if (!index->class_head || !index->class_map)
+		return -ENOMEM;
+	memset(index->class_head, 0xff, classes * sizeof(*index->class_head));
+	memset(index->class_map, 0, BITS_TO_LONGS(classes) * sizeof(long));
+
+	return 0;
+}
+
+static void *dir_space_realloc(void *old, size_t old_size, size_t size)
+{
+	void *new = malloc(size);
+
+	if (new && old) {
+		memcpy(new, old, old_size);
+		free(old);
+	}
+	return new;
+}
+
+/* Make per-block arrays to have space for blocks */
+static int dir_space_grow(struct dir_index *index, u32 blocks)
+{
+	u32 old = index->capacity, capacity = max(old, 16U);
+	u16 *space;
+	u32 *next, *prev;
+	unsigned long *live;
+
+	if (blocks <= old)
+		return 0;
+	while (capacity < blocks)
+		capacity *= 2;
+
+	space = dir_space_realloc(index->space, old * sizeof(*space),
+				  capacity * sizeof(*space));
+	if (!space)
+		return -ENOMEM;
+	index->space = space;
+	next = dir_space_realloc(index->space_next, old * sizeof(*next),
+				 capacity * sizeof(*next));
+	if (!next)
+		return -ENOMEM;
+	index->space_next = next;
+	prev = dir_space_realloc(index->space_prev, old * sizeof(*prev),
+				 capacity * sizeof(*prev));
+	if (!prev)
+		return -ENOMEM;
+	index->space_prev = prev;
+	live = dir_space_realloc(index->live_map,
+				 BITS_TO_LONGS(old) * sizeof(long),
+				 BITS_TO_LONGS(capacity) * sizeof(long));
+	if (!live)
+		return -ENOMEM;
+	index->live_map = live;
+	index->capacity = capacity;
+
+	return 0;
+}
+
+static void dir_space_unlink(struct dir_index *index, u32 block)
+{
+	unsigned class = index->space[block];
+	u32 next = index->space_next[block], prev = index->space_prev[block];
+
+	/* Full block is not linked */
+	if (!class)
+		return;
+
+	if (prev == DIR_INDEX_END)
+		index->class_head[class] = next;
+	else
+		index->space_next[prev] = next;
+	if (next != DIR_INDEX_END)
+		index->space_prev[next] = prev;
+	if (index->class_head[class] == DIR_INDEX_END)
+		__clear_bit(class, index->class_map);
+}
+
+static void dir_space_link(struct dir_index *index, u32 block)
+{
+	unsigned class = index->space[block];
+	u32 head = index->class_head[class];
+
+	if (!class)
+		return;
+
+	index->space_prev[block] = DIR_INDEX_END;
+	index->space_next[block] = head;
+	if (head != DIR_INDEX_END)
+		index->space_prev[head] = block;
+	index->class_head[class] = block;
+	__set_bit(class, index->class_map);
+}
+
+/* Set largest free record of block */
+static int dir_space_set(struct dir_index *index, block_t block,
+			 unsigned space)
+{
+	if (block >= index->blocks) {
+		int err = dir_space_grow(index, block + 1);
+		if (err)
+			return err;
+		while (index->blocks <= block) {
+			__set_bit(index->blocks, index->live_map);
+			index->space[index->blocks++] = 0;
+		}
+	}
+
+	dir_space_unlink(index, block);
+	index->space[block] = space;
+	dir_space_link(index, block);
+
+	/* Only empty block has the whole block as free record */
+	if (space == index->classes - 1)
+		__clear_bit(block, index->live_map);
+	else
+		__set_bit(block, index->live_map);
+
+	return 0;
+}
+
+/* Find block which has space for reclen, or return DIR_INDEX_END */
+static u32 dir_space_find(struct dir_index *index, unsigned reclen)
+{
+	unsigned class;
+
+	class = find_next_bit(index->class_map, index->classes,
+			      reclen / TUX_DIR_ALIGN);
+	if (class >= index->classes)
+		return DIR_INDEX_END;
+	return index->class_head[class];
+}
+
+/* Find first block >= block which may have live names */
+static block_t dir_space_next_live(struct dir_index *index, block_t block)
+{
+	/* Block is not in map yet, caller has to read it */
+	if (block >= index->blocks)
+		return block;
+	return find_next_bit(index->live_map, index->blocks, block);
+}
+
+/* Dirent block was changed */
+static void dir_space_update(struct inode *dir, block_t block, void *data)
+{
+	struct dir_index *index = tux_inode(dir)->dir_index;
+
+	if (index) {
+		unsigned space = dir_space_calc(tux_sb(dir->i_sb), data);
+		if (dir_space_set(index, block, space)) {
+			/* Space map lost the block, drop it */
+			tux3_dir_index_free(dir);
+		}
+	}
+}
+
+/* Add all live names and free space in dirent block to index */
+static int dir_index_add_block(struct inode *dir, struct dir_index *index,
+			       struct buffer_head *buffer)
+{
+	struct sb *sb = tux_sb(dir->i_sb);
+	block_t block = bufindex(buffer);
+	tux_dirent *entry = bufdata(buffer);
+	tux_dirent *limit = bufdata(buffer) + sb->blocksize - TUX_REC_LEN(1);
+
+	for (; entry <= limit; entry = next_entry(entry)) {
+		int err;
+
+		if (entry->rec_len == 0) {
+			tux_zero_len_error(dir, block);
+			return -EIO;
+		}
+		if (is_deleted(entry))
+			continue;
+
+		err = dir_index_add(index,
+				    tux_name_hash(entry->name, entry->name_len),
+				    block);
+		if (err)
+			return err;
+	}
+
+	return dir_space_set(index, block, dir_space_calc(sb, bufdata(buffer)));
+}
+
+static struct dir_index *dir_index_build(struct inode *dir, loff_t size)
+{
+	struct sb *sb = tux_sb(dir->i_sb);
+	block_t block, blocks = size >> sb->blockbits;
+	struct dir_index *index;
+	unsigned shift;
+	int err;
+
+	index = malloc(sizeof(*index));
+	if (!index)
+		return ERR_PTR(-ENOMEM);
+	*index = (struct dir_index){ .free = DIR_INDEX_END, };
+
+	/* Guess from the number of minimum size entries in a block */
+	shift = ilog2(blocks * (sb->blocksize / TUX_REC_LEN(8)));
+	shift = max_t(unsigned, shift, DIR_INDEX_SHIFT_MIN);
+	shift = min_t(unsigned, shift, DIR_INDEX_SHIFT_MAX);
+	err = dir_index_resize(index, shift);
+	if (err)
+		goto error;
+	err = dir_space_init(sb, index);
+	if (err)
+		goto error;
+	err = dir_space_grow(index, blocks);
+	if (err)
+		goto error;
+
+	for (block = 0; block < blocks; block++) {
+		struct buffer_head *buffer = blockread(mapping(dir), block);
+		if (!buffer) {
+			err = -EIO;
+			goto error;
+		}
+		err = dir_index_add_block(dir, index, buffer);
+		blockput(buffer);
+		if (err)
+			goto error;
+	}
+
+	trace("inum %Lu, %u entries, shift %u", tux_inode(dir)->inum,
+	      index->used, index->shift);
+
+	return index;
+
+error:
+	dir_index_destroy(index);
+	return ERR_PTR(err);
+}
+
+/*
+ * Get index of directory, and build it if directory is large.
+ * Return NULL if index is not usable, caller should scan directory.
+ */
+static struct dir_index *dir_index_get(struct inode *dir, loff_t size)
+{
+	struct tux3_inode *tuxnode = tux_inode(dir);
+	struct sb *sb = tux_sb(dir->i_sb);
+	struct dir_index *index;
+
+	if (tuxnode->dir_index)
+		return tuxnode->dir_index;
+
+	if ((size >> sb->blockbits) < DIR_INDEX_MIN_BLOCKS)
+		return NULL;
+
+	index = dir_index_build(dir, size);
+	if (IS_ERR(index))
+		return NULL;
+
+	tuxnode->dir_index = index;
+	return index;
+}
+
+/* Find name by index */
+static tux_dirent *dir_index_find(struct inode *dir, struct dir_index *index,
+				  const char *name, unsigned len,
+				  struct buffer_head **result)
+{
+	struct sb *sb = tux_sb(dir->i_sb);
+	unsigned reclen = TUX_REC_LEN(len);
+	u32 hash, this;
+
+	/* Longer name can't be in directory, and don't hash past it */
+	if (len > TUX_NAME_LEN)
+		return ERR_PTR(-ENOENT);
+
+	hash = tux_name_hash(name, len);
+	this = *dir_index_head(index, hash);
+	for (; this != DIR_INDEX_END; this = index->entries[this].next) {
+		struct dir_index_entry *ientry = index->entries + this;
+		struct buffer_head *buffer;
+		tux_dirent *entry, *limit;
+
+		if (ientry->hash != hash)
+			continue;
+
+		buffer = blockread(mapping(dir), ientry->block);
+		if (!buffer)
+			return ERR_PTR(-EIO);
+		entry = bufdata(buffer);
+		limit = (void *)entry + sb->blocksize - reclen;
+		while (entry <= limit) {
+			if (entry->rec_len == 0) {
+				blockput(buffer);
+				tux_zero_len_error(dir, ientry->block);
+				return ERR_PTR(-EIO);
+			}
+			if (tux_match(entry, name, len)) {
+				*result = buffer;
+				return entry;
+			}
+			entry = next_entry(entry);
+		}
+		blockput(buffer);
+	}
+
+	return ERR_PTR(-ENOENT);
+}
+
+/* Name was added to block */
+static void dir_index_insert(struct inode *dir, const char *name,
+			     unsigned len, block_t block)
+{
+	struct dir_index *index = tux_inode(dir)->dir_index;
+
+	if (index && dir_index_add(index, tux_name_hash(name, len), block)) {
+		/* Index lost the name, drop it */
+		tux3_dir_index_free(dir);
+	}
+}
+
+/* Name was removed from block */
+static void dir_index_remove(struct inode *dir, const char *name,
+			     unsigned len, block_t block)
+{
+	struct dir_index *index = tux_inode(dir)->dir_index;
+
+	if (index)
+		dir_index_del(index, tux_name_hash(name, len), block);
+}
@@ -0,0 +1,6 @@
+#ifndef TUX3_DIR_INDEX_H
+#define TUX3_DIR_INDEX_H
+
+void tux3_dir_index_free(struct inode *dir);
+
+#endif /* !TUX3_DIR_INDEX_H */
@@ -23,8 +23,10 @@
  *
  * inode->i_mutex
  *     mapping->private_lock (front uses to protect dirty buffer list)
- *     tuxnode->hole_extents_lock (for inode->hole_extents,
- *				   i_ddc->dirty_holes is protected by ->i_mutex)
+ *     tuxnode->hole_extents_lock (for inode->hole_extents and updating
+ *				   ->hole_index, i_ddc->dirty_holes is
+ *				   protected by ->i_mutex. ->hole_index is
+ *				   read under RCU)
  *
  *     inode->i_lock
  *         tuxnode->lock (to protect tuxnode data)
@@ -46,6 +48,7 @@
 
 #include "tux3.h"
 #include "dleaf2.h"
+#include "filemap_inline.h"
 
 #ifndef trace
 #define trace trace_on
@@ -594,6 +597,8 @@ static int map_region(struct inode *inode, block_t start, unsigned count,
 	return segs;
 }
 
+#include "filemap_inline.c"
+
 static int filemap_extent_io(enum map_mode mode, int rw, struct bufvec *bufvec);
 int tux3_filemap_overwrite_io(int rw, struct bufvec *bufvec)
 {
@@ -628,6 +633,9 @@ static int filemap_extent_io(enum map_mode mode, int rw, struct bufvec *bufvec)
 		return segs;
 	assert(segs);
 
+	/* FIXME: for now, only userland saves inline data */
+	tux3_inline_written(inode, index);
+
 	for (int i = 0; i < segs; i++) {
 		block = seg[i].block;
 		count = seg[i].count;
@@ -877,6 +885,20 @@ error:
 	return NULL;
 }
 
+/* Start to read count blocks from iblock, without waiting I/O */
+void blockreadahead(struct address_space *mapping, block_t iblock,
+		    unsigned count)
+{
+	struct inode *inode = mapping->host;
+	unsigned shift = PAGE_CACHE_SHIFT - inode->i_blkbits;
+	pgoff_t index = iblock >> shift;
+	pgoff_t end = (iblock + count + (1 << shift) - 1) >> shift;
+	struct file_ra_state ra;
+
+	file_ra_state_init(&ra, mapping);
+	page_cache_sync_readahead(mapping, &ra, NULL, index, end - index);
+}
+
 struct buffer_head *blockget(struct address_space *mapping, block_t iblock)
 {
 	struct inode *inode = mapping->host;
@@ -948,6 +970,9 @@ struct buffer_head *blockget(struct address_space *mapping, block_t iblock)
 
 static int tux3_readpage(struct file *file, struct page *page)
 {
+	if (tux3_inline_readpage(page))
+		return 0;
+
 	int err = mpage_readpage(page, tux3_get_block);
 	assert(!PageForked(page));	/* FIXME: handle forked page */
 	return err;
@@ -956,6 +981,9 @@ static int tux3_readpage(struct file *file, struct page *page)
 static int tux3_readpages(struct file *file, struct address_space *mapping,
 			  struct list_head *pages, unsigned nr_pages)
 {
+	/* Leave to ->readpage() to read inline data */
+	if (tux_inode(mapping->host)->inline_data)
+		return 0;
 	return mpage_readpages(mapping, pages, nr_pages, tux3_get_block);
 }
 
@@ -1012,10 +1040,21 @@ static int tux3_file_write_begin(struct file *file,
 				 loff_t pos, unsigned len, unsigned flags,
 				 struct page **pagep, void **fsdata)
 {
+	int err;
+
 	/* Separate big write transaction to small chunk. */
 	assert(S_ISREG(mapping->host->i_mode));
+
+	err = tux3_inline_write_begin(mapping);
+	if (err)
+		return err;
+
 	change_begin_if_needed(tux_sb(mapping->host->i_sb));
 
+	err = tux3_inline_grow(mapping->host, pos + len);
+	if (err)
+		return err;
+
 	return __tux3_file_write_begin(file, mapping, pos, len, flags, pagep,
 				       fsdata, 1);
 }
@@ -13,6 +13,11 @@
  *
  * And backend will apply the hole extents to dtree later, and do
  * actual truncation and freeing blocks.
+ *
+ * ->hole_extents is the authoritative list, and updated under
+ * ->hole_extents_lock. On each update, we publish the sorted and
+ * merged copy of it as ->hole_index via RCU, so that readers can
+ * binary search holes without taking the lock.
  */
 
 #include "tux3.h"
@@ -26,6 +31,19 @@ struct hole_extent {
 	block_t count;			/* number of blocks of hole */
 };
 
+/* Sorted and merged snapshot of ->hole_extents for readers */
+struct hole_index {
+	struct rcu_head rcu;
+	unsigned count;			/* number of range[] */
+	struct hole_range {
+		block_t start;		/* start block of hole */
+		block_t end;		/* end block of hole (exclusive) */
+	} range[];
+};
+
+/* Couldn't allocate snapshot. Readers have to scan ->hole_extents. */
+#define HOLE_INDEX_STALE	((struct hole_index *)-1L)
+
 static struct kmem_cache *tux_hole_cachep;
 
 static void tux3_hole_init_once(void *mem)
@@ -70,6 +88,83 @@ static void tux3_destroy_hole(struct hole_extent *hole)
 	kmem_cache_free(tux_hole_cachep, hole);
 }
 
+/*
+ * Insert hole into ->hole_extents in order of start block, so that
+ * tux3_hole_index_update() can merge holes by one pass. Caller must
+ * hold ->hole_extents_lock.
+ */
+static void tux3_hole_list_add(struct tux3_inode *tuxnode,
+			       struct hole_extent *new)
+{
+	struct hole_extent *hole;
+
+	list_for_each_entry(hole, &tuxnode->hole_extents, list) {
+		if (new->start < hole->start)
+			break;
+	}
+	list_add_tail(&new->list, &hole->list);
+}
+
+/*
+ * Rebuild ->hole_index from ->hole_extents. Caller must call this
+ * after every change of ->hole_extents.
+ */
+static void tux3_hole_index_update(struct tux3_inode *tuxnode)
+{
+	struct hole_index *index = NULL, *old;
+	struct hole_extent *hole;
+	unsigned count, alloced = 0;
+
+	spin_lock(&tuxnode->hole_extents_lock);
+	while (1) {
+		count = 0;
+		list_for_each_entry(hole, &tuxnode->hole_extents, list)
+			count++;
+		if (count <= alloced)
+			break;
+
+		/* List was grown while allocating, retry */
+		spin_unlock(&tuxnode->hole_extents_lock);
+		free(index);
+		alloced = count;
+		index = malloc(sizeof(*index) + sizeof(index->range[0]) * count);
+		spin_lock(&tuxnode->hole_extents_lock);
+		if (!index) {
+			index = HOLE_INDEX_STALE;
+			goto publish;
+		}
+	}
+
+	if (!count) {
+		free(index);
+		index = NULL;
+	} else {
+		/* List is sorted, merge overlapped or adjacent holes */
+		index->count = 0;
+		list_for_each_entry(hole, &tuxnode->hole_extents, list) {
+			struct hole_range *last = &index->range[index->count];
+			block_t end = hole->start + hole->count;
+
+			if (index->count && hole->start <= last[-1].end) {
+				last[-1].end = max(last[-1].end, end);
+				continue;
+			}
+			last->start = hole->start;
+			last->end = end;
+			index->count++;
+		}
+	}
+
+publish:
+	old = rcu_dereference_protected(tuxnode->hole_index,
+			lockdep_is_held(&tuxnode->hole_extents_lock));
+	rcu_assign_pointer(tuxnode->hole_index, index);
+	spin_unlock(&tuxnode->hole_extents_lock);
+
+	if (old && old != HOLE_INDEX_STALE)
+		kfree_rcu(old, rcu);
+}
+
 /*
  * Backend functions
  */
@@ -94,6 +189,9 @@ int tux3_flush_hole(struct inode *inode, unsigned delta)
 		ret = btree_chop(&tuxnode->btree, hole->start, TUXKEY_LIMIT);
 		if (ret && !err)
 			err = ret;		/* FIXME: error handling */
+		/* Inline data is the block 0 */
+		if (hole->start == 0)
+			tux3_inline_free(inode);
 
 		/*
 		 * Hole extent was applied to btree. Remove from
@@ -106,6 +204,7 @@ int tux3_flush_hole(struct inode *inode, unsigned delta)
 		list_del_init(&hole->dirty_list);
 		tux3_destroy_hole(hole);
 	}
+	tux3_hole_index_update(tuxnode);
 
 	return err;
 }
@@ -118,8 +217,6 @@ int tux3_flush_hole(struct inode *inode, unsigned delta)
  * Add new hole extent.
  *
  * Find holes, and merge if possible (caller must hold ->i_mutex)
- * FIXME: we can use RCU for this?
- * FIXME: list doesn't scale, use better algorithm
  */
 static int tux3_add_hole(struct inode *inode, block_t start, block_t count)
 {
@@ -128,10 +225,10 @@ static int tux3_add_hole(struct inode *inode, block_t start, block_t count)
 	struct inode_delta_dirty *i_ddc = tux3_inode_ddc(inode, delta);
 	struct hole_extent *hole, *safe, *merged = NULL, *removed = NULL;
 
-	/* FIXME: for now, support truncate only */
-	assert(start + count == MAX_BLOCKS);
-
 	/*
+	 * Frontend can handle any hole, but tux3_flush_hole() supports
+	 * truncate only for now.
+	 *
 	 * Find frontend dirty holes, and merge if possible
 	 * (->dirty_holes is protected by ->i_mutex)
 	 */
@@ -162,8 +259,14 @@ static int tux3_add_hole(struct inode *inode, block_t start, block_t count)
 		if (removed)
 			tux3_destroy_hole(hole);
 	}
-	if (merged)
-		return 0;
+	if (merged) {
+		/* Start was changed, keep the list sorted */
+		spin_lock(&tuxnode->hole_extents_lock);
+		list_del_init(&merged->list);
+		tux3_hole_list_add(tuxnode, merged);
+		spin_unlock(&tuxnode->hole_extents_lock);
+		goto out;
+	}
 
 	hole = tux3_alloc_hole();
 	if (!hole)
@@ -174,8 +277,10 @@ static int tux3_add_hole(struct inode *inode, block_t start, block_t count)
 	list_add(&hole->dirty_list, &i_ddc->dirty_holes);
 	/* Add hole */
 	spin_lock(&tuxnode->hole_extents_lock);
-	list_add(&hole->list, &tux_inode(inode)->hole_extents);
+	tux3_hole_list_add(tuxnode, hole);
 	spin_unlock(&tuxnode->hole_extents_lock);
+out:
+	tux3_hole_index_update(tuxnode);
 
 	return 0;
 }
@@ -204,82 +309,185 @@ int tux3_clear_hole(struct inode *inode, unsigned delta)
 
 		has_hole = 1;
 	}
+	if (has_hole)
+		tux3_hole_index_update(tux_inode(inode));
 
 	return has_hole;
 }
 
-/* Is the region a hole? */
-static int tux3_is_hole(struct inode *inode, block_t start, unsigned count)
+/*
+ * Slow path of tux3_find_hole(). Scan ->hole_extents, and merge
+ * holes connected to found one.
+ */
+static int tux3_find_hole_list(struct tux3_inode *tuxnode, block_t start,
+			       block_t end, struct hole_range *found)
 {
-	struct tux3_inode *tuxnode = tux_inode(inode);
 	struct hole_extent *hole;
-	int whole = 0;
+	int merged, ret = 0;
 
 	spin_lock(&tuxnode->hole_extents_lock);
+	/* Find first hole overlapped with region */
 	list_for_each_entry(hole, &tuxnode->hole_extents, list) {
-		/* FIXME: for now, support truncate only */
-		assert(hole->start + hole->count == MAX_BLOCKS);
+		block_t hole_end = hole->start + hole->count;
 
-		if (hole->start <= start) {
-			whole = 1;
-			break;
+		if (hole_end <= start || end <= hole->start)
+			continue;
+		if (!ret || hole->start < found->start) {
+			found->start = hole->start;
+			found->end = hole_end;
+			ret = 1;
 		}
 	}
+	/* Expand it with connected holes */
+	do {
+		merged = 0;
+		list_for_each_entry(hole, &tuxnode->hole_extents, list) {
+			block_t hole_end = hole->start + hole->count;
+
+			if (!ret || hole->start > found->end ||
+			    hole_end <= found->end)
+				continue;
+			found->end = hole_end;
+			merged = 1;
+		}
+	} while (merged);
 	spin_unlock(&tuxnode->hole_extents_lock);
 
-	return whole;
+	return ret;
 }
 
-/* Update specified segs[] with holes. */
-static int tux3_map_hole(struct inode *inode, block_t start, unsigned count,
-			 struct block_segment seg[], unsigned segs,
-			 unsigned max_segs)
+/*
+ * Find first hole overlapped with region [start, start + count).
+ *
+ * return value:
+ * 1 - found, and *found is filled
+ * 0 - not found
+ */
+static int tux3_find_hole(struct inode *inode, block_t start, block_t count,
+			  struct hole_range *found)
 {
 	struct tux3_inode *tuxnode = tux_inode(inode);
-	struct hole_extent *hole;
-	block_t hole_start = MAX_BLOCKS;
-	int i;
-
-	/* Search start of hole */
-	spin_lock(&tuxnode->hole_extents_lock);
-	list_for_each_entry(hole, &tuxnode->hole_extents, list) {
-		/* FIXME: for now, support truncate only */
-		assert(hole->start + hole->count == MAX_BLOCKS);
+	struct hole_index *index;
+	block_t end = start + count;
+	unsigned lo, hi;
+	int ret = 0;
+
+	rcu_read_lock();
+	index = rcu_dereference(tuxnode->hole_index);
+	if (!index)
+		goto out;
+	if (index == HOLE_INDEX_STALE) {
+		rcu_read_unlock();
+		return tux3_find_hole_list(tuxnode, start, end, found);
+	}
 
-		hole_start = min(hole_start, hole->start);
+	/* Binary search first range which ends after start */
+	lo = 0;
+	hi = index->count;
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		if (index->range[mid].end <= start)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-	spin_unlock(&tuxnode->hole_extents_lock);
+	if (lo < index->count && index->range[lo].start < end) {
+		*found = index->range[lo];
+		ret = 1;
+	}
+out:
+	rcu_read_unlock();
+
+	return ret;
+}
+
+/* Is the region a hole? */
+static int tux3_is_hole(struct inode *inode, block_t start, unsigned count)
+{
+	struct hole_range range;
+
+	if (!tux3_find_hole(inode, start, count, &range))
+		return 0;
 
-	/* Outside of hole */
-	if (start + count <= hole_start)
-		return segs;
+	return range.start <= start && start + count <= range.end;
+}
+
+/*
+ * Split seg[] (starts from block start) at block "at". If seg[] is
+ * full, the last segment is dropped or cut at "at", i.e. the mapped
+ * region becomes shorter.
+ */
+static unsigned tux3_split_seg(block_t start, block_t at,
+			       struct block_segment seg[], unsigned segs,
+			       unsigned max_segs)
+{
+	unsigned i;
 
-	/* Update seg[] */
 	for (i = 0; i < segs; i++) {
-		/* Matched start of hole */
-		if (hole_start < start + seg[i].count) {
-			if (seg[i].state == BLOCK_SEG_HOLE) {
-				/* Expand if hole */
-				seg[i].count = count;
-				i++;
-			} else {
-				/* Update region */
-				seg[i].count = hole_start - start;
-				i++;
-
-				/* If there is space, add hole region */
-				if (i < max_segs) {
-					seg[i].state = BLOCK_SEG_HOLE;
-					seg[i].block = 0;
-					seg[i].count = count;
-					i++;
-				}
-			}
+		if (at <= start)
+			return segs;		/* on boundary */
+		if (at < start + seg[i].count)
 			break;
-		}
 		start += seg[i].count;
-		count -= seg[i].count;
+	}
+	if (i == segs)
+		return segs;			/* outside of seg[] */
+
+	if (segs == max_segs) {
+		if (i == segs - 1) {
+			seg[i].count = at - start;
+			return segs;
+		}
+		segs--;
+	}
+	memmove(&seg[i + 1], &seg[i], sizeof(seg[0]) * (segs - i));
+	segs++;
+
+	seg[i].count = at - start;
+	seg[i + 1].count -= seg[i].count;
+	if (seg[i + 1].state != BLOCK_SEG_HOLE)
+		seg[i + 1].block += seg[i].count;
+
+	return segs;
+}
+
+/* Update specified segs[] with holes. */
+static int tux3_map_hole(struct inode *inode, block_t start, unsigned count,
+			 struct block_segment seg[], unsigned segs,
+			 unsigned max_segs)
+{
+	block_t pos = start, end = start + count;
+	struct hole_range range;
+	unsigned i, j;
+
+	while (pos < end && tux3_find_hole(inode, pos, end - pos, &range)) {
+		block_t hole_start = max(range.start, pos);
+		block_t hole_end = min(range.end, end);
+		block_t seg_start = start;
+
+		/* Split at boundaries of hole, then replace by hole */
+		segs = tux3_split_seg(start, hole_start, seg, segs, max_segs);
+		segs = tux3_split_seg(start, hole_end, seg, segs, max_segs);
+		for (i = 0; i < segs; i++) {
+			if (hole_start <= seg_start &&
+			    seg_start + seg[i].count <= hole_end) {
+				seg[i].state = BLOCK_SEG_HOLE;
+				seg[i].block = 0;
+			}
+			seg_start += seg[i].count;
+		}
+		pos = hole_end;
+	}
+
+	/* Merge adjacent holes */
+	for (i = 0, j = 0; i < segs; i++) {
+		if (j && seg[j - 1].state == BLOCK_SEG_HOLE &&
+		    seg[i].state == BLOCK_SEG_HOLE) {
+			seg[j - 1].count += seg[i].count;
+			continue;
+		}
+		seg[j++] = seg[i];
 	}
 
-	return i;
+	return j;
 }
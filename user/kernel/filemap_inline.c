@@ -0,0 +1,236 @@
+/*
+ * Inline data functions
+ *
+ * Small regular files and symlinks keep their body in the inode
+ * attributes (IDATA_ATTR), instead of dtree and data block. So,
+ * reading such a file needs only the ileaf block.
+ *
+ * The frontend doesn't know about inline data except on read. It
+ * writes the page cache as usual, and backend decides on flush: if
+ * the file has no dtree and i_size fits in tux3_inline_limit(), the
+ * dirty block 0 is copied to ->inline_data instead of being written
+ * to a data block.
+ *
+ * If the frontend grows the file beyond the limit, it dirties block 0
+ * on the current delta (see tux3_inline_grow()). So the backend writes
+ * block 0 to dtree by usual buffer flush, and drops inline data.
+ *
+ * Inline data is owned by backend. Frontend only reads it to fill
+ * page cache. ->inline_data is replaced or freed under tuxnode->lock,
+ * and the frontend holds it while copying.
+ */
+
+#include "tux3.h"
+#include "filemap_inline.h"
+
+/* Max size of inline data */
+static unsigned tux3_inline_limit(struct sb *sb)
+{
+	return min_t(unsigned, TUX3_INLINE_MAX, sb->blocksize >> 3);
+}
+
+/* Can backend store the data of inode as inline data? */
+static int tux3_inline_can_write(struct inode *inode,
+				 struct tux3_iattr_data *idata)
+{
+	struct sb *sb = tux_sb(inode->i_sb);
+
+	if (!S_ISREG(idata->i_mode) && !S_ISLNK(idata->i_mode))
+		return 0;
+	if (has_root(&tux_inode(inode)->btree))
+		return 0;
+	return idata->i_size <= tux3_inline_limit(sb);
+}
+
+/* Replace inline data, and free old one */
+static void tux3_inline_replace(struct inode *inode, void *data,
+				unsigned size)
+{
+	struct tux3_inode *tuxnode = tux_inode(inode);
+	void *old;
+
+	spin_lock(&tuxnode->lock);
+	old = tuxnode->inline_data;
+	tuxnode->inline_data = data;
+	tuxnode->inline_size = size;
+	spin_unlock(&tuxnode->lock);
+
+	if (old)
+		free(old);
+}
+
+void tux3_inline_free(struct inode *inode)
+{
+	if (tux_inode(inode)->inline_data)
+		tux3_inline_replace(inode, NULL, 0);
+}
+
+/* Fill block from inline data (caller must hold tuxnode->lock, or backend) */
+static void tux3_inline_read(struct inode *inode, block_t index, void *data,
+			     unsigned size)
+{
+	struct tux3_inode *tuxnode = tux_inode(inode);
+	unsigned copy = 0;
+
+	/* Truncated region is not applied to inline data yet */
+	if (index == 0 && !tux3_is_hole(inode, 0, 1)) {
+		copy = min(tuxnode->inline_size, size);
+		memcpy(data, tuxnode->inline_data, copy);
+	}
+	memset(data + copy, 0, size - copy);
+}
+
+/*
+ * Save block 0 data as inline data.
+ *
+ * return value:
+ * 1 - data was saved as inline data
+ * 0 - can't save as inline data, caller has to write to dtree
+ * < 0 - error
+ */
+static int tux3_inline_write(struct inode *inode,
+			     struct tux3_iattr_data *idata,
+			     block_t index, unsigned count, void *data)
+{
+	struct tux3_inode *tuxnode = tux_inode(inode);
+	unsigned size = idata->i_size;
+
+	if (index != 0 || count != 1 || !tux3_inline_can_write(inode, idata))
+		return 0;
+
+	if (size != tuxnode->inline_size) {
+		void *new = NULL;
+
+		if (size) {
+			new = malloc(size);
+			if (!new)
+				return -ENOMEM;
+			memcpy(new, data, size);
+		}
+		tux3_inline_replace(inode, new, size);
+	} else {
+		spin_lock(&tuxnode->lock);
+		memcpy(tuxnode->inline_data, data, size);
+		spin_unlock(&tuxnode->lock);
+	}
+
+	/* Tell to save inode attributes */
+	tux3_mark_btree_dirty(&tuxnode->btree);
+
+	trace("inum %Lu, inline %u bytes", tuxnode->inum, size);
+
+	return 1;
+}
+
+/* Block 0 was written to dtree, so inline data is obsoleted */
+static void tux3_inline_written(struct inode *inode, block_t index)
+{
+	if (index == 0)
+		tux3_inline_free(inode);
+}
+
+/*
+ * Called after flushing buffers. If file can't be inline anymore,
+ * block 0 was dirtied by tux3_inline_grow() and written to dtree, so
+ * inline data must be dropped already.
+ */
+int tux3_flush_inline(struct inode *inode, struct tux3_iattr_data *idata)
+{
+	struct tux3_inode *tuxnode = tux_inode(inode);
+
+	if (!tuxnode->inline_data || tux3_inline_can_write(inode, idata))
+		return 0;
+
+	tux3_fs_error(tux_sb(inode->i_sb),
+		      "inum %Lu: inline data was not migrated to dtree",
+		      tuxnode->inum);
+	return -EIO;
+}
+
+#ifdef __KERNEL__
+/*
+ * Fill page from inline data.
+ *
+ * return value:
+ * 1 - page was filled and unlocked
+ * 0 - inode doesn't have inline data
+ */
+static int tux3_inline_readpage(struct page *page)
+{
+	struct inode *inode = page->mapping->host;
+	struct tux3_inode *tuxnode = tux_inode(inode);
+	struct sb *sb = tux_sb(inode->i_sb);
+	block_t index = (block_t)page->index << (PAGE_CACHE_SHIFT - sb->blockbits);
+	unsigned offset;
+	void *kaddr;
+
+	/* Backend may free inline data, hold it while copying */
+	spin_lock(&tuxnode->lock);
+	if (!tuxnode->inline_data) {
+		spin_unlock(&tuxnode->lock);
+		return 0;
+	}
+
+	kaddr = kmap_atomic(page);
+	for (offset = 0; offset < PAGE_CACHE_SIZE; offset += sb->blocksize)
+		tux3_inline_read(inode, index++, kaddr + offset, sb->blocksize);
+	kunmap_atomic(kaddr);
+	spin_unlock(&tuxnode->lock);
+
+	flush_dcache_page(page);
+	SetPageUptodate(page);
+	unlock_page(page);
+
+	return 1;
+}
+
+/*
+ * block_write_begin() would map block 0 as hole. So, read page 0
+ * from inline data before it.
+ */
+static int tux3_inline_write_begin(struct address_space *mapping)
+{
+	struct page *page;
+
+	if (!tux_inode(mapping->host)->inline_data)
+		return 0;
+
+	page = read_mapping_page(mapping, 0, NULL);
+	if (IS_ERR(page))
+		return PTR_ERR(page);
+	page_cache_release(page);
+
+	return 0;
+}
+#endif /* __KERNEL__ */
+
+/*
+ * Frontend is growing the file to newsize. If block 0 can be inline
+ * data (now, or by flush of an in-flight delta), dirty block 0 on the
+ * current delta. Then the backend writes it to dtree by usual buffer
+ * flush, and drops inline data.
+ */
+int tux3_inline_grow(struct inode *inode, loff_t newsize)
+{
+	struct sb *sb = tux_sb(inode->i_sb);
+	loff_t oldsize = i_size_read(inode);
+	unsigned limit = tux3_inline_limit(sb);
+
+	if (!S_ISREG(inode->i_mode) && !S_ISLNK(inode->i_mode))
+		return 0;
+	if (!oldsize || oldsize > limit || newsize <= limit)
+		return 0;
+
+	trace("inum %Lu, grow %Ld => %Ld, migrate to dtree",
+	      tux_inode(inode)->inum, (s64)oldsize, (s64)newsize);
+#ifdef __KERNEL__
+	{
+		/* get_block() maps block 0 as hole, read it first */
+		int err = tux3_inline_write_begin(inode->i_mapping);
+		if (err)
+			return err;
+	}
+#endif
+	/* Zero beyond old i_size, and dirty block 0 */
+	return tux3_truncate_partial_block(inode, oldsize);
+}
@@ -0,0 +1,8 @@
+#ifndef TUX3_FILEMAP_INLINE_H
+#define TUX3_FILEMAP_INLINE_H
+
+void tux3_inline_free(struct inode *inode);
+int tux3_flush_inline(struct inode *inode, struct tux3_iattr_data *idata);
+int tux3_inline_grow(struct inode *inode, loff_t newsize);
+
+#endif /* !TUX3_FILEMAP_INLINE_H */
@@ -11,12 +11,17 @@
 #include "tux3.h"
 #include "ileaf.h"
 #include "iattr.h"
+#include "filemap_inline.h"
 
 /*
  * Variable size attribute format:
  *
  *    immediate data: kind+version:16, bytes:16, data[bytes]
  *    immediate xattr: kind+version:16, bytes:16, atom:16, data[bytes - 2]
+ *
+ * Fixed size xattr attribute format:
+ *
+ *    shared xattr: kind+version:16, atom:16, share:32
  */
 
 unsigned atsize[MAX_ATTRS] = {
@@ -30,6 +35,7 @@ unsigned atsize[MAX_ATTRS] = {
 	/* Variable size (extended) attrs */
 	[IDATA_ATTR] = 2,
 	[XATTR_ATTR] = 4,
+	[XSHARE_ATTR] = 6,
 };
 
 /*
@@ -124,6 +130,9 @@ void dump_attrs(struct inode *inode)
 		case XATTR_ATTR:
 			__tux3_dbg("xattr(s) ");
 			break;
+		case XSHARE_ATTR:
+			__tux3_dbg("shared xattr(s) ");
+			break;
 		default:
 			__tux3_dbg("<%i>? ", kind);
 			break;
@@ -131,6 +140,8 @@ void dump_attrs(struct inode *inode)
 	}
 	if (has_root(&tuxnode->btree))
 		__tux3_dbg("root %Lx:%u ", tuxnode->btree.root.block, tuxnode->btree.root.depth);
+	if (tuxnode->inline_data)
+		__tux3_dbg("idata %u ", tuxnode->inline_size);
 	__tux3_dbg("\n");
 }
 
@@ -182,6 +193,71 @@ static void *encode_attrs(struct btree *btree, void *data, void *attrs,
 	return attrs;
 }
 
+/* Inline data is trimmed to i_size, the tail was truncated */
+static unsigned inline_bytes(struct inode *inode, struct tux3_iattr_data *idata)
+{
+	return min_t(loff_t, tux_inode(inode)->inline_size, idata->i_size);
+}
+
+static unsigned encode_isize(struct inode *inode, struct tux3_iattr_data *idata)
+{
+	unsigned bytes = inline_bytes(inode, idata);
+
+	return bytes ? 2 + atsize[IDATA_ATTR] + bytes : 0;
+}
+
+static void *encode_idata(struct inode *inode, struct tux3_iattr_data *idata,
+			  void *attrs)
+{
+	unsigned bytes = inline_bytes(inode, idata);
+
+	if (!bytes)
+		return attrs;
+
+	// immediate data: kind+version:16, bytes:16, data[bytes]
+	attrs = encode_kind(attrs, IDATA_ATTR, tux_sb(inode->i_sb)->version);
+	attrs = encode16(attrs, bytes);
+	memcpy(attrs, tux_inode(inode)->inline_data, bytes);
+	return attrs + bytes;
+}
+
+static void *decode_idata(struct inode *inode, void *attrs)
+{
+	struct tux3_inode *tuxnode = tux_inode(inode);
+	unsigned bytes;
+
+	attrs = decode16(attrs, &bytes);
+	/* Allocated by decode_isize() */
+	assert(tuxnode->inline_size == bytes);
+	memcpy(tuxnode->inline_data, attrs, bytes);
+
+	return attrs + bytes;
+}
+
+/* Get size of inline data to decode */
+static unsigned decode_isize(struct inode *inode, void *attrs, unsigned size)
+{
+	struct sb *sb = tux_sb(inode->i_sb);
+	void *limit = attrs + size;
+	unsigned bytes;
+
+	while (attrs < limit - 1) {
+		unsigned kind, version;
+		attrs = decode_kind(attrs, &kind, &version);
+		switch (kind) {
+		case XATTR_ATTR:
+		case IDATA_ATTR:
+			attrs = decode16(attrs, &bytes);
+			if (kind == IDATA_ATTR && version == sb->version)
+				return bytes;
+			attrs += bytes;
+			continue;
+		}
+		attrs += atsize[kind];
+	}
+	return 0;
+}
+
 void *decode_kind(void *attrs, unsigned *kind, unsigned *version)
 {
 	unsigned head;
@@ -243,9 +319,16 @@ static void *decode_attrs(struct inode *inode, void *attrs, unsigned size)
 			attrs = decode64(attrs, &v64);
 			inode->i_mtime = spectime(v64 << TIME_ATTR_SHIFT);
 			break;
+		case IDATA_ATTR:
+			attrs = decode_idata(inode, attrs);
+			/* We don't use ->present for inline data */
+			goto skip_present;
 		case XATTR_ATTR:
 			attrs = decode_xattr(inode, attrs);
 			break;
+		case XSHARE_ATTR:
+			attrs = decode_xshare(inode, attrs);
+			break;
 		default:
 			return NULL;
 		}
@@ -266,7 +349,8 @@ static int iattr_encoded_size(struct btree *btree, void *data)
 	struct iattr_req_data *iattr_data = data;
 	struct inode *inode = iattr_data->inode;
 
-	return encode_asize(iattr_data->idata->present) + encode_xsize(inode);
+	return encode_asize(iattr_data->idata->present) +
+		encode_isize(inode, iattr_data->idata) + encode_xsize(inode);
 }
 
 static void iattr_encode(struct btree *btree, void *data, void *attrs, int size)
@@ -276,20 +360,32 @@ static void iattr_encode(struct btree *btree, void *data, void *attrs, int size)
 	void *attr;
 
 	attr = encode_attrs(btree, data, attrs, size);
+	attr = encode_idata(inode, iattr_data->idata, attr);
 	attr = encode_xattrs(inode, attr, attrs + size - attr);
 	assert(attr == attrs + size);
 }
 
 static int iattr_decode(struct btree *btree, void *data, void *attrs, int size)
 {
+	struct tux3_inode *tuxnode = tux_inode(data);
 	struct inode *inode = data;
-	unsigned xsize;
+	unsigned xsize, isize;
+
+	isize = decode_isize(inode, attrs, size);
+	if (isize) {
+		tuxnode->inline_data = malloc(isize);
+		if (!tuxnode->inline_data)
+			return -ENOMEM;
+		tuxnode->inline_size = isize;
+	}
 
 	xsize = decode_xsize(inode, attrs, size);
 	if (xsize) {
 		int err = new_xcache(inode, xsize);
-		if (err)
+		if (err) {
+			tux3_inline_free(inode);
 			return err;
+		}
 	}
 
 	decode_attrs(inode, attrs, size); // error???
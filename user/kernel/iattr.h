@@ -18,7 +18,7 @@ enum atkind {
 	/* Variable size (extended) attrs */
 	IDATA_ATTR	= 11,
 	XATTR_ATTR	= 12,
-	/* acl		= 13 */
+	XSHARE_ATTR	= 13,	/* xattr with shared value */
 	/* allocation hint = 14 */
 	RESERVED2_ATTR	= 15,
 	MAX_ATTRS,
@@ -35,6 +35,7 @@ enum atbit {
 	/* Variable size (extended) attrs */
 	IDATA_BIT	= 1 << IDATA_ATTR,
 	XATTR_BIT	= 1 << XATTR_ATTR,
+	XSHARE_BIT	= 1 << XSHARE_ATTR,
 };
 
 extern unsigned atsize[MAX_ATTRS];
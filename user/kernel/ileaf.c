@@ -10,6 +10,7 @@
 
 #include "tux3.h"
 #include "ileaf.h"
+#include "filemap_inline.h"
 
 #ifndef trace
 #define trace trace_on
@@ -131,10 +132,12 @@ static void ileaf_dump(struct btree *btree, void *vleaf)
 			struct inode *inode = &tuxnode.vfs_inode;
 			void *attrs = leaf->table + offset;
 
-			inode->i_sb = vfs_sb(btree->sb),
+			inode->i_sb = vfs_sb(btree->sb);
+			spin_lock_init(&tuxnode.lock);
 			attr_ops->decode(btree, inode, attrs, size);
 
 			free_xcache(inode);
+			tux3_inline_free(inode);
 		}
 		offset = limit;
 	}
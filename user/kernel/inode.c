@@ -10,6 +10,8 @@
 
 #include "tux3.h"
 #include "filemap_hole.h"
+#include "dir_index.h"
+#include "filemap_inline.h"
 #include "ileaf.h"
 #include "iattr.h"
 
@@ -17,6 +19,8 @@
 #define trace trace_on
 #endif
 
+#include "inode_inum.c"
+
 static void tux_setup_inode(struct inode *inode);
 
 static inline void tux_set_inum(struct inode *inode, inum_t inum)
@@ -96,30 +100,6 @@ static int is_defer_alloc_inum(struct inode *inode)
 	return !list_empty(&tux_inode(inode)->alloc_list);
 }
 
-/* must hold itree->btree.lock */
-static int find_defer_alloc_inum(struct sb *sb, inum_t inum)
-{
-	/*
-	 * FIXME: temporary hack. We should replace this by efficient
-	 * one something like bitmap.
-	 */
-#if 0
-	struct tux3_inode *tuxnode;
-
-	list_for_each_entry(tuxnode, &sb->alloc_inodes, alloc_list) {
-		if (tuxnode->inum == inum)
-			return 1;
-	}
-#else
-	struct inode *tmp = tux3_ilookup_nowait(sb, inum);
-	if (tmp) {
-		iput(tmp);
-		return 1;
-	}
-#endif
-	return 0;
-}
-
 /* must hold itree->btree.lock */
 static void add_defer_alloc_inum(struct inode *inode)
 {
@@ -139,85 +119,35 @@ void cancel_defer_alloc_inum(struct inode *inode)
 	struct sb *sb = tux_sb(inode->i_sb);
 
 	down_write(&itree_btree(sb)->lock);	/* FIXME: spinlock is enough? */
+	/* Inode is not going to be written, release reserved inum */
+	if (is_defer_alloc_inum(inode))
+		inum_map_free(sb, tux_inode(inode)->inum);
 	del_defer_alloc_inum(inode);
 	up_write(&itree_btree(sb)->lock);
 }
 
 /*
- * Inode btree expansion algorithm
- *
- * First probe for the inode goal.  This retreives the rightmost leaf that
- * contains an inode less than or equal to the goal.  (We could in theory avoid
- * retrieving any leaf at all in some cases if we observe that the the goal must
- * fall into an unallocated gap between two index keys, for what that is worth.
- * Probably not very much.)
+ * Free inum allocation
  *
- * If not at end then next key is greater than goal.  This block has the highest
- * ibase less than or equal to goal.  Ibase should be equal to btree key, so
- * assert.  Search block even if ibase is way too low.  If goal comes back equal
- * to next_key then there is no room to create more inodes in it, so advance to
- * the next block and repeat.
+ * Free inums are found from the in-memory inum map (inode_inum.c)
+ * instead of traversing itree. The map is seeded lazily from ileaves
+ * per region, and includes deferred allocation inums, so the found
+ * inum is free in both of itree and sb->alloc_inodes.
  *
- * Otherwise, expand the inum goal that came back.  If ibase was too low to
- * create the inode in that block then the low level split will fail and expand
- * will create a new ileaf block with ibase at the goal.  We round the
- * goal down to some binary multiple in ileaf_split to reduce the chance of
- * creating ileaf blocks with only a small number of inodes.  (Actually
- * we should only round down the split point, not the returned goal.)
+ * Find free inum from goal, and wrapped to TUX_NORMAL_INO if not
+ * found. This prevent to use less than TUX_NORMAL_INO if reserved
+ * ino was not specified explicitly.
  */
-
 static int find_free_inum(struct cursor *cursor, inum_t goal, inum_t *allocated)
 {
 	int ret;
 
-#ifndef __KERNEL__ /* FIXME: kill this, only mkfs path needs this */
-	/* If this is not mkfs path, it should have itree root */
-	if (!has_root(cursor->btree)) {
-		*allocated = goal;
-		return 0;
-	}
-#endif
-
-	ret = btree_probe(cursor, goal);
-	if (ret)
+	ret = inum_map_alloc(cursor, goal, TUXKEY_LIMIT, allocated);
+	if (ret != -ENOSPC)
 		return ret;
 
-	/* FIXME: need better allocation policy */
-
-	/*
-	 * Find free inum from goal, and wrapped to TUX_NORMAL_INO if
-	 * not found. This prevent to use less than TUX_NORMAL_INO if
-	 * reserved ino was not specified explicitly.
-	 */
-	ret = btree_traverse(cursor, goal, TUXKEY_LIMIT, ileaf_find_free,
-			     allocated);
-	if (ret < 0)
-		goto out;
-	if (ret > 0) {
-		/* Found free inum */
-		ret = 0;
-		goto out;
-	}
-
-	if (TUX_NORMAL_INO < goal) {
-		u64 len = goal - TUX_NORMAL_INO;
-
-		ret = btree_traverse(cursor, TUX_NORMAL_INO, len,
-				     ileaf_find_free, allocated);
-		if (ret < 0)
-			goto out;
-		if (ret > 0) {
-			/* Found free inum */
-			ret = 0;
-			goto out;
-		}
-	}
-
-	/* Couldn't find free inum */
-	ret = -ENOSPC;
-
-out:
-	release_cursor(cursor);
+	if (TUX_NORMAL_INO < goal)
+		ret = inum_map_alloc(cursor, TUX_NORMAL_INO, goal, allocated);
 
 	return ret;
 }
@@ -251,7 +181,8 @@ static int alloc_inum(struct inode *inode, inum_t goal)
 			goto error;
 
 		/*
-		 * Is this inum already used by deferred inum allocation?
+		 * Is this inum still used by in-core inode (e.g. inode
+		 * is purged from itree, but not evicted yet)?
 		 *
 		 * FIXME: Can be nfsd race happened, or fs corruption.
 		 * And we would want to move this outside btree->lock.
@@ -259,15 +190,9 @@ static int alloc_inum(struct inode *inode, inum_t goal)
 		if (insert_inode_locked4(inode, goal, tux_test, &goal) >= 0)
 			break;
 
-		/*
-		 * Skip deferred allocate inums.
-		 *
-		 * FIXME: This is inefficient, we should replace with
-		 * better way.
-		 */
+		/* Give back reserved inum, and try next */
+		inum_map_free(sb, goal);
 		goal++;
-		while (find_defer_alloc_inum(sb, goal))
-			goal++;
 	}
 
 	init_btree(&tux_inode(inode)->btree, sb, no_root, dtree_ops());
@@ -287,6 +212,8 @@ static int alloc_inum(struct inode *inode, inum_t goal)
 	if (goal >= TUX_NORMAL_INO) {
 		assert(sb->freeinodes > TUX_NORMAL_INO);
 		sb->freeinodes--;
+		/* Locality hint for next allocation in tux_create_dirent() */
+		sb->nextinum = goal + 1;
 	}
 
 error:
@@ -418,6 +345,15 @@ static int open_inode(struct inode *inode)
 	struct btree *itree = itree_btree(sb);
 	int err;
 
+#ifndef __KERNEL__
+	/* Recently evicted inode doesn't need to read itree */
+	if (iattr_cache_fill(inode)) {
+		check_present(inode);
+		tux_setup_inode(inode);
+		return 0;
+	}
+#endif
+
 	struct cursor *cursor = alloc_cursor(itree, 0);
 	if (!cursor)
 		return -ENOMEM;
@@ -478,34 +414,29 @@ struct inode *tux3_ilookup(struct sb *sb, inum_t inum)
 	return ilookup5(vfs_sb(sb), inum, tux_test, &inum);
 }
 
-static int save_inode(struct inode *inode, struct tux3_iattr_data *idata,
-		      unsigned delta)
+/*
+ * Write inode attributes at cursor. If cursor is not pointing the
+ * leaf including inum, probe again. So, if caller saves inodes in
+ * inum order, consecutive inodes in same ileaf share one probe.
+ */
+static int save_inode_at(struct cursor *cursor, struct inode *inode,
+			 struct tux3_iattr_data *idata)
 {
-	struct sb *sb = tux_sb(inode->i_sb);
-	struct btree *itree = itree_btree(sb);
+	struct btree *itree = cursor->btree;
+	struct sb *sb = itree->sb;
 	inum_t inum = tux_inode(inode)->inum;
-	int err = 0;
+	int err;
 
 	trace("save inode 0x%Lx", inum);
 
-#ifndef __KERNEL__
-	/* FIXME: kill this, only mkfs path needs this */
-	/* FIXME: this should be merged to btree_expand()? */
-	down_write(&itree->lock);
-	if (!has_root(itree))
-		err = alloc_empty_btree(itree);
-	up_write(&itree->lock);
-	if (err)
-		return err;
-#endif
-
-	struct cursor *cursor = alloc_cursor(itree, 1); /* +1 for new depth */
-	if (!cursor)
-		return -ENOMEM;
-
-	down_write(&cursor->btree->lock);
-	if ((err = btree_probe(cursor, inum)))
-		goto out;
+	if (cursor->level >= 0 &&
+	    (inum < cursor_this_key(cursor) || inum >= cursor_next_key(cursor)))
+		release_cursor(cursor);
+	if (cursor->level < 0) {
+		err = btree_probe(cursor, inum);
+		if (err)
+			return err;
+	}
 	/* paranoia check */
 	if (!is_defer_alloc_inum(inode)) {
 		unsigned size;
@@ -527,7 +458,7 @@ static int save_inode(struct inode *inode, struct tux3_iattr_data *idata,
 	};
 	err = btree_write(cursor, &rq.key);
 	if (err)
-		goto error_release;
+		return err;
 
 	/*
 	 * If inode is newly added into itree, account to on-disk usedinodes.
@@ -540,16 +471,10 @@ static int save_inode(struct inode *inode, struct tux3_iattr_data *idata,
 	}
 	del_defer_alloc_inum(inode);
 
-error_release:
-	release_cursor(cursor);
-out:
-	up_write(&cursor->btree->lock);
-	free_cursor(cursor);
-	return err;
+	return 0;
 }
 
-int tux3_save_inode(struct inode *inode, struct tux3_iattr_data *idata,
-		    unsigned delta)
+static void tux3_save_inode_check(struct inode *inode)
 {
 	/* Those inodes must not be marked as I_DIRTY_SYNC/DATASYNC. */
 	assert(tux_inode(inode)->inum != TUX_VOLMAP_INO &&
@@ -563,7 +488,70 @@ int tux3_save_inode(struct inode *inode, struct tux3_iattr_data *idata,
 		/* FIXME: assert(only btree should be changed); */
 		break;
 	}
-	return save_inode(inode, idata, delta);
+}
+
+/*
+ * Save attributes of inodes with one itree lock and cursor. reqs[]
+ * should be sorted by inum to share leaves.
+ */
+int tux3_save_inodes(struct sb *sb, struct save_inode_req *reqs,
+		     unsigned count, unsigned delta)
+{
+	struct btree *itree = itree_btree(sb);
+	struct cursor *cursor = NULL;
+	unsigned depth = 0;
+	int err = 0;
+
+#ifndef __KERNEL__
+	/* FIXME: kill this, only mkfs path needs this */
+	/* FIXME: this should be merged to btree_expand()? */
+	down_write(&itree->lock);
+	if (!has_root(itree))
+		err = alloc_empty_btree(itree);
+	up_write(&itree->lock);
+	if (err)
+		return err;
+#endif
+
+	down_write(&itree->lock);
+	for (unsigned i = 0; i < count; i++) {
+		tux3_save_inode_check(reqs[i].inode);
+
+		/* Leaf split can grow depth, cursor has room only for +1 */
+		if (!cursor || itree->root.depth != depth) {
+			if (cursor) {
+				release_cursor(cursor);
+				free_cursor(cursor);
+			}
+			depth = itree->root.depth;
+			cursor = alloc_cursor(itree, 1); /* +1 for new depth */
+			if (!cursor) {
+				err = -ENOMEM;
+				break;
+			}
+		}
+
+		err = save_inode_at(cursor, reqs[i].inode, &reqs[i].idata);
+		if (err)
+			break;
+	}
+	if (cursor) {
+		release_cursor(cursor);
+		free_cursor(cursor);
+	}
+	up_write(&itree->lock);
+
+	return err;
+}
+
+int tux3_save_inode(struct inode *inode, struct tux3_iattr_data *idata,
+		    unsigned delta)
+{
+	struct save_inode_req req = {
+		.inode	= inode,
+		.idata	= *idata,
+	};
+	return tux3_save_inodes(tux_sb(inode->i_sb), &req, 1, delta);
 }
 
 /* FIXME: we wait page under I/O though, we would like to fork it instead */
@@ -587,11 +575,12 @@ static int tux3_truncate(struct inode *inode, loff_t newsize)
 	oldsize = inode->i_size;
 	is_expand = newsize > oldsize;
 
-	if (!is_expand) {
+	if (!is_expand)
 		err = tux3_truncate_partial_block(inode, newsize);
-		if (err)
-			goto error;
-	}
+	else
+		err = tux3_inline_grow(inode, newsize);
+	if (err)
+		goto error;
 
 	/* Change i_size, then clean buffers */
 	i_size_write(inode, newsize);
@@ -623,6 +612,7 @@ static int purge_inode(struct inode *inode)
 	struct sb *sb = tux_sb(inode->i_sb);
 	struct btree *itree = itree_btree(sb);
 	int reserved_inum = tux_inode(inode)->inum < TUX_NORMAL_INO;
+	int err;
 
 	down_write(&itree->lock);	/* FIXME: spinlock is enough? */
 
@@ -636,6 +626,7 @@ static int purge_inode(struct inode *inode)
 	}
 
 	if (is_defer_alloc_inum(inode)) {
+		inum_map_free(sb, tux_inode(inode)->inum);
 		del_defer_alloc_inum(inode);
 		up_write(&itree->lock);
 		return 0;
@@ -653,7 +644,16 @@ static int purge_inode(struct inode *inode)
 	}
 
 	/* Remove inum from inode btree */
-	return btree_chop(itree, tux_inode(inode)->inum, 1);
+	err = btree_chop(itree, tux_inode(inode)->inum, 1);
+	if (err)
+		return err;
+
+	/* Release inum after chop, otherwise region load can see it */
+	down_write(&itree->lock);
+	inum_map_free(sb, tux_inode(inode)->inum);
+	up_write(&itree->lock);
+
+	return 0;
 }
 
 static int tux3_truncate_blocks(struct inode *inode, loff_t newsize)
@@ -779,6 +779,8 @@ void tux3_evict_inode(struct inode *inode)
 
 	clear_inode(inode);
 	free_xcache(inode);
+	tux3_inline_free(inode);
+	tux3_dir_index_free(inode);
 }
 
 #ifdef __KERNEL__
@@ -810,7 +812,7 @@ int tux3_sync_file(struct file *file, loff_t start, loff_t end, int datasync)
 			  start, end, datasync);
 	}
 
-	return force_delta(sb);
+	return fsync_delta(sb);
 }
 
 int tux3_getattr(struct vfsmount *mnt, struct dentry *dentry, struct kstat *stat)
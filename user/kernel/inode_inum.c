@@ -0,0 +1,176 @@
+/*
+ * In-memory free inum index
+ *
+ * The inum space is split into fixed size regions. Each region has a
+ * bitmap of inums in use, seeded lazily from the ileaves covering the
+ * region on first touch. Deferred inum allocations (inodes not yet
+ * written to itree) set the bit at allocation time, so the bitmap is
+ * the union of itree and sb->alloc_inodes, and we never have to walk
+ * either of them again to skip in-use inums.
+ *
+ * All functions here must hold itree->btree.lock for write.
+ */
+
+#include "tux3.h"
+#include "ileaf.h"
+
+#define INUM_REGION_BITS	15
+#define INUM_REGION_SIZE	((inum_t)1 << INUM_REGION_BITS)
+#define INUM_REGION_MASK	(INUM_REGION_SIZE - 1)
+
+struct inum_region {
+	struct hlist_node hash;		/* link for inum_map->hash */
+	inum_t base;			/* first inum of this region */
+	unsigned used;			/* number of bits set in bitmap */
+	unsigned long bitmap[INUM_REGION_SIZE / BITS_PER_LONG];
+};
+
+static struct hlist_head *inum_map_head(struct inum_map *map, inum_t base)
+{
+	return map->hash + hash_64(base >> INUM_REGION_BITS, INUM_MAP_HASH_BITS);
+}
+
+void inum_map_init(struct inum_map *map)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(map->hash); i++)
+		INIT_HLIST_HEAD(&map->hash[i]);
+}
+
+void inum_map_destroy(struct inum_map *map)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(map->hash); i++) {
+		struct inum_region *region;
+		struct hlist_node *n;
+
+		hlist_for_each_entry_safe(region, n, &map->hash[i], hash) {
+			hlist_del(&region->hash);
+			free(region);
+		}
+	}
+}
+
+static struct inum_region *inum_map_lookup(struct inum_map *map, inum_t base)
+{
+	struct inum_region *region;
+
+	hlist_for_each_entry(region, inum_map_head(map, base), hash) {
+		if (region->base == base)
+			return region;
+	}
+	return NULL;
+}
+
+static int inum_region_seed(struct btree *btree, inum_t inum, void *attrs,
+			    unsigned size, void *data)
+{
+	struct inum_region *region = data;
+
+	if (!__test_and_set_bit(inum - region->base, region->bitmap))
+		region->used++;
+	return 0;
+}
+
+/* Mark inums already in itree for this region */
+static int inum_region_load(struct cursor *cursor, struct inum_region *region)
+{
+	struct ileaf_enumrate_cb cb = {
+		.callback	= inum_region_seed,
+		.data		= region,
+	};
+	int err;
+
+	/* mkfs path doesn't have itree root yet */
+	if (!has_root(cursor->btree))
+		return 0;
+
+	err = btree_probe(cursor, region->base);
+	if (err)
+		return err;
+
+	err = btree_traverse(cursor, region->base, INUM_REGION_SIZE,
+			     ileaf_enumerate, &cb);
+	release_cursor(cursor);
+
+	return err;
+}
+
+static struct inum_region *inum_map_get(struct cursor *cursor, inum_t base)
+{
+	struct sb *sb = cursor->btree->sb;
+	struct inum_region *region;
+	int err;
+
+	region = inum_map_lookup(&sb->inum_map, base);
+	if (region)
+		return region;
+
+	region = malloc(sizeof(*region));
+	if (!region)
+		return ERR_PTR(-ENOMEM);
+	memset(region, 0, sizeof(*region));
+	region->base = base;
+
+	err = inum_region_load(cursor, region);
+	if (err) {
+		free(region);
+		return ERR_PTR(err);
+	}
+
+	hlist_add_head(&region->hash, inum_map_head(&sb->inum_map, base));
+
+	return region;
+}
+
+/*
+ * Find and reserve the first free inum in range [goal, limit).
+ *
+ * return value:
+ * 0 - found, and reserved
+ * -ENOSPC - not found
+ * < 0 - error
+ */
+int inum_map_alloc(struct cursor *cursor, inum_t goal, inum_t limit,
+		   inum_t *allocated)
+{
+	while (goal < limit) {
+		inum_t base = goal & ~INUM_REGION_MASK;
+		struct inum_region *region;
+		unsigned long bit;
+
+		region = inum_map_get(cursor, base);
+		if (IS_ERR(region))
+			return PTR_ERR(region);
+
+		if (region->used < INUM_REGION_SIZE) {
+			bit = find_next_zero_bit(region->bitmap,
+						 INUM_REGION_SIZE,
+						 goal & INUM_REGION_MASK);
+			if (bit < INUM_REGION_SIZE && base + bit < limit) {
+				__set_bit(bit, region->bitmap);
+				region->used++;
+				*allocated = base + bit;
+				return 0;
+			}
+		}
+
+		goal = base + INUM_REGION_SIZE;
+	}
+
+	return -ENOSPC;
+}
+
+/* Release inum reserved by inum_map_alloc() or loaded from itree */
+void inum_map_free(struct sb *sb, inum_t inum)
+{
+	inum_t base = inum & ~INUM_REGION_MASK;
+	struct inum_region *region;
+
+	/* If region is not loaded yet, itree will tell the truth */
+	region = inum_map_lookup(&sb->inum_map, base);
+	if (region && __test_and_clear_bit(inum - base, region->bitmap))
+		region->used--;
+}
@@ -22,6 +22,8 @@
  *  - There is no direct mapping from the log block cache to physical disk,
  *    instead there is a reverse chain starting from sb->logchain.  Log blocks
  *    are read only at replay on mount and written only at delta transition.
+ *    Each link of the chain also has the count of physically contiguous log
+ *    blocks ending at the linked block, so replay reads those at once.
  *
  *  - sb->super.logcount: count of log blocks in unify cycle
  *  - sb->lognext: Logmap index of next log block in delta cycle
@@ -55,9 +57,17 @@
  *  - Log block header records size of log block payload in ->bytes.
  *
  *  - Each log block entry has a one byte type code implying its length.
+ *    (Except LOG_BITMAP_BATCH, see below)
  *
  *  - Integer fields are big endian, byte aligned.
  *
+ *  - LOG_BALLOC, LOG_BFREE, LOG_BFREE_ON_UNIFY and LOG_BFREE_RELOG are
+ *    emitted as LOG_BITMAP_BATCH, and the consecutive logs of same
+ *    intent are appended to the same entry.  LOG_BITMAP_BATCH has the
+ *    code, intent, byte length of payload (up to 255), then pairs of
+ *    varint.  First is zigzag encoded difference of block from end of
+ *    previous pair (from 0 for first pair), second is count.
+ *
  * Log block locking
  *
  *  - Log block must be touched only by the backend. So, we don't need to lock.
@@ -84,14 +94,69 @@ unsigned log_size[] = {
 	[LOG_FREEBLOCKS]	= 7,
 	[LOG_UNIFY]		= 1,
 	[LOG_DELTA]		= 1,
+	[LOG_BITMAP_BATCH]	= 3,	/* header only, payload follows */
 };
 
+#define LOG_BATCH_HEAD		3	/* code, intent, bytes */
+#define LOG_BATCH_MAX		255	/* max bytes of payload */
+
+/* Size of log entry at data (including code) */
+unsigned log_entry_size(unsigned char *data)
+{
+	if (*data == LOG_BITMAP_BATCH)
+		return LOG_BATCH_HEAD + data[2];
+	return log_size[*data];
+}
+
+static inline u64 zigzag_encode(s64 val)
+{
+	return ((u64)val << 1) ^ (u64)(val >> 63);
+}
+
+static inline s64 zigzag_decode(u64 val)
+{
+	return (s64)(val >> 1) ^ -(s64)(val & 1);
+}
+
+/* Initialize decoder for LOG_BITMAP_BATCH entry at data */
+void log_batch_init(struct log_batch *batch, unsigned char *data)
+{
+	assert(*data == LOG_BITMAP_BATCH);
+	batch->intent = data[1];
+	batch->pos = data + LOG_BATCH_HEAD;
+	batch->limit = batch->pos + data[2];
+	batch->end = 0;
+}
+
+/* Decode next pair. Return 1 if decoded, 0 if no more, or -EINVAL */
+int log_batch_next(struct log_batch *batch, block_t *block, unsigned *count)
+{
+	u64 delta, val;
+
+	if (batch->pos == batch->limit)
+		return 0;
+
+	batch->pos = decode_varint(batch->pos, batch->limit, &delta);
+	if (!batch->pos)
+		return -EINVAL;
+	batch->pos = decode_varint(batch->pos, batch->limit, &val);
+	if (!batch->pos || !val || val > UINT_MAX)
+		return -EINVAL;
+
+	*block = batch->end + zigzag_decode(delta);
+	*count = val;
+	batch->end = *block + *count;
+
+	return 1;
+}
+
 void log_next(struct sb *sb)
 {
 	/* FIXME: error handling of blockget() */
 	sb->logbuf = blockget(mapping(sb->logmap), sb->lognext++);
 	sb->logpos = bufdata(sb->logbuf) + sizeof(struct logblock);
 	sb->logtop = bufdata(sb->logbuf) + sb->blocksize;
+	sb->logbatch = NULL;
 }
 
 void log_drop(struct sb *sb)
@@ -99,6 +164,7 @@ void log_drop(struct sb *sb)
 	blockput(sb->logbuf);
 	sb->logbuf = NULL;
 	sb->logtop = sb->logpos = NULL;
+	sb->logbatch = NULL;
 }
 
 void log_finish(struct sb *sb)
@@ -182,15 +248,18 @@ int tux3_logmap_io(int rw, struct bufvec *bufvec)
 
 		for (p = seg; p < seg + segs; p++) {
 			block_t block, limit;
+			unsigned contig = 0;
 
 			/*
-			 * Link log blocks to logchain.
-			 *
-			 * FIXME: making the link for each block is
-			 * inefficient to read on replay. Instead, we would be
-			 * able to use the link of extent. With it, we can
-			 * read multiple blocks at once.
+			 * Link log blocks to logchain with the count of
+			 * contiguous log blocks, so replay can read
+			 * multiple blocks at once. If previous log block
+			 * is just before this extent, extend its count.
 			 */
+			if (sb->super.logchain &&
+			    logchain_block(sb->super.logchain) + 1 == p->block)
+				contig = logchain_count(sb->super.logchain);
+
 			block = p->block;
 			limit = p->block + p->count;
 			bufvec_buffer_for_each_contig(buffer, bufvec) {
@@ -199,8 +268,8 @@ int tux3_logmap_io(int rw, struct bufvec *bufvec)
 				assert(log->magic==cpu_to_be16(TUX3_MAGIC_LOG));
 				log->logchain = sb->super.logchain;
 
-				trace("logchain %lld", block);
-				sb->super.logchain = cpu_to_be64(block);
+				trace("logchain %lld, contig %u", block, contig + 1);
+				sb->super.logchain = logchain_link(block, ++contig);
 				block++;
 				if (block == limit)
 					break;
@@ -251,14 +320,6 @@ static void log_u16_u48(struct sb *sb, u8 intent, u16 v1, u64 v2)
 	log_end(sb, encode48(data, v2));
 }
 
-static void log_u32_u48(struct sb *sb, u8 intent, u32 v1, u64 v2)
-{
-	unsigned char *data = log_begin(sb, log_size[intent]);
-	*data++ = intent;
-	data = encode32(data, v1);
-	log_end(sb, encode48(data, v2));
-}
-
 static void log_u48_u48(struct sb *sb, u8 intent, u64 v1, u64 v2)
 {
 	unsigned char *data = log_begin(sb, log_size[intent]);
@@ -285,32 +346,68 @@ static void log_u48_u48_u48(struct sb *sb, u8 intent, u64 v1, u64 v2, u64 v3)
 	log_end(sb, encode48(data, v3));
 }
 
+/*
+ * Add bitmap log to LOG_BITMAP_BATCH. If the last entry is the batch
+ * of same intent and has space, append to it. Otherwise, start new
+ * batch.
+ */
+static void log_bitmap(struct sb *sb, u8 intent, block_t block, unsigned count)
+{
+	unsigned char pair[20], *batch = sb->logbatch, *data, *end;
+	unsigned bytes;
+
+	if (batch && batch[1] == intent &&
+	    batch + LOG_BATCH_HEAD + batch[2] == sb->logpos) {
+		end = encode_varint(pair, zigzag_encode(block - sb->logbatch_end));
+		end = encode_varint(end, count);
+		bytes = end - pair;
+		if (batch[2] + bytes <= LOG_BATCH_MAX &&
+		    sb->logpos + bytes <= sb->logtop) {
+			memcpy(sb->logpos, pair, bytes);
+			batch[2] += bytes;
+			sb->logbatch_end = block + count;
+			log_end(sb, sb->logpos + bytes);
+			return;
+		}
+	}
+
+	/* Start new batch, the first pair is from 0 */
+	end = encode_varint(pair, zigzag_encode(block));
+	end = encode_varint(end, count);
+	bytes = end - pair;
+
+	data = log_begin(sb, LOG_BATCH_HEAD + bytes);
+	data[0] = LOG_BITMAP_BATCH;
+	data[1] = intent;
+	data[2] = bytes;
+	memcpy(data + LOG_BATCH_HEAD, pair, bytes);
+	sb->logbatch = data;
+	sb->logbatch_end = block + count;
+	log_end(sb, data + LOG_BATCH_HEAD + bytes);
+}
+
 /* balloc() until next unify */
 void log_balloc(struct sb *sb, block_t block, unsigned count)
 {
-	/* FIXME: 32bits count is too big? */
-	log_u32_u48(sb, LOG_BALLOC, count, block);
+	log_bitmap(sb, LOG_BALLOC, block, count);
 }
 
 /* bfree() */
 void log_bfree(struct sb *sb, block_t block, unsigned count)
 {
-	/* FIXME: 32bits count is too big? */
-	log_u32_u48(sb, LOG_BFREE, count, block);
+	log_bitmap(sb, LOG_BFREE, block, count);
 }
 
 /* Defered bfree() until after next unify */
 void log_bfree_on_unify(struct sb *sb, block_t block, unsigned count)
 {
-	/* FIXME: 32bits count is too big? */
-	log_u32_u48(sb, LOG_BFREE_ON_UNIFY, count, block);
+	log_bitmap(sb, LOG_BFREE_ON_UNIFY, block, count);
 }
 
 /* Same with log_bfree() (re-logged log_bfree_on_unify() on unify) */
 void log_bfree_relog(struct sb *sb, block_t block, unsigned count)
 {
-	/* FIXME: 32bits count is too big? */
-	log_u32_u48(sb, LOG_BFREE_RELOG, count, block);
+	log_bitmap(sb, LOG_BFREE_RELOG, block, count);
 }
 
 /*
@@ -580,14 +677,68 @@ int stash_walk(struct sb *sb, struct stash *stash, unstash_t actor)
 
 /* Deferred free blocks list */
 
+#define STASH_PAGE_VALUES	(PAGE_SIZE / sizeof(u64))
+#define DEFREE_COUNT_MAX	((unsigned)(ULLONG_MAX >> 48))
+
+static inline block_t defree_block(u64 val)
+{
+	return val & ~(-1ULL << 48);
+}
+
+static inline unsigned defree_count(u64 val)
+{
+	return val >> 48;
+}
+
+static inline u64 defree_value(block_t block, unsigned count)
+{
+	return ((u64)count << 48) + block;
+}
+
+/* Last value in stash, or NULL if current page is empty */
+static u64 *stash_last(struct stash *stash)
+{
+	if (!stash->pos || stash->pos == stash->top - STASH_PAGE_VALUES)
+		return NULL;
+	return stash->pos - 1;
+}
+
+/* Try to merge extent into last stashed extent */
+static int defer_bfree_merge(struct stash *defree, block_t block,
+			     unsigned count)
+{
+	u64 *last = stash_last(defree);
+	block_t lastblock;
+	unsigned lastcount;
+
+	if (!last)
+		return 0;
+	lastblock = defree_block(*last);
+	lastcount = defree_count(*last);
+	if (lastcount + count > DEFREE_COUNT_MAX)
+		return 0;
+
+	if (lastblock + lastcount == block)
+		*last = defree_value(lastblock, lastcount + count);
+	else if (block + count == lastblock)
+		*last = defree_value(block, lastcount + count);
+	else
+		return 0;
+	return 1;
+}
+
 int defer_bfree(struct sb *sb, struct stash *defree,
 		block_t block, unsigned count)
 {
-	static const unsigned limit = ULLONG_MAX >> 48;
+	static const unsigned limit = DEFREE_COUNT_MAX;
 
 	assert(count > 0);
 	assert(block + count <= sb->volblocks);
 
+	/* Frees of adjacent extents in a row are common (e.g. truncate) */
+	if (defer_bfree_merge(defree, block, count))
+		return 0;
+
 	/*
 	 * count field of stash is 16bits. So, this separates to
 	 * multiple records to avoid overflow.
@@ -596,7 +747,7 @@ int defer_bfree(struct sb *sb, struct stash *defree,
 		unsigned c = min(count, limit);
 		int err;
 
-		err = stash_value(defree, ((u64)c << 48) + block);
+		err = stash_value(defree, defree_value(block, c));
 		if (err)
 			return err;
 
@@ -607,6 +758,182 @@ int defer_bfree(struct sb *sb, struct stash *defree,
 	return 0;
 }
 
+/*
+ * Make table of stash pages, to access values in stash by index.
+ * Returns number of values, or -ENOMEM.
+ */
+static long stash_table(struct stash *stash, struct page ***table_ret,
+			unsigned *pages_ret)
+{
+	struct flink_head *head = &stash->head;
+	struct link *link, *first;
+	unsigned pages = 0, i = 0;
+	struct page **table;
+
+	*table_ret = NULL;
+	*pages_ret = 0;
+	if (flink_empty(head))
+		return 0;
+
+	link = first = flink_next(head);
+	do {
+		pages++;
+		link = link->next;
+	} while (link != first);
+
+	table = malloc(pages * sizeof(*table));
+	if (!table)
+		return -ENOMEM;
+	do {
+		table[i++] = __link_entry(link, struct page, private);
+		link = link->next;
+	} while (link != first);
+
+	*table_ret = table;
+	*pages_ret = pages;
+	/* The last page is current page */
+	return (long)(pages - 1) * STASH_PAGE_VALUES +
+		(stash->pos - (u64 *)page_address(table[pages - 1]));
+}
+
+static inline u64 *stash_at(struct page **table, unsigned long i)
+{
+	u64 *vec = page_address(table[i / STASH_PAGE_VALUES]);
+	return vec + i % STASH_PAGE_VALUES;
+}
+
+static inline void stash_swap(u64 *a, u64 *b)
+{
+	u64 tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+static void defree_sift(struct page **table, unsigned long i, unsigned long n)
+{
+	while (1) {
+		unsigned long child = 2 * i + 1;
+		u64 *p, *c;
+
+		if (child >= n)
+			break;
+		c = stash_at(table, child);
+		if (child + 1 < n) {
+			u64 *c2 = stash_at(table, child + 1);
+			if (defree_block(*c2) > defree_block(*c)) {
+				c = c2;
+				child++;
+			}
+		}
+		p = stash_at(table, i);
+		if (defree_block(*p) >= defree_block(*c))
+			break;
+		stash_swap(p, c);
+		i = child;
+	}
+}
+
+/*
+ * Sort deferred frees by block, then merge adjacent extents. This
+ * sorts stash pages in place by heapsort, so there is no large
+ * allocation even for millions of extents.
+ */
+int sort_defer_bfree(struct stash *defree)
+{
+	struct page **table;
+	unsigned long i, n, last;
+	unsigned pages, keep;
+	long nr;
+
+	nr = stash_table(defree, &table, &pages);
+	if (nr <= 1) {
+		free(table);
+		return nr < 0 ? nr : 0;
+	}
+	n = nr;
+
+	for (i = n / 2; i-- > 0;)
+		defree_sift(table, i, n);
+	for (i = n - 1; i > 0; i--) {
+		stash_swap(stash_at(table, 0), stash_at(table, i));
+		defree_sift(table, 0, i);
+	}
+
+	/* Merge adjacent extents */
+	last = 0;
+	for (i = 1; i < n; i++) {
+		u64 *prev = stash_at(table, last), val = *stash_at(table, i);
+		block_t block = defree_block(*prev);
+		unsigned count = defree_count(*prev);
+
+		if (block + count == defree_block(val) &&
+		    count + defree_count(val) <= DEFREE_COUNT_MAX)
+			*prev = defree_value(block, count + defree_count(val));
+		else
+			*stash_at(table, ++last) = val;
+	}
+
+	/* Relink pages still used, and free others */
+	n = last + 1;
+	keep = (n - 1) / STASH_PAGE_VALUES + 1;
+	init_flink_head(&defree->head);
+	for (i = 0; i < pages; i++) {
+		if (i >= keep)
+			__free_page(table[i]);
+		else if (i == 0)
+			flink_first_add(page_link(table[i]), &defree->head);
+		else
+			flink_add(page_link(table[i]), &defree->head);
+	}
+	defree->pos = stash_at(table, n - 1) + 1;
+	defree->top = page_address(table[keep - 1]) + PAGE_SIZE;
+
+	free(table);
+	return 0;
+}
+
+/*
+ * Apply deferred frees in sorted order. The extents on same bitmap
+ * block are freed with one blockdirty().
+ */
+int apply_defer_bfree(struct sb *sb, struct stash *defree)
+{
+	struct buffer_head *pin = NULL;
+	struct flink_head *head = &defree->head;
+	struct page *page;
+	int err;
+
+	/* If sort failed, we can still free in original order */
+	sort_defer_bfree(defree);
+
+	if (flink_empty(head))
+		return 0;
+	while (1) {
+		page = __flink_next_entry(head, struct page, private);
+		u64 *vec = page_address(page);
+		u64 *top = page_address(page) + PAGE_SIZE;
+
+		if (top == defree->top)
+			top = defree->pos;
+		for (; vec < top; vec++) {
+			err = bfree_pinned(sb, &pin, defree_block(*vec),
+					   defree_count(*vec));
+			if (err)
+				goto out;
+			sb->commit_counters.defree++;
+		}
+		if (flink_is_last(head))
+			break;
+		flink_del_next(head);
+		__free_page(page);
+	}
+	defree->pos = page_address(page);
+	err = 0;
+out:
+	bfree_unpin(&pin);
+	return err;
+}
+
 void destroy_defer_bfree(struct stash *defree)
 {
 	empty_stash(defree);
@@ -33,9 +33,25 @@ struct orphan {
 /* list_entry() for orphan object (orphan del, LOG_ORPHAN_ADD on replay) list */
 #define orphan_entry(x)		list_entry(x, struct orphan, list)
 
+static struct kmem_cache *tux_orphan_cachep;
+
+int __init tux3_init_orphan_cache(void)
+{
+	tux_orphan_cachep = kmem_cache_create("tux3_orphan_cache",
+			sizeof(struct orphan), 0, 0, NULL);
+	if (tux_orphan_cachep == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+void tux3_destroy_orphan_cache(void)
+{
+	kmem_cache_destroy(tux_orphan_cachep);
+}
+
 static struct orphan *alloc_orphan(inum_t inum)
 {
-	struct orphan *orphan = malloc(sizeof(struct orphan));
+	struct orphan *orphan = kmem_cache_alloc(tux_orphan_cachep, GFP_NOFS);
 	if (!orphan)
 		return ERR_PTR(-ENOMEM);
 
@@ -46,7 +62,7 @@ static struct orphan *alloc_orphan(inum_t inum)
 
 static void free_orphan(struct orphan *orphan)
 {
-	free(orphan);
+	kmem_cache_free(tux_orphan_cachep, orphan);
 }
 
 /* Caller must care about locking if needed */
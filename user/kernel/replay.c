@@ -30,6 +30,7 @@ static const char *log_name[] = {
 	X(LOG_FREEBLOCKS),
 	X(LOG_UNIFY),
 	X(LOG_DELTA),
+	X(LOG_BITMAP_BATCH),
 #undef X
 };
 
@@ -46,16 +47,22 @@ static struct replay *alloc_replay(struct sb *sb, unsigned logcount)
 	rp->unify_index = -1;
 	memset(rp->blocknrs, 0, logcount * sizeof(block_t));
 
+	INIT_LIST_HEAD(&rp->bitmap_updates);
+	INIT_LIST_HEAD(&rp->bitmap_chunks);
+
 	INIT_LIST_HEAD(&rp->log_orphan_add);
 	INIT_LIST_HEAD(&rp->orphan_in_otree);
 
 	return rp;
 }
 
+static void replay_free_bitmap(struct replay *rp);
+
 static void free_replay(struct replay *rp)
 {
 	assert(list_empty(&rp->log_orphan_add));
 	assert(list_empty(&rp->orphan_in_otree));
+	replay_free_bitmap(rp);
 	free(rp);
 }
 
@@ -86,11 +93,29 @@ static int replay_check_log(struct replay *rp, struct buffer_head *logbuf)
 			rp->unify_index = bufindex(logbuf);
 		}
 
-		if (log_size[code] == 0) {
+		if (code >= LOG_TYPES || log_size[code] == 0) {
 			tux3_err(sb, "invalid log code: 0x%02x", code);
 			return -EINVAL;
 		}
-		data += log_size[code];
+		if (code == LOG_BITMAP_BATCH) {
+			struct log_batch batch;
+			block_t block;
+			unsigned count;
+			int ret;
+
+			log_batch_init(&batch, data);
+			while ((ret = log_batch_next(&batch, &block, &count)) > 0)
+				;
+			if (ret < 0) {
+				tux3_err(sb, "invalid bitmap batch log");
+				return -EINVAL;
+			}
+		}
+		data += log_entry_size(data);
+	}
+	if (data != log->data + be16_to_cpu(log->bytes)) {
+		tux3_err(sb, "log entry is over log bytes");
+		return -EINVAL;
 	}
 
 	return 0;
@@ -111,13 +136,60 @@ static void replay_unpin_logblocks(struct sb *sb, unsigned i, unsigned logcount)
 	}
 }
 
+/* Max number of logblocks to read at once */
+#define REPLAY_READ_MAX		64
+
+/*
+ * Read and pin count of logblocks at once. Those are logblocks from
+ * index to index + count - 1, and physically contiguous from block.
+ */
+static int replay_read_logblocks(struct replay *rp, unsigned index,
+				 unsigned count, block_t block)
+{
+	struct sb *sb = rp->sb;
+	struct buffer_head *buffers[REPLAY_READ_MAX];
+	unsigned i;
+	int err;
+
+	for (i = 0; i < count; i++) {
+		buffers[i] = blockget(mapping(sb->logmap), index + i);
+		if (!buffers[i]) {
+			err = -ENOMEM;
+			goto error;
+		}
+		assert(bufindex(buffers[i]) == index + i);
+	}
+
+	err = blockio_multi(READ, sb, buffers, count, block);
+	if (err)
+		goto error;
+
+	/* Check from newer logblock to find latest unify */
+	while (i-- > 0) {
+		err = replay_check_log(rp, buffers[i]);
+		if (err) {
+			i = count;
+			goto error;
+		}
+
+		/* Store index => blocknr map */
+		rp->blocknrs[index + i] = block + i;
+	}
+
+	return 0;
+
+error:
+	while (i-- > 0)
+		blockput(buffers[i]);
+	return err;
+}
+
 /* Prepare log info for replay and pin logblocks. */
 static struct replay *replay_prepare(struct sb *sb)
 {
-	block_t logchain = be64_to_cpu(sb->super.logchain);
+	__be64 logchain = sb->super.logchain;
 	unsigned i, logcount = be32_to_cpu(sb->super.logcount);
 	struct replay *rp;
-	struct buffer_head *buffer;
 	int err;
 
 	/* FIXME: this address array is quick hack. Rethink about log
@@ -126,32 +198,30 @@ static struct replay *replay_prepare(struct sb *sb)
 	if (IS_ERR(rp))
 		return rp;
 
-	/* FIXME: maybe, we should use bufvec to read log blocks */
+	/*
+	 * Follow the logchain from newest, and read contiguous
+	 * logblocks in the link at once.
+	 */
 	trace("load %u logblocks", logcount);
 	i = logcount;
-	while (i-- > 0) {
+	while (i > 0) {
+		block_t block = logchain_block(logchain);
+		unsigned count = logchain_count(logchain);
+		struct buffer_head *buffer;
 		struct logblock *log;
 
-		buffer = blockget(mapping(sb->logmap), i);
-		if (!buffer) {
-			i++;
-			err = -ENOMEM;
-			goto error;
-		}
-		assert(bufindex(buffer) == i);
-		err = blockio(READ, sb, buffer, logchain);
+		count = min(count, min_t(unsigned, i, REPLAY_READ_MAX));
+		err = replay_read_logblocks(rp, i - count, count,
+					    block - count + 1);
 		if (err)
 			goto error;
+		i -= count;
 
-		err = replay_check_log(rp, buffer);
-		if (err)
-			goto error;
-
-		/* Store index => blocknr map */
-		rp->blocknrs[bufindex(buffer)] = logchain;
-
+		/* Oldest logblock in this read has the next link */
+		buffer = peekblk(mapping(sb->logmap), i);
 		log = bufdata(buffer);
-		logchain = be64_to_cpu(log->logchain);
+		logchain = log->logchain;
+		blockput(buffer);
 	}
 
 	return rp;
@@ -178,6 +248,51 @@ static void replay_done(struct replay *rp)
 
 typedef int (*replay_log_t)(struct replay *, struct buffer_head *);
 
+/*
+ * Stage1 reads the old bnode of LOG_BNODE_REDIRECT one by one (other
+ * bnode logs work on buffers made by earlier logs). Scan logs, and
+ * start to read those at once before replaying.
+ */
+static void replay_readahead_bnodes(struct replay *rp)
+{
+	struct sb *sb = rp->sb;
+	unsigned i, logcount = be32_to_cpu(sb->super.logcount);
+	block_t start = 0;
+	unsigned count = 0;
+
+	for (i = rp->unify_index; i < logcount; i++) {
+		struct buffer_head *logbuf = peekblk(mapping(sb->logmap), i);
+		struct logblock *log = bufdata(logbuf);
+		unsigned char *data = log->data;
+		unsigned char *limit = log->data + be16_to_cpu(log->bytes);
+
+		if (i == rp->unify_index)
+			data = rp->unify_pos;
+		while (data < limit) {
+			/* Broken log is reported by replay_log_stage1() */
+			if (*data >= LOG_TYPES || !log_entry_size(data))
+				break;
+
+			if (*data == LOG_BNODE_REDIRECT) {
+				u64 oldblock;
+				decode48(data + 1, &oldblock);
+				if (count && oldblock == start + count)
+					count++;
+				else {
+					if (count)
+						vol_readahead(sb, start, count);
+					start = oldblock;
+					count = 1;
+				}
+			}
+			data += log_entry_size(data);
+		}
+		blockput(logbuf);
+	}
+	if (count)
+		vol_readahead(sb, start, count);
+}
+
 static int replay_log_stage1(struct replay *rp, struct buffer_head *logbuf)
 {
 	struct sb *sb = rp->sb;
@@ -318,7 +433,8 @@ static int replay_log_stage1(struct replay *rp, struct buffer_head *logbuf)
 		case LOG_ORPHAN_DEL:
 		case LOG_UNIFY:
 		case LOG_DELTA:
-			data += log_size[code] - sizeof(code);
+		case LOG_BITMAP_BATCH:
+			data += log_entry_size(data - 1) - sizeof(code);
 			break;
 		default:
 			tux3_err(rp->sb, "unrecognized log code 0x%x", code);
@@ -329,6 +445,186 @@ static int replay_log_stage1(struct replay *rp, struct buffer_head *logbuf)
 	return 0;
 }
 
+/*
+ * Bitmap updates of stage2 are not applied while decoding logs.
+ * Those are recorded (split at bitmap block boundary), sorted by
+ * bitmap block, then applied with merging contiguous updates. So each
+ * bitmap block is visited only once.
+ *
+ * list_sort() is stable, so the updates for the same bit are still
+ * applied in log order.
+ */
+struct replay_bitmap {
+	struct list_head list;		/* link for rp->bitmap_updates */
+	block_t start;
+	unsigned count;
+	int set;
+};
+
+#define REPLAY_BITMAP_CHUNK	128
+
+struct replay_bitmap_chunk {
+	struct list_head list;		/* link for rp->bitmap_chunks */
+	unsigned used;
+	struct replay_bitmap updates[REPLAY_BITMAP_CHUNK];
+};
+
+static struct replay_bitmap *replay_bitmap_alloc(struct replay *rp)
+{
+	struct replay_bitmap_chunk *chunk = NULL;
+
+	if (!list_empty(&rp->bitmap_chunks)) {
+		chunk = list_entry(rp->bitmap_chunks.prev,
+				   struct replay_bitmap_chunk, list);
+		if (chunk->used == REPLAY_BITMAP_CHUNK)
+			chunk = NULL;
+	}
+	if (!chunk) {
+		chunk = malloc(sizeof(*chunk));
+		if (!chunk)
+			return NULL;
+		chunk->used = 0;
+		list_add_tail(&chunk->list, &rp->bitmap_chunks);
+	}
+
+	return &chunk->updates[chunk->used++];
+}
+
+static void replay_free_bitmap(struct replay *rp)
+{
+	struct replay_bitmap_chunk *chunk, *safe;
+
+	list_for_each_entry_safe(chunk, safe, &rp->bitmap_chunks, list) {
+		list_del(&chunk->list);
+		free(chunk);
+	}
+	INIT_LIST_HEAD(&rp->bitmap_updates);
+}
+
+/* Record bitmap update to apply by replay_apply_bitmap() */
+static int replay_defer_bitmap(struct replay *rp, block_t start,
+			       unsigned count, int set)
+{
+	struct sb *sb = rp->sb;
+	unsigned mapshift = sb->blockbits + 3;
+	unsigned mapmask = (1 << mapshift) - 1;
+
+	if (!count || start + count > sb->volblocks) {
+		tux3_err(sb, "invalid bitmap update: start 0x%Lx, count %u",
+			 start, count);
+		return -EINVAL;
+	}
+
+	while (count) {
+		struct replay_bitmap *update;
+		unsigned len = min(count, mapmask + 1 - (unsigned)(start & mapmask));
+
+		update = replay_bitmap_alloc(rp);
+		if (!update)
+			return -ENOMEM;
+		update->start = start;
+		update->count = len;
+		update->set = set;
+		list_add_tail(&update->list, &rp->bitmap_updates);
+
+		start += len;
+		count -= len;
+	}
+
+	return 0;
+}
+
+static int replay_bitmap_cmp(void *priv, struct list_head *a,
+			     struct list_head *b)
+{
+	struct sb *sb = priv;
+	unsigned mapshift = sb->blockbits + 3;
+	block_t mapa = list_entry(a, struct replay_bitmap, list)->start >> mapshift;
+	block_t mapb = list_entry(b, struct replay_bitmap, list)->start >> mapshift;
+
+	return mapa < mapb ? -1 : mapa > mapb;
+}
+
+/* Start to read bitmap blocks of sorted updates at once */
+static void replay_readahead_bitmap(struct replay *rp)
+{
+	struct sb *sb = rp->sb;
+	unsigned mapshift = sb->blockbits + 3;
+	struct replay_bitmap *update;
+	block_t start = 0;
+	unsigned count = 0;
+
+	list_for_each_entry(update, &rp->bitmap_updates, list) {
+		block_t index = update->start >> mapshift;
+
+		if (count && index < start + count)
+			continue;
+		if (count && index == start + count) {
+			count++;
+			continue;
+		}
+		if (count)
+			blockreadahead(mapping(sb->bitmap), start, count);
+		start = index;
+		count = 1;
+	}
+	if (count)
+		blockreadahead(mapping(sb->bitmap), start, count);
+}
+
+static int replay_apply_bitmap(struct replay *rp)
+{
+	struct sb *sb = rp->sb;
+	struct replay_bitmap *update, *prev = NULL;
+	int err;
+
+	list_sort(sb, &rp->bitmap_updates, replay_bitmap_cmp);
+	replay_readahead_bitmap(rp);
+
+	list_for_each_entry(update, &rp->bitmap_updates, list) {
+		/* Merge with previous update if possible */
+		if (prev && prev->set == update->set &&
+		    prev->start + prev->count == update->start) {
+			prev->count += update->count;
+			continue;
+		}
+		if (prev) {
+			err = replay_update_bitmap(rp, prev->start, prev->count,
+						   prev->set);
+			if (err)
+				return err;
+		}
+		prev = update;
+	}
+	if (prev) {
+		err = replay_update_bitmap(rp, prev->start, prev->count,
+					   prev->set);
+		if (err)
+			return err;
+	}
+
+	replay_free_bitmap(rp);
+
+	return 0;
+}
+
+/* Replay LOG_BALLOC, LOG_BFREE, LOG_BFREE_ON_UNIFY, and LOG_BFREE_RELOG */
+static int replay_bitmap_log(struct replay *rp, u8 code, block_t block,
+			     unsigned count)
+{
+	switch (code) {
+	case LOG_BALLOC:
+		return replay_defer_bitmap(rp, block, count, 1);
+	case LOG_BFREE:
+	case LOG_BFREE_RELOG:
+		return replay_defer_bitmap(rp, block, count, 0);
+	case LOG_BFREE_ON_UNIFY:
+		return defer_bfree(rp->sb, &rp->sb->deunify, block, count);
+	}
+	tux3_err(rp->sb, "invalid bitmap log code 0x%x", code);
+	return -EINVAL;
+}
+
 static int replay_log_stage2(struct replay *rp, struct buffer_head *logbuf)
 {
 	struct sb *sb = rp->sb;
@@ -344,7 +640,7 @@ static int replay_log_stage2(struct replay *rp, struct buffer_head *logbuf)
 	 * LOG_FREEBLOCKS replay if there is it.)
 	 */
 	trace("LOG BLOCK: logblock %Lx", blocknr);
-	err = replay_update_bitmap(rp, blocknr, 1, 1);
+	err = replay_defer_bitmap(rp, blocknr, 1, 1);
 	if (err)
 		return err;
 	/* Mark log block as deunify block */
@@ -373,17 +669,30 @@ static int replay_log_stage2(struct replay *rp, struct buffer_head *logbuf)
 			trace("%s: count %u, block %Lx",
 			      log_name[code], count, block);
 
-			err = 0;
-			if (code == LOG_BALLOC)
-				err = replay_update_bitmap(rp, block, count, 1);
-			else if (code == LOG_BFREE_ON_UNIFY)
-				defer_bfree(sb, &sb->deunify, block, count);
-			else
-				err = replay_update_bitmap(rp, block, count, 0);
+			err = replay_bitmap_log(rp, code, block, count);
 			if (err)
 				return err;
 			break;
 		}
+		case LOG_BITMAP_BATCH:
+		{
+			struct log_batch batch;
+			block_t block;
+			unsigned count;
+
+			log_batch_init(&batch, data - 1);
+			while (log_batch_next(&batch, &block, &count) > 0) {
+				trace("%s: %s: count %u, block %Lx",
+				      log_name[code], log_name[batch.intent],
+				      count, block);
+				err = replay_bitmap_log(rp, batch.intent,
+							block, count);
+				if (err)
+					return err;
+			}
+			data = batch.limit;
+			break;
+		}
 		case LOG_LEAF_REDIRECT:
 		case LOG_BNODE_REDIRECT:
 		{
@@ -392,11 +701,11 @@ static int replay_log_stage2(struct replay *rp, struct buffer_head *logbuf)
 			data = decode48(data, &newblock);
 			trace("%s: oldblock %Lx, newblock %Lx",
 			      log_name[code], oldblock, newblock);
-			err = replay_update_bitmap(rp, newblock, 1, 1);
+			err = replay_defer_bitmap(rp, newblock, 1, 1);
 			if (err)
 				return err;
 			if (code == LOG_LEAF_REDIRECT) {
-				err = replay_update_bitmap(rp, oldblock, 1, 0);
+				err = replay_defer_bitmap(rp, oldblock, 1, 0);
 				if (err)
 					return err;
 			} else {
@@ -411,7 +720,7 @@ static int replay_log_stage2(struct replay *rp, struct buffer_head *logbuf)
 			u64 block;
 			data = decode48(data, &block);
 			trace("%s: block %Lx", log_name[code], block);
-			err = replay_update_bitmap(rp, block, 1, 0);
+			err = replay_defer_bitmap(rp, block, 1, 0);
 			if (err)
 				return err;
 
@@ -434,7 +743,7 @@ static int replay_log_stage2(struct replay *rp, struct buffer_head *logbuf)
 			trace("%s: count %u, root block %Lx, left %Lx, right %Lx, rkey %Lx",
 			      log_name[code], count, root, left, right, rkey);
 
-			err = replay_update_bitmap(rp, root, 1, 1);
+			err = replay_defer_bitmap(rp, root, 1, 1);
 			if (err)
 				return err;
 			break;
@@ -448,7 +757,7 @@ static int replay_log_stage2(struct replay *rp, struct buffer_head *logbuf)
 			data = decode48(data, &dst);
 			trace("%s: pos %x, src %Lx, dst %Lx",
 			      log_name[code], pos, src, dst);
-			err = replay_update_bitmap(rp, dst, 1, 1);
+			err = replay_defer_bitmap(rp, dst, 1, 1);
 			if (err)
 				return err;
 			break;
@@ -460,7 +769,7 @@ static int replay_log_stage2(struct replay *rp, struct buffer_head *logbuf)
 			data = decode48(data, &dst);
 			trace("%s: src 0x%Lx, dst 0x%Lx",
 			      log_name[code], src, dst);
-			err = replay_update_bitmap(rp, src, 1, 0);
+			err = replay_defer_bitmap(rp, src, 1, 0);
 			if (err)
 				return err;
 
@@ -527,7 +836,10 @@ struct replay *replay_stage1(struct sb *sb)
 {
 	struct replay *rp = replay_prepare(sb);
 	if (!IS_ERR(rp)) {
-		int err = replay_logblocks(rp, replay_log_stage1);
+		int err;
+
+		replay_readahead_bnodes(rp);
+		err = replay_logblocks(rp, replay_log_stage1);
 		if (err) {
 			replay_done(rp);
 			return ERR_PTR(err);
@@ -543,6 +855,11 @@ int replay_stage2(struct replay *rp)
 	if (err)
 		goto error;
 
+	/* Apply bitmap updates recorded by replay_log_stage2() */
+	err = replay_apply_bitmap(rp);
+	if (err)
+		goto error;
+
 	/*
 	 * Load orphan inodes into sb->orphan_add to decide what to do
 	 * by caller.
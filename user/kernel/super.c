@@ -105,6 +105,7 @@ static void __tux3_put_super(struct sb *sbi)
 	/* All forked buffers should be freed here */
 	free_forked_buffers(sbi, NULL, 1);
 
+	tux3_exit_commit(sbi);
 	destroy_defer_bfree(&sbi->deunify);
 	destroy_defer_bfree(&sbi->defree);
 
@@ -128,6 +129,9 @@ static void __tux3_put_super(struct sb *sbi)
 	/* Cleanup flusher after inode was evicted */
 	tux3_exit_flusher(sbi);
 
+	inum_map_destroy(&sbi->inum_map);
+	tux3_atom_cache_free(sbi);
+
 	/* FIXME: add more sanity check */
 	assert(list_empty(&sbi->alloc_inodes));
 	assert(link_empty(&sbi->forked_buffers));
@@ -172,6 +176,8 @@ struct replay *tux3_init_fs(struct sb *sbi)
 {
 	struct replay *rp = NULL;
 	struct inode *inode;
+	unsigned logcount;
+	u64 replay_start;
 	char *name;
 	int err;
 
@@ -194,6 +200,8 @@ struct replay *tux3_init_fs(struct sb *sbi)
 		goto error;
 
 	/* Replay physical structures */
+	logcount = be32_to_cpu(sbi->super.logcount);
+	replay_start = tux3_time_usecs();
 	rp = replay_stage1(sbi);
 	if (IS_ERR(rp)) {
 		err = PTR_ERR(rp);
@@ -241,6 +249,8 @@ struct replay *tux3_init_fs(struct sb *sbi)
 		rp = NULL;
 		goto error;
 	}
+	tux3_sched_replay_time(sbi, logcount,
+			       tux3_time_usecs() - replay_start);
 
 	return rp;
 
@@ -265,6 +275,7 @@ static void tux3_inode_init_once(void *mem)
 	INIT_LIST_HEAD(&tuxnode->orphan_list);
 	spin_lock_init(&tuxnode->hole_extents_lock);
 	INIT_LIST_HEAD(&tuxnode->hole_extents);
+	tuxnode->hole_index = NULL;
 	spin_lock_init(&tuxnode->lock);
 	/* Initialize inode_delta_dirty */
 	for (i = 0; i < ARRAY_SIZE(tuxnode->i_ddc); i++) {
@@ -287,6 +298,10 @@ static void tux3_inode_init_always(struct tux3_inode *tuxnode)
 	tuxnode->btree		= (struct btree){ };
 	tuxnode->present	= 0;
 	tuxnode->xcache		= NULL;
+	tuxnode->inline_data	= NULL;
+	tuxnode->inline_size	= 0;
+	tuxnode->dir_index	= NULL;
+	tuxnode->dir_entries	= -1;
 	tuxnode->flags		= 0;
 #ifdef __KERNEL__
 	tuxnode->io		= NULL;
@@ -320,6 +335,9 @@ static void tux3_check_destroy_inode(struct inode *inode)
 	assert(list_empty(&tux_inode(inode)->alloc_list));
 	assert(list_empty(&tux_inode(inode)->orphan_list));
 	assert(i_ddc_is_clean(inode));
+	assert(list_empty(&tux_inode(inode)->hole_extents));
+	assert(!tux_inode(inode)->hole_index);
+	assert(!tux_inode(inode)->dir_index);
 }
 
 #ifdef __KERNEL__
@@ -533,6 +551,18 @@ static int __init init_tux3(void)
 	if (err)
 		goto error_hole;
 
+	err = tux3_init_cursor_cache();
+	if (err)
+		goto error_cursor;
+
+	err = tux3_init_orphan_cache();
+	if (err)
+		goto error_orphan;
+
+	err = tux3_init_xcache_cache();
+	if (err)
+		goto error_xcache;
+
 	err = register_filesystem(&tux3_fs_type);
 	if (err)
 		goto error_fs;
@@ -540,9 +570,15 @@ static int __init init_tux3(void)
 	return 0;
 
 error_fs:
-	tux3_destroy_inodecache();
-error_hole:
+	tux3_destroy_xcache_cache();
+error_xcache:
+	tux3_destroy_orphan_cache();
+error_orphan:
+	tux3_destroy_cursor_cache();
+error_cursor:
 	tux3_destroy_hole_cache();
+error_hole:
+	tux3_destroy_inodecache();
 error:
 	return err;
 }
@@ -550,6 +586,9 @@ error:
 static void __exit exit_tux3(void)
 {
 	unregister_filesystem(&tux3_fs_type);
+	tux3_destroy_xcache_cache();
+	tux3_destroy_orphan_cache();
+	tux3_destroy_cursor_cache();
 	tux3_destroy_hole_cache();
 	tux3_destroy_inodecache();
 }
@@ -15,9 +15,16 @@
 #include <linux/slab.h>
 #include <linux/xattr.h>
 #include <linux/list_sort.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,18,0)
+/* Need PERCPU_REF_INIT_DEAD and percpu_ref_reinit() */
+#include <linux/percpu-refcount.h>
+#define TUX3_DELTA_PERCPU_REF
+#endif
 
 #include "trace.h"
 #include "buffer.h"
+#else
+#define TUX3_DELTA_PERCPU_REF
 #endif /* !__KERNEL__ */
 
 #include "link.h"
@@ -81,6 +88,34 @@ static inline void *decode48(void *at, u64 *val)
 	return at;
 }
 
+/* Variable length integer, 7 bits per byte, and MSB is continue bit */
+static inline void *encode_varint(void *at, u64 val)
+{
+	unsigned char *p = at;
+	while (val >= 0x80) {
+		*p++ = val | 0x80;
+		val >>= 7;
+	}
+	*p++ = val;
+	return p;
+}
+
+/* Returns NULL if varint is over limit */
+static inline void *decode_varint(void *at, void *limit, u64 *val)
+{
+	unsigned char *p = at;
+	unsigned shift = 0;
+
+	*val = 0;
+	while (p < (unsigned char *)limit && shift < 64) {
+		*val |= (u64)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80))
+			return p;
+		shift += 7;
+	}
+	return NULL;
+}
+
 /* Tux3 disk format */
 
 /*
@@ -116,6 +151,8 @@ static inline void *decode48(void *at, u64 *val)
 #define MAX_BLOCKS_BITS		48
 #define MAX_BLOCKS		((block_t)1 << MAX_BLOCKS_BITS)
 #define MAX_EXTENT		(1 << 6)
+/* Maximum bytes of file data in inode attributes (IDATA_ATTR) */
+#define TUX3_INLINE_MAX		256
 
 #define SB_LOC			(1 << 12)
 #define SB_LEN			(1 << 12)	/* this is maximum blocksize */
@@ -195,8 +232,8 @@ struct cursor {
 #ifdef CURSOR_DEBUG
 #define FREE_BUFFER	((void *)0xdbc06505)
 #define FREE_NEXT	((void *)0xdbc06507)
-	int maxlevel;
 #endif
+	int maxlevel;
 	int level;
 	struct path_level {
 		struct buffer_head *buffer;
@@ -206,6 +243,10 @@ struct cursor {
 
 struct stash { struct flink_head head; u64 *pos, *top; };
 
+/* In-memory free inum index (see inode_inum.c) */
+#define INUM_MAP_HASH_BITS	8
+struct inum_map { struct hlist_head hash[1 << INUM_MAP_HASH_BITS]; };
+
 /* Flush synchronously */
 #define TUX3_FLUSHER_SYNC		1
 /* Flush asynchronously by own timing */
@@ -215,7 +256,12 @@ struct stash { struct flink_head head; u64 *pos, *top; };
 
 /* Refcount for delta */
 struct delta_ref {
+#ifdef TUX3_DELTA_PERCPU_REF
+	struct percpu_ref refcount;	/* killed at delta transition */
+#else
 	atomic_t refcount;
+#endif
+	struct sb *sb;
 	unsigned delta;
 #ifdef UNIFY_DEBUG
 	int unify_flag;	/* FIXME: is there better way? */
@@ -225,8 +271,83 @@ struct delta_ref {
 /* Per-delta data structure for sb */
 struct sb_delta_dirty {
 	struct list_head dirty_inodes;	/* dirty inodes list */
+	unsigned nr_inodes;		/* number of dirty_inodes */
+	atomic_t nr_blocks;		/* number of dirtied blocks */
+	atomic_t nr_fsync;		/* fsync callers waiting this delta */
+	atomic_t nr_sync;		/* waiters for data integrity */
+};
+
+/* Delta and unify scheduling (see need_delta() and need_unify()) */
+struct tux3_sched {
+	/* Tunables, 0 disables the trigger */
+	unsigned delta_blocks;		/* dirty blocks to start delta commit */
+	unsigned delta_inodes;		/* dirty inodes to start delta commit */
+	unsigned delta_msecs;		/* age of delta to start delta commit */
+	unsigned unify_logblocks;	/* log blocks to unify */
+	unsigned unify_replay_msecs;	/* estimated replay time to unify */
+	unsigned fsync_window_usecs;	/* wait to gather fsync callers */
+
+	/* Measured state */
+	u64 delta_start;		/* start time of current delta (usecs) */
+	unsigned commit_usecs;		/* average latency of delta commit */
+	unsigned replay_usecs;		/* replay time per log block */
+	unsigned fsync_group;		/* fsync callers of last commit */
+};
+
+/* Commit phases timed by commit flight recorder (see do_commit()) */
+enum {
+	COMMIT_PHASE_STAGE,		/* stage_delta() */
+	COMMIT_PHASE_UNIFY,		/* wait commit block, and unify_log() */
+	COMMIT_PHASE_BTREE,		/* write_btree() */
+	COMMIT_PHASE_LOG,		/* write_log() */
+	COMMIT_PHASE_IOWAIT,		/* wait I/O of delta */
+	COMMIT_PHASE_COMMIT,		/* commit_delta() */
+	COMMIT_PHASE_POST,		/* post_commit() */
+	COMMIT_PHASES,
+};
+
+/* Counters updated by backend, the difference is recorded per commit */
+struct commit_counters {
+	u32 inodes;			/* inodes flushed */
+	u32 buffers;			/* buffers submitted for write */
+	u32 logblocks;			/* log blocks written */
+	u32 bitmap_dirty;		/* blockdirty() of bitmap blocks */
+	u32 defree;			/* deferred free extents applied */
+};
+
+#define COMMIT_RECORD_UNIFY	(1 << 0)	/* commit did unify */
+#define COMMIT_RECORD_SYNC	(1 << 1)	/* waited commit block */
+
+/* One commit in flight recorder (part of TUX3_IOC_COMMITSTAT) */
+struct commit_record {
+	u32 delta;
+	u32 flags;			/* COMMIT_RECORD_* */
+	s32 err;
+	u32 total_usecs;
+	u64 start_usecs;		/* monotonic time at start */
+	u32 phase_usecs[COMMIT_PHASES];
+	struct commit_counters counters;
+};
+
+#define TUX3_COMMIT_RECORDS	64
+
+/* Ring of last TUX3_COMMIT_RECORDS commits */
+struct commit_recorder {
+	spinlock_t lock;		/* for readers vs backend */
+	u64 nr_commits;			/* total number of commits */
+	struct commit_record records[TUX3_COMMIT_RECORDS];
+};
+
+/* Result of TUX3_IOC_COMMITSTAT, records are in commit order */
+struct tux3_commitstat {
+	u64 nr_commits;			/* total number of commits */
+	u32 nr_records;			/* valid entries in records[] */
+	u32 __pad;
+	struct commit_record records[TUX3_COMMIT_RECORDS];
 };
 
+#define TUX3_IOC_COMMITSTAT	_IOR('T', 1, struct tux3_commitstat)
+
 /* Pin a block in cache and keep a pointer to it */
 struct countmap_pin {
 	struct buffer_head *buffer;
@@ -257,7 +378,13 @@ struct sb {
 	unsigned committed_delta;		/* committed delta */
 	wait_queue_head_t delta_event_wq;	/* wait queue for delta event */
 #if TUX3_FLUSHER == TUX3_FLUSHER_ASYNC_OWN
+#ifdef __KERNEL__
 	struct task_struct *flush_task;		/* work to flush delta */
+#else
+	pthread_t flush_thread;			/* thread to flush delta */
+	int flush_state;			/* state of flush_thread */
+	pthread_mutex_t frontend_lock;		/* frontend vs flush_thread */
+#endif
 #endif
 #if TUX3_FLUSHER == TUX3_FLUSHER_ASYNC_HACK
 	struct backing_dev_info bdi;
@@ -276,8 +403,7 @@ struct sb {
 	u64 freeinodes;		/* Number of free inode numbers. This is
 				 * including the deferred allocated inodes */
 	block_t volblocks, freeblocks, nextblock;
-	inum_t nextinum;	/* FIXME: temporary hack to avoid to find
-				 * same area in itree for free inum. */
+	inum_t nextinum;	/* Hint of next inum, updated by alloc_inum() */
 	unsigned entries_per_node; /* must be per-btree type, get rid of this */
 	unsigned version;	/* Currently mounted volume version view */
 
@@ -286,6 +412,12 @@ struct sb {
 	loff_t atomdictsize;	/* Atom dictionary size */
 	unsigned freeatom;	/* Start of free atom list in atom table */
 	unsigned atomgen;	/* Next atom number to allocate if no free atoms */
+	struct atom_cache *atom_cache; /* In-memory name <-> atom map */
+	unsigned xattr_share;	/* Share xattr value of this size or more
+				 * between inodes (0 means disabled) */
+	struct tux3_sched sched;	/* delta and unify scheduling */
+	struct commit_counters commit_counters; /* updated by backend */
+	struct commit_recorder commit_recorder; /* last commits */
 
 	/*
 	 * For backend only
@@ -294,16 +426,22 @@ struct sb {
 	unsigned lognext;	/* Index of next log block in log map */
 	struct buffer_head *logbuf; /* Cached log block */
 	unsigned char *logpos, *logtop; /* Where to emit next log entry */
+	unsigned char *logbatch; /* LOG_BITMAP_BATCH to append entry */
+	block_t logbatch_end;	/* end of last entry in logbatch */
 
 	struct list_head orphan_add; /* defered orphan inode add list */
 	struct list_head orphan_del; /* defered orphan inode del list */
 
 	struct stash defree;	/* defer extent frees until after delta */
 	struct stash deunify;	/* defer extent frees until after unify */
+	struct stash decommit;	/* defree waiting in-flight commit block */
 
 	struct list_head unify_buffers; /* dirty metadata flushed at unify */
 
 	struct iowait *iowait;		/* helper for waiting I/O */
+	struct iowait commit_iowait;	/* in-flight commit block I/O */
+	struct disksuper commit_super;	/* image of in-flight commit block */
+	int commit_inflight;		/* commit block is not waited yet */
 
 	/*
 	 * For frontend and backend
@@ -311,6 +449,7 @@ struct sb {
 	spinlock_t countmap_lock;
 	struct countmap_pin countmap_pin;
 	struct list_head alloc_inodes;	/* deferred inum allocation inodes */
+	struct inum_map inum_map;	/* free inum index (under itree lock) */
 
 	spinlock_t forked_buffers_lock;
 	struct link forked_buffers;	/* forked buffers list */
@@ -323,6 +462,7 @@ struct sb {
 #else
 	struct dev *dev;		/* userspace block device */
 	loff_t s_maxbytes;		/* maximum file size */
+	struct tux3_dcachestat dcachestat; /* dentry cache statistics */
 #endif
 };
 
@@ -348,10 +488,34 @@ struct logblock {
 	__be16 magic;		/* Magic number */
 	__be16 bytes;		/* Total data bytes on this block */
 	u32 unused;		/* padding */
-	__be64 logchain;	/* Block number to previous logblock */
+	__be64 logchain;	/* Link to previous logblock (see below) */
 	unsigned char data[];	/* Log data */
 };
 
+/*
+ * Link of log chain (->logchain of disksuper and logblock). Lower 48
+ * bits is block number of previous logblock, and upper 16 bits is
+ * count of contiguous logblocks ending at it (0 is same with 1). So
+ * replay can read those logblocks at once.
+ */
+#define LOGCHAIN_COUNT_MAX	0xffff
+
+static inline __be64 logchain_link(block_t block, unsigned count)
+{
+	count = min_t(unsigned, count, LOGCHAIN_COUNT_MAX);
+	return cpu_to_be64(block | ((u64)count << 48));
+}
+
+static inline block_t logchain_block(__be64 logchain)
+{
+	return be64_to_cpu(logchain) & ~(-1ULL << 48);
+}
+
+static inline unsigned logchain_count(__be64 logchain)
+{
+	return max_t(unsigned, be64_to_cpu(logchain) >> 48, 1);
+}
+
 enum {
 	LOG_BALLOC = 0x33,	/* Log of block allocation */
 	LOG_BFREE,		/* Log of freeing block after delta */
@@ -373,9 +537,18 @@ enum {
 	LOG_FREEBLOCKS,		/* Log of freeblocks in bitmap on unify */
 	LOG_UNIFY,		/* Log of marking unify */
 	LOG_DELTA,		/* just for debugging */
+	LOG_BITMAP_BATCH,	/* Batch of LOG_BALLOC/LOG_BFREE* */
 	LOG_TYPES
 };
 
+/* Decoder of LOG_BITMAP_BATCH entries */
+struct log_batch {
+	u8 intent;		/* LOG_BALLOC, LOG_BFREE, ... */
+	unsigned char *pos;	/* next entry */
+	unsigned char *limit;	/* end of entries */
+	block_t end;		/* end of previous entry */
+};
+
 /* For debugging, MAX_ATTRS is smaller than 31, so present never be -1 */
 #define TUX3_INVALID_PRESENT		(-1U)
 
@@ -395,6 +568,12 @@ struct tux3_iattr_data {
 	u64		i_version;
 };
 
+/* Inode attributes to save by tux3_save_inodes() */
+struct save_inode_req {
+	struct inode *inode;
+	struct tux3_iattr_data idata;
+};
+
 /* Per-delta data structure for inode */
 struct inode_delta_dirty {
 	struct list_head dirty_buffers;	/* list for dirty buffers */
@@ -408,16 +587,23 @@ struct inode_delta_dirty {
 };
 
 struct xcache;
+struct hole_index;
+struct dir_index;
 struct tux3_inode {
 	struct btree btree;
 	inum_t inum;			/* Inode number */
 	struct xcache *xcache;		/* Extended attribute cache */
+	void *inline_data;		/* Inline file data (IDATA_ATTR) */
+	unsigned inline_size;		/* Bytes of inline_data */
+	struct dir_index *dir_index;	/* Hashed name index of directory */
+	long dir_entries;		/* Live dirents except "." and "..",
+					 * or -1 if not counted yet */
 	struct list_head alloc_list;	/* link for deferred inum allocation */
 	struct list_head orphan_list;	/* link for orphan inode list */
 
-	/* FIXME: we can use RCU for hole_extents? */
 	spinlock_t hole_extents_lock;	/* lock for hole_extents */
 	struct list_head hole_extents;	/* hole extents list */
+	struct hole_index __rcu *hole_index; /* sorted hole_extents for read */
 
 	spinlock_t lock;		/* lock for inode metadata */
 	/* Per-delta dirty data for inode */
@@ -474,6 +660,12 @@ static inline struct block_device *sb_dev(struct sb *sb)
 {
 	return sb->vfs_sb->s_bdev;
 }
+
+/* Monotonic time for scheduling */
+static inline u64 tux3_time_usecs(void)
+{
+	return ktime_to_us(ktime_get());
+}
 #else /* !__KERNEL__ */
 static inline struct sb *tux_sb(struct sb *sb)
 {
@@ -494,6 +686,14 @@ static inline struct dev *sb_dev(struct sb *sb)
 {
 	return sb->dev;
 }
+
+/* Monotonic time for scheduling */
+static inline u64 tux3_time_usecs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (u64)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
 #endif /* !__KERNEL__ */
 
 /* Get delta from free running counter */
@@ -606,6 +806,8 @@ struct replay {
 	struct list_head orphan_in_otree; /* Orphan inodes in sb->otree */
 
 	/* For replay.c */
+	struct list_head bitmap_updates; /* bitmap updates to apply at once */
+	struct list_head bitmap_chunks;	/* memory for bitmap_updates */
 	void *unify_pos;	/* position of unify log in a log block */
 	block_t unify_index;	/* index of a log block including unify log */
 	block_t blocknrs[];	/* block address of log blocks */
@@ -688,6 +890,8 @@ int devio(int rw, struct block_device *dev, loff_t offset, void *data,
 	  unsigned len);
 int blockio(int rw, struct sb *sb, struct buffer_head *buffer, block_t block);
 int blockio_vec(int rw, struct bufvec *bufvec, block_t block, unsigned count);
+int blockio_multi(int rw, struct sb *sb, struct buffer_head **buffers,
+		  unsigned count, block_t block);
 
 #define tux3_msg(sb, fmt, ...)						\
 	__tux3_msg(sb, KERN_INFO, "", fmt, ##__VA_ARGS__)
@@ -701,6 +905,8 @@ int blockio_vec(int rw, struct bufvec *bufvec, block_t block, unsigned count);
 struct buffer_head *peekblk(struct address_space *mapping, block_t iblock);
 struct buffer_head *blockread(struct address_space *mapping, block_t iblock);
 struct buffer_head *blockget(struct address_space *mapping, block_t iblock);
+void blockreadahead(struct address_space *mapping, block_t iblock,
+		    unsigned count);
 #endif /* !__KERNEL__ */
 
 /* balloc.c */
@@ -719,9 +925,14 @@ int balloc_segs(struct sb *sb,
 block_t balloc_one(struct sb *sb);
 int bfree_segs(struct sb *sb, struct block_segment *seg, int segs);
 int bfree(struct sb *sb, block_t start, unsigned blocks);
+void bfree_unpin(struct buffer_head **pin);
+int bfree_pinned(struct sb *sb, struct buffer_head **pin, block_t start,
+		 unsigned blocks);
 int replay_update_bitmap(struct replay *rp, block_t start, unsigned blocks, int set);
 
 /* btree.c */
+int tux3_init_cursor_cache(void);
+void tux3_destroy_cursor_cache(void);
 unsigned calc_entries_per_node(unsigned blocksize);
 struct buffer_head *cursor_leafbuf(struct cursor *cursor);
 void release_cursor(struct cursor *cursor);
@@ -764,11 +975,15 @@ int replay_bnode_adjust(struct replay *rp, block_t bnode, tuxkey_t from, tuxkey_
 void setup_sb(struct sb *sb, struct disksuper *super);
 int load_sb(struct sb *sb);
 int save_sb(struct sb *sb);
+void tux3_exit_commit(struct sb *sb);
 void tux3_start_backend(struct sb *sb);
 void tux3_end_backend(void);
 int tux3_under_backend(struct sb *sb);
+void tux3_sched_replay_time(struct sb *sb, unsigned logcount, u64 usecs);
+void tux3_commitstat(struct sb *sb, struct tux3_commitstat *stat);
 int force_unify(struct sb *sb);
 int force_delta(struct sb *sb);
+int fsync_delta(struct sb *sb);
 unsigned tux3_get_current_delta(void);
 unsigned tux3_inode_delta(struct inode *inode);
 void change_begin_atomic(struct sb *sb);
@@ -784,6 +999,7 @@ void change_end_if_needed(struct sb *sb);
 #include "commit_flusher.h"
 
 /* dir.c */
+u32 tux_name_hash(const char *name, unsigned len);
 void tux_set_entry(struct buffer_head *buffer, tux_dirent *entry,
 		   inum_t inum, umode_t mode);
 void tux_update_dirent(struct inode *dir, struct buffer_head *buffer,
@@ -854,6 +1070,8 @@ struct inode *tux_create_specific_inode(struct inode *dir, inum_t inum,
 struct inode *tux3_iget(struct sb *sb, inum_t inum);
 struct inode *tux3_ilookup_nowait(struct sb *sb, inum_t inum);
 struct inode *tux3_ilookup(struct sb *sb, inum_t inum);
+int tux3_save_inodes(struct sb *sb, struct save_inode_req *reqs,
+		     unsigned count, unsigned delta);
 int tux3_save_inode(struct inode *inode, struct tux3_iattr_data *idata,
 		    unsigned delta);
 int tux3_purge_inode(struct inode *inode, struct tux3_iattr_data *idata,
@@ -862,8 +1080,18 @@ int tux3_drop_inode(struct inode *inode);
 void tux3_evict_inode(struct inode *inode);
 void iget_if_dirty(struct inode *inode);
 
+/* inode_inum.c */
+void inum_map_init(struct inum_map *map);
+void inum_map_destroy(struct inum_map *map);
+int inum_map_alloc(struct cursor *cursor, inum_t goal, inum_t limit,
+		   inum_t *allocated);
+void inum_map_free(struct sb *sb, inum_t inum);
+
 /* log.c */
 extern unsigned log_size[];
+unsigned log_entry_size(unsigned char *data);
+void log_batch_init(struct log_batch *batch, unsigned char *data);
+int log_batch_next(struct log_batch *batch, block_t *block, unsigned *count);
 void log_next(struct sb *sb);
 void log_drop(struct sb *sb);
 void log_finish(struct sb *sb);
@@ -899,9 +1127,13 @@ int unstash(struct sb *sb, struct stash *defree, unstash_t actor);
 int stash_walk(struct sb *sb, struct stash *stash, unstash_t actor);
 int defer_bfree(struct sb *sb, struct stash *defree,
 		block_t block, unsigned count);
+int sort_defer_bfree(struct stash *defree);
+int apply_defer_bfree(struct sb *sb, struct stash *defree);
 void destroy_defer_bfree(struct stash *defree);
 
 /* orphan.c */
+int tux3_init_orphan_cache(void);
+void tux3_destroy_orphan_cache(void);
 void clean_orphan_list(struct list_head *head);
 extern struct ileaf_attr_ops oattr_ops;
 int tux3_unify_orphan_add(struct sb *sb, struct list_head *orphan_add);
@@ -980,8 +1212,12 @@ void tux3_check_destroy_inode_flags(struct inode *inode);
 #define ENOATTR ENODATA
 #endif
 
+int tux3_init_xcache_cache(void);
+void tux3_destroy_xcache_cache(void);
 void atable_init_base(struct sb *sb);
+void tux3_atom_cache_free(struct sb *sb);
 int xcache_dump(struct inode *inode);
+void __free_xcache(struct xcache *xcache);
 void free_xcache(struct inode *inode);
 int new_xcache(struct inode *inode, unsigned size);
 int xcache_remove_all(struct inode *inode);
@@ -995,6 +1231,7 @@ unsigned encode_xsize(struct inode *inode);
 void *encode_xattrs(struct inode *inode, void *attrs, unsigned size);
 unsigned decode_xsize(struct inode *inode, void *attrs, unsigned size);
 void *decode_xattr(struct inode *inode, void *attrs);
+void *decode_xshare(struct inode *inode, void *attrs);
 
 static inline struct buffer_head *vol_find_get_block(struct sb *sb, block_t block)
 {
@@ -1011,5 +1248,10 @@ static inline struct buffer_head *vol_bread(struct sb *sb, block_t block)
 	return blockread(mapping(sb->volmap), block);
 }
 
+static inline void vol_readahead(struct sb *sb, block_t block, unsigned count)
+{
+	blockreadahead(mapping(sb->volmap), block, count);
+}
+
 #include "dirty-buffer.h"	/* remove this after atomic commit */
 #endif /* !TUX3_H */
@@ -71,6 +71,36 @@ int blockio_vec(int rw, struct bufvec *bufvec, block_t block, unsigned count)
 	return bufvec_io(rw, bufvec, block, count);
 }
 
+/* I/O for count of buffers to physically contiguous blocks at once */
+int blockio_multi(int rw, struct sb *sb, struct buffer_head **buffers,
+		  unsigned count, block_t block)
+{
+	unsigned max = min(bio_get_nr_vecs(sb_dev(sb)), 16);
+
+	while (count > 0) {
+		struct bio_vec vec[16];
+		unsigned i, vecs = min(count, max);
+		int err;
+
+		for (i = 0; i < vecs; i++) {
+			vec[i] = (struct bio_vec){
+				.bv_page	= buffers[i]->b_page,
+				.bv_offset	= bh_offset(buffers[i]),
+				.bv_len		= sb->blocksize,
+			};
+		}
+		err = syncio(rw, sb_dev(sb), block << sb->blockbits, vecs, vec);
+		if (err)
+			return err;
+
+		buffers += vecs;
+		block += vecs;
+		count -= vecs;
+	}
+
+	return 0;
+}
+
 void hexdump(void *data, unsigned size)
 {
 	print_hex_dump(KERN_INFO, "", DUMP_PREFIX_ADDRESS, 16, 1, data, size, 1);
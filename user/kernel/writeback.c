@@ -9,6 +9,7 @@
 
 #include "tux3.h"
 #include "filemap_hole.h"
+#include "filemap_inline.h"
 
 #ifndef trace
 #define trace trace_on
@@ -210,6 +211,7 @@ void tux3_dirty_inode(struct inode *inode, int flags)
 			if (list_empty(&i_ddc->dirty_list)) {
 				list_add_tail(&i_ddc->dirty_list,
 					      &s_ddc->dirty_inodes);
+				s_ddc->nr_inodes++;
 				/* The inode was re-dirtied while flushing. */
 				re_dirtied = (inode->i_state & I_DIRTY);
 			}
@@ -373,8 +375,14 @@ void __tux3_mark_buffer_dirty(struct buffer_head *buffer, unsigned delta)
 	       PageLocked(buffer->b_page));
 #endif
 
-	if (tux3_set_buffer_dirty(mapping(inode), buffer, delta))
+	if (tux3_set_buffer_dirty(mapping(inode), buffer, delta)) {
+		/* Count only blocks flushed by delta commit */
+		if (!tux3_is_inode_no_flush(inode)) {
+			struct sb *sb = tux_sb(inode->i_sb);
+			atomic_inc(&tux3_sb_ddc(sb, delta)->nr_blocks);
+		}
 		__tux3_mark_inode_dirty(inode, I_DIRTY_PAGES);
+	}
 }
 
 /*
@@ -486,17 +494,13 @@ static inline int tux3_flush_buffers(struct inode *inode,
 }
 
 /*
- * Flush inode.
- *
- * The inode dirty flags keeps until finish I/O to prevent inode
- * reclaim. Because we don't wait writeback on evict_inode(), and
- * instead we keeps the inode while writeback is running.
+ * Flush inode except saving inode attributes. If attributes have to
+ * be saved, *need_save is set and idata is ready for tux3_save_inode().
  */
-int tux3_flush_inode(struct inode *inode, unsigned delta, int req_flag)
+static int __tux3_flush_inode(struct inode *inode,
+			      struct tux3_iattr_data *idata,
+			      unsigned delta, int req_flag, int *need_save)
 {
-	/* FIXME: linux writeback doesn't allow to control writeback
-	 * timing. */
-	struct tux3_iattr_data idata;
 	unsigned dirty = 0, orphaned, deleted;
 	int ret = 0, err;
 
@@ -504,10 +508,10 @@ int tux3_flush_inode(struct inode *inode, unsigned delta, int req_flag)
 	 * Read the stabled inode attributes and state for this delta,
 	 * then tell we read already.
 	 */
-	tux3_state_read_and_clear(inode, &idata, &orphaned, &deleted, delta);
+	tux3_state_read_and_clear(inode, idata, &orphaned, &deleted, delta);
 
 	trace("inum %Lu, idata %p, orphaned %d, deleted %d, delta %u",
-	      tux_inode(inode)->inum, &idata, orphaned, deleted, delta);
+	      tux_inode(inode)->inum, idata, orphaned, deleted, delta);
 
 	if (!deleted) {
 		/* If orphaned on this delta, add orphan */
@@ -532,15 +536,22 @@ int tux3_flush_inode(struct inode *inode, unsigned delta, int req_flag)
 		remove_inode_hash(inode);
 
 		/* If inode was deleted and referencer was gone, delete inode */
-		err = tux3_purge_inode(inode, &idata, delta);
+		err = tux3_purge_inode(inode, idata, delta);
 		if (err && !ret)
 			ret = err;
 	}
 
-	err = tux3_flush_buffers(inode, &idata, delta, req_flag);
+	err = tux3_flush_buffers(inode, idata, delta, req_flag);
 	if (err && !ret)
 		ret = err;
 
+	/* If file grew, move inline data to dtree */
+	if (!deleted) {
+		err = tux3_flush_inline(inode, idata);
+		if (err && !ret)
+			ret = err;
+	}
+
 	/*
 	 * Get flags after tux3_flush_buffers() to check TUX3_DIRTY_BTREE.
 	 * If inode is dead, we don't need to save inode.
@@ -548,13 +559,35 @@ int tux3_flush_inode(struct inode *inode, unsigned delta, int req_flag)
 	if (!deleted)
 		dirty = tux3_dirty_flags(inode, delta);
 
+	*need_save = 0;
 	if (dirty & (TUX3_DIRTY_BTREE | I_DIRTY_SYNC | I_DIRTY_DATASYNC)) {
 		/*
 		 * If there is btree root, adjust present after
 		 * tux3_flush_buffers().
 		 */
-		tux3_iattr_adjust_for_btree(inode, &idata);
+		tux3_iattr_adjust_for_btree(inode, idata);
+		*need_save = 1;
+	}
+
+	return ret;
+}
+
+/*
+ * Flush inode.
+ *
+ * The inode dirty flags keeps until finish I/O to prevent inode
+ * reclaim. Because we don't wait writeback on evict_inode(), and
+ * instead we keeps the inode while writeback is running.
+ */
+int tux3_flush_inode(struct inode *inode, unsigned delta, int req_flag)
+{
+	/* FIXME: linux writeback doesn't allow to control writeback
+	 * timing. */
+	struct tux3_iattr_data idata;
+	int need_save, ret, err;
 
+	ret = __tux3_flush_inode(inode, &idata, delta, req_flag, &need_save);
+	if (need_save) {
 		err = tux3_save_inode(inode, &idata, delta);
 		if (err && !ret)
 			ret = err;
@@ -612,33 +645,67 @@ static int inode_inum_cmp(void *priv, struct list_head *a, struct list_head *b)
 	return 0;
 }
 
+/* Number of inodes to save per itree pass */
+#define SAVE_INODE_BATCH	64
+
 int tux3_flush_inodes(struct sb *sb, unsigned delta)
 {
 	struct sb_delta_dirty *s_ddc = tux3_sb_ddc(sb, delta);
 	struct list_head *dirty_inodes = &s_ddc->dirty_inodes;
 	struct inode_delta_dirty *i_ddc, *safe;
+	struct save_inode_req *reqs;
+	unsigned count = 0;
 	int err;
 
 	/* ->dirty_inodes owned by backend. No need to lock here */
 
-	/* Sort by tuxnode->inum. FIXME: do we want to sort? */
+	/*
+	 * Sort by tuxnode->inum. Saving inodes in inum order lets
+	 * tux3_save_inodes() update one ileaf for consecutive inodes.
+	 */
 	list_sort(&delta, dirty_inodes, inode_inum_cmp);
 
+	/* If no memory, fallback to save each inode */
+	reqs = malloc(sizeof(*reqs) * SAVE_INODE_BATCH);
+
 	list_for_each_entry_safe(i_ddc, safe, dirty_inodes, dirty_list) {
 		struct tux3_inode *tuxnode = i_ddc_to_inode(i_ddc, delta);
 		struct inode *inode = &tuxnode->vfs_inode;
+		int need_save;
 
 		assert(!tux3_is_inode_no_flush(inode));
+		sb->commit_counters.inodes++;
 
-		err = tux3_flush_inode(inode, delta, 0);
+		if (!reqs) {
+			err = tux3_flush_inode(inode, delta, 0);
+			if (err)
+				goto error;
+			continue;
+		}
+
+		err = __tux3_flush_inode(inode, &reqs[count].idata, delta, 0,
+					 &need_save);
 		if (err)
 			goto error;
+		if (!need_save)
+			continue;
+
+		reqs[count].inode = inode;
+		if (++count == SAVE_INODE_BATCH) {
+			err = tux3_save_inodes(sb, reqs, count, delta);
+			if (err)
+				goto error;
+			count = 0;
+		}
 	}
 
-	return 0;
-
+	err = 0;
+	if (count)
+		err = tux3_save_inodes(sb, reqs, count, delta);
 error:
 	/* FIXME: what to do for dirty_inodes on error path */
+	if (reqs)
+		free(reqs);
 	return err;
 }
 
@@ -141,8 +141,9 @@ static int is_free_unatom(loff_t where)
 	return (where & UNATOM_FREE_MASK) == UNATOM_FREE_MAGIC;
 }
 
-/* Convert atom to name */
-static int unatom(struct inode *atable, atom_t atom, char *name, unsigned size)
+/* Convert atom to name by reading the reverse map and dictionary */
+static int unatom_read(struct inode *atable, atom_t atom, char *name,
+		       unsigned size)
 {
 	struct sb *sb = tux_sb(atable->i_sb);
 	struct buffer_head *buffer;
@@ -183,6 +184,279 @@ error:
 	return err;
 }
 
+/*
+ * Atom cache
+ *
+ * In-memory map of name -> atom and atom -> name, to avoid reading
+ * the atom dictionary for each xattr operation. The cache is built by
+ * walking the reverse map at first use, and updated by make_atom()
+ * and atomref() after that. So find_atom() trusts the cache for
+ * negative result too. If we fail to update the cache, we drop it,
+ * and next use rebuilds it.
+ *
+ * Protected by atable->i_mutex.
+ */
+#define ATOM_CACHE_SHIFT_MIN	6
+#define ATOM_CACHE_SHIFT_MAX	24
+
+struct atom_entry {
+	struct hlist_node name_link;	/* link for ->name_hash */
+	struct hlist_node atom_link;	/* link for ->atom_hash */
+	atom_t atom;
+	unsigned len;
+	char name[];
+};
+
+#define XSHARE_SEEN_SHIFT	8
+
+struct atom_cache {
+	unsigned shift;			/* log2 of number of buckets */
+	unsigned count;			/* number of entries */
+	struct hlist_head *name_hash;
+	struct hlist_head *atom_hash;
+	/* hash of recently set xattr values, see xshare_get() */
+	u32 xshare_seen[1 << XSHARE_SEEN_SHIFT];
+};
+
+static struct hlist_head *atom_cache_name_head(struct atom_cache *cache,
+					       const char *name, unsigned len)
+{
+	return cache->name_hash + hash_32(tux_name_hash(name, len), cache->shift);
+}
+
+static struct hlist_head *atom_cache_atom_head(struct atom_cache *cache,
+					       atom_t atom)
+{
+	return cache->atom_hash + hash_32(atom, cache->shift);
+}
+
+static struct hlist_head *atom_cache_alloc_hash(unsigned shift)
+{
+	struct hlist_head *hash;
+	unsigned i;
+
+	hash = malloc(sizeof(*hash) << shift);
+	if (hash) {
+		for (i = 0; i < 1U << shift; i++)
+			INIT_HLIST_HEAD(&hash[i]);
+	}
+	return hash;
+}
+
+static void atom_cache_destroy(struct atom_cache *cache)
+{
+	unsigned i;
+
+	/* atom_cache_build() may fail before the hash arrays are allocated */
+	for (i = 0; cache->atom_hash && i < 1U << cache->shift; i++) {
+		struct atom_entry *entry;
+		struct hlist_node *n;
+
+		hlist_for_each_entry_safe(entry, n, &cache->atom_hash[i],
+					  atom_link)
+			free(entry);
+	}
+	free(cache->name_hash);
+	free(cache->atom_hash);
+	free(cache);
+}
+
+void tux3_atom_cache_free(struct sb *sb)
+{
+	if (sb->atom_cache) {
+		atom_cache_destroy(sb->atom_cache);
+		sb->atom_cache = NULL;
+	}
+}
+
+/* Double the number of buckets */
+static void atom_cache_grow(struct atom_cache *cache)
+{
+	unsigned i, old_shift = cache->shift;
+	struct hlist_head *old_name = cache->name_hash;
+	struct hlist_head *old_atom = cache->atom_hash;
+	struct hlist_head *name_hash, *atom_hash;
+
+	if (old_shift >= ATOM_CACHE_SHIFT_MAX)
+		return;
+
+	name_hash = atom_cache_alloc_hash(old_shift + 1);
+	atom_hash = atom_cache_alloc_hash(old_shift + 1);
+	if (!name_hash || !atom_hash) {
+		/* Not fatal, just continue with longer chains */
+		free(name_hash);
+		free(atom_hash);
+		return;
+	}
+
+	cache->shift = old_shift + 1;
+	cache->name_hash = name_hash;
+	cache->atom_hash = atom_hash;
+	for (i = 0; i < 1U << old_shift; i++) {
+		struct atom_entry *entry;
+		struct hlist_node *n;
+
+		hlist_for_each_entry_safe(entry, n, &old_name[i], name_link) {
+			hlist_del(&entry->name_link);
+			hlist_add_head(&entry->name_link,
+				       atom_cache_name_head(cache, entry->name,
+							    entry->len));
+		}
+		hlist_for_each_entry_safe(entry, n, &old_atom[i], atom_link) {
+			hlist_del(&entry->atom_link);
+			hlist_add_head(&entry->atom_link,
+				       atom_cache_atom_head(cache, entry->atom));
+		}
+	}
+	free(old_name);
+	free(old_atom);
+}
+
+static int atom_cache_insert(struct atom_cache *cache, const char *name,
+			     unsigned len, atom_t atom)
+{
+	struct atom_entry *entry;
+
+	entry = malloc(sizeof(*entry) + len);
+	if (!entry)
+		return -ENOMEM;
+	entry->atom = atom;
+	entry->len = len;
+	memcpy(entry->name, name, len);
+
+	if (++cache->count > 1U << cache->shift)
+		atom_cache_grow(cache);
+
+	hlist_add_head(&entry->name_link, atom_cache_name_head(cache, name, len));
+	hlist_add_head(&entry->atom_link, atom_cache_atom_head(cache, atom));
+
+	return 0;
+}
+
+static void atom_cache_remove(struct atom_cache *cache, struct atom_entry *entry)
+{
+	hlist_del(&entry->name_link);
+	hlist_del(&entry->atom_link);
+	cache->count--;
+	free(entry);
+}
+
+static struct atom_entry *atom_cache_lookup_name(struct atom_cache *cache,
+						 const char *name, unsigned len)
+{
+	struct atom_entry *entry;
+
+	hlist_for_each_entry(entry, atom_cache_name_head(cache, name, len),
+			     name_link) {
+		if (entry->len == len && !memcmp(entry->name, name, len))
+			return entry;
+	}
+	return NULL;
+}
+
+static struct atom_entry *atom_cache_lookup_atom(struct atom_cache *cache,
+						 atom_t atom)
+{
+	struct atom_entry *entry;
+
+	hlist_for_each_entry(entry, atom_cache_atom_head(cache, atom),
+			     atom_link) {
+		if (entry->atom == atom)
+			return entry;
+	}
+	return NULL;
+}
+
+static struct atom_cache *atom_cache_build(struct inode *atable)
+{
+	struct sb *sb = tux_sb(atable->i_sb);
+	struct atom_cache *cache;
+	char name[MAX_ATOM_NAME_LEN];
+	atom_t atom;
+	int err;
+
+	cache = malloc(sizeof(*cache));
+	if (!cache)
+		return ERR_PTR(-ENOMEM);
+	cache->shift = ATOM_CACHE_SHIFT_MIN;
+	cache->count = 0;
+	memset(cache->xshare_seen, 0, sizeof(cache->xshare_seen));
+	cache->name_hash = atom_cache_alloc_hash(cache->shift);
+	cache->atom_hash = atom_cache_alloc_hash(cache->shift);
+	if (!cache->name_hash || !cache->atom_hash) {
+		err = -ENOMEM;
+		goto error;
+	}
+
+	/* Atom 0 is never used */
+	for (atom = 1; atom < sb->atomgen; atom++) {
+		loff_t where = unatom_dict_read(atable, atom);
+		int len;
+
+		if (where < 0) {
+			err = where;
+			goto error;
+		}
+		if (is_free_unatom(where))
+			continue;
+
+		len = unatom_read(atable, atom, name, sizeof(name));
+		if (len < 0) {
+			err = len;
+			goto error;
+		}
+		err = atom_cache_insert(cache, name, len, atom);
+		if (err)
+			goto error;
+	}
+
+	trace("%u atoms, shift %u", cache->count, cache->shift);
+
+	return cache;
+
+error:
+	atom_cache_destroy(cache);
+	return ERR_PTR(err);
+}
+
+/* Get atom cache. Return NULL if cache is not usable. */
+static struct atom_cache *atom_cache_get(struct inode *atable)
+{
+	struct sb *sb = tux_sb(atable->i_sb);
+	struct atom_cache *cache;
+
+	if (sb->atom_cache)
+		return sb->atom_cache;
+
+	cache = atom_cache_build(atable);
+	if (IS_ERR(cache))
+		return NULL;
+
+	sb->atom_cache = cache;
+	return cache;
+}
+
+/* Convert atom to name */
+static int unatom(struct inode *atable, atom_t atom, char *name, unsigned size)
+{
+	struct atom_cache *cache = atom_cache_get(atable);
+
+	if (cache) {
+		struct atom_entry *entry = atom_cache_lookup_atom(cache, atom);
+		if (entry) {
+			if (size) {
+				if (entry->len > size)
+					return -ERANGE;
+				memcpy(name, entry->name, entry->len);
+			}
+			return entry->len;
+		}
+		/* Not cached atom is broken, let unatom_read() report it */
+	}
+
+	return unatom_read(atable, atom, name, size);
+}
+
 /* Find free atom */
 static int get_freeatom(struct inode *atable, atom_t *atom)
 {
@@ -213,9 +487,22 @@ static int find_atom(struct inode *atable, const char *name, unsigned len,
 		     atom_t *atom)
 {
 	struct sb *sb = tux_sb(atable->i_sb);
+	struct atom_cache *cache = atom_cache_get(atable);
 	struct buffer_head *buffer;
 	tux_dirent *entry;
 
+	if (cache) {
+		struct atom_entry *centry;
+
+		if (len > MAX_ATOM_NAME_LEN)
+			return -ENODATA;
+		centry = atom_cache_lookup_name(cache, name, len);
+		if (!centry)
+			return -ENODATA;
+		*atom = centry->atom;
+		return 0;
+	}
+
 	entry = tux_find_entry(atable, name, len, &buffer, sb->atomdictsize);
 	if (IS_ERR(entry)) {
 		int err = PTR_ERR(entry);
@@ -264,6 +551,10 @@ static int make_atom(struct inode *atable, const char *name, unsigned len,
 		return where;
 	}
 
+	if (sb->atom_cache &&
+	    atom_cache_insert(sb->atom_cache, name, len, *atom))
+		tux3_atom_cache_free(sb);
+
 	return 0;
 }
 
@@ -372,6 +663,15 @@ static int atomref(struct inode *atable, atom_t atom, int use)
 			err = tux_delete_entry(atable, buffer, entry);
 			if (err)
 				return err;
+
+			if (sb->atom_cache) {
+				struct atom_entry *centry;
+				centry = atom_cache_lookup_atom(sb->atom_cache,
+								atom);
+				if (centry)
+					atom_cache_remove(sb->atom_cache,
+							  centry);
+			}
 		} else {
 			/* FIXME: better set a flag that unatom broke
 			 * or something! */
@@ -444,12 +744,101 @@ eek:
 	tux3_err(sb, "eek");
 }
 
+/*
+ * Shared xattr values
+ *
+ * Many inodes tend to have the same xattr value (e.g. security label
+ * or ACL). If sb->xattr_share is not 0, a value of at least that size
+ * is stored only once in the atom dictionary, as an atom whose name
+ * is the value prefixed by '\0' (xattr name can't include '\0', so it
+ * doesn't conflict with name atoms). The inode stores the value atom
+ * (XSHARE_ATTR) instead of the value, and the value atom is refcounted
+ * by atomref() like name atoms. The xcache keeps only the value atom,
+ * and get_xattr() reads the value from the atom cache.
+ *
+ * A value is shared only if it is duplicated. The atom cache remembers
+ * the hash of values set recently, and the value atom is made when
+ * the same value is set again. So a unique value doesn't consume atom.
+ *
+ * Value atoms use the same atom space with name atoms, but xcache and
+ * XATTR_ATTR can store only 16bits atom of name. To leave atoms for
+ * names, value atoms are not made beyond XSHARE_ATOM_MAX.
+ */
+#define XSHARE_MAX_SIZE		(MAX_ATOM_NAME_LEN - 1)
+#define XSHARE_ATOM_MAX		0xf000
+#define XATTR_ATOM_MAX		0xffff
+
+/*
+ * Get the atom of shared value with a reference to it. If the value
+ * should be stored in the inode, *atom is 0.
+ */
+static int xshare_get(struct inode *atable, const void *data, unsigned size,
+		      atom_t *atom)
+{
+	struct sb *sb = tux_sb(atable->i_sb);
+	struct atom_cache *cache;
+	char key[MAX_ATOM_NAME_LEN];
+	int err;
+
+	*atom = 0;
+	if (!sb->xattr_share || size < sb->xattr_share ||
+	    size > XSHARE_MAX_SIZE)
+		return 0;
+	/* Without atom cache, we can't know whether value is duplicated */
+	cache = atom_cache_get(atable);
+	if (!cache)
+		return 0;
+
+	key[0] = '\0';
+	memcpy(key + 1, data, size);
+	err = find_atom(atable, key, size + 1, atom);
+	if (err == -ENODATA) {
+		u32 hash = tux_name_hash(key, size + 1);
+		unsigned slot = hash_32(hash, XSHARE_SEEN_SHIFT);
+		atom_t next = sb->freeatom ? sb->freeatom : sb->atomgen;
+
+		/* First user of value, or no atom left for value */
+		if (cache->xshare_seen[slot] != hash ||
+		    next >= XSHARE_ATOM_MAX) {
+			cache->xshare_seen[slot] = hash;
+			*atom = 0;
+			return 0;
+		}
+		err = make_atom(atable, key, size + 1, atom);
+	}
+	if (!err)
+		err = atomref(atable, *atom, 1);
+	if (err)
+		*atom = 0;
+	return err;
+}
+
+/* Read shared value to data, and return size of value */
+static int xshare_read(struct inode *atable, atom_t atom, void *data,
+		       unsigned size)
+{
+	char key[MAX_ATOM_NAME_LEN];
+	int len = unatom(atable, atom, key, sizeof(key));
+	if (len < 1 || key[0] != '\0') {
+		tux3_fs_error(tux_sb(atable->i_sb),
+			      "atom %x is not shared xattr value", atom);
+		return -EIO;
+	}
+	len--;
+	if (len <= size)
+		memcpy(data, key + 1, len);
+	else if (size)
+		return -ERANGE;
+	return len;
+}
+
 /* Xattr cache */
 
 struct xcache_entry {
 	/* FIXME: 16bits? */
 	u16 atom;		/* atom of xattr data */
 	u16 size;		/* size of body[] */
+	atom_t share;		/* atom of shared value, or 0 if not shared */
 	char body[];
 };
 
@@ -459,11 +848,57 @@ struct xcache {
 	struct xcache_entry xattrs[];
 };
 
+#define MIN_ALLOC_SIZE	(1 << 7)
+
+/*
+ * Most inodes have only a few small xattrs (e.g. security label), so
+ * xcache up to MIN_ALLOC_SIZE is allocated from slab cache.
+ */
+static struct kmem_cache *tux_xcache_cachep;
+
+int __init tux3_init_xcache_cache(void)
+{
+	tux_xcache_cachep = kmem_cache_create("tux3_xcache_cache",
+			sizeof(struct xcache) + MIN_ALLOC_SIZE, 0,
+			SLAB_RECLAIM_ACCOUNT, NULL);
+	if (tux_xcache_cachep == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+void tux3_destroy_xcache_cache(void)
+{
+	kmem_cache_destroy(tux_xcache_cachep);
+}
+
+static struct xcache *xcache_alloc(unsigned size)
+{
+	struct xcache *xcache;
+
+	if (size <= MIN_ALLOC_SIZE) {
+		xcache = kmem_cache_alloc(tux_xcache_cachep, GFP_NOFS);
+		size = MIN_ALLOC_SIZE;
+	} else
+		xcache = malloc(sizeof(*xcache) + size);
+
+	if (xcache)
+		xcache->maxsize = size;
+	return xcache;
+}
+
+void __free_xcache(struct xcache *xcache)
+{
+	if (xcache->maxsize <= MIN_ALLOC_SIZE)
+		kmem_cache_free(tux_xcache_cachep, xcache);
+	else
+		free(xcache);
+}
+
 /* Free xcache memory */
 void free_xcache(struct inode *inode)
 {
 	if (tux_inode(inode)->xcache) {
-		free(tux_inode(inode)->xcache);
+		__free_xcache(tux_inode(inode)->xcache);
 		tux_inode(inode)->xcache = NULL;
 	}
 }
@@ -473,12 +908,11 @@ int new_xcache(struct inode *inode, unsigned size)
 {
 	struct xcache *xcache;
 
-	xcache = malloc(sizeof(*xcache) + size);
+	xcache = xcache_alloc(size);
 	if (!xcache)
 		return -ENOMEM;
 
 	xcache->size = 0;
-	xcache->maxsize = size;
 	tux_inode(inode)->xcache = xcache;
 
 	return 0;
@@ -487,7 +921,6 @@ int new_xcache(struct inode *inode, unsigned size)
 /* Expand xcache memory */
 static int expand_xcache(struct inode *inode, unsigned size)
 {
-#define MIN_ALLOC_SIZE	(1 << 7)
 	struct xcache *xcache, *old = tux_inode(inode)->xcache;
 
 	assert(!old || size > old->maxsize);
@@ -502,7 +935,7 @@ static int expand_xcache(struct inode *inode, unsigned size)
 	assert(size);
 	assert(size <= USHRT_MAX);
 
-	xcache = malloc(sizeof(*xcache) + size);
+	xcache = xcache_alloc(size);
 	if (!xcache)
 		return -ENOMEM;
 
@@ -511,9 +944,8 @@ static int expand_xcache(struct inode *inode, unsigned size)
 	else {
 		xcache->size = old->size;
 		memcpy(xcache->xattrs, old->xattrs, old->size);
-		free(old);
+		__free_xcache(old);
 	}
-	xcache->maxsize = size;
 
 	tux_inode(inode)->xcache = xcache;
 
@@ -545,7 +977,9 @@ int xcache_dump(struct inode *inode)
 		if (xattr->size > tux_sb(inode->i_sb)->blocksize)
 			goto bail;
 		__tux3_dbg("atom %.3x => ", xattr->atom);
-		if (xattr->size)
+		if (xattr->share)
+			__tux3_dbg("shared value atom %x\n", xattr->share);
+		else if (xattr->size)
 			hexdump(xattr->body, xattr->size);
 		else
 			__tux3_dbg("<empty>\n");
@@ -605,46 +1039,82 @@ static inline int remove_old(struct xcache *xcache, struct xcache_entry *xattr)
 static int xcache_update(struct inode *inode, unsigned atom, const void *data,
 			 unsigned len, unsigned flags)
 {
+	struct sb *sb = tux_sb(inode->i_sb);
 	struct xcache *xcache = tux_inode(inode)->xcache;
 	struct xcache_entry *xattr = xcache_lookup(xcache, atom);
-	int use = 0;
+	atom_t share;
+	unsigned more;
+	int err, use = 0;
 
 	if (IS_ERR(xattr)) {
 		if (PTR_ERR(xattr) != -ENOATTR || (flags & XATTR_REPLACE))
 			return PTR_ERR(xattr);
-
-		tux3_xattrdirty(inode);
+		xattr = NULL;
 	} else {
 		if (flags & XATTR_CREATE)
 			return -EEXIST;
-
-		tux3_xattrdirty(inode);
-		/* FIXME: if we can't insert new one, the xattr will lose */
-		use -= remove_old(xcache, xattr);
 	}
 
-	/* Insert new */
-	unsigned more = sizeof(*xattr) + len;
+	/* Take shared value before putting old, old may be the same value */
+	err = xshare_get(sb->atable, data, len, &share);
+	if (err)
+		return err;
+	if (share)
+		len = 0;
+
+	/* Make space for new one (without removing old) before changing */
+	more = sizeof(*xattr) + len;
 	if (!xcache || xcache->size + more > xcache->maxsize) {
 		unsigned oldsize = xcache ? xcache->size : 0;
-		int err = expand_xcache(inode, oldsize + more);
+		err = expand_xcache(inode, oldsize + more);
 		if (err)
-			return err;
+			goto error;
+		xcache = tux_inode(inode)->xcache;
+		if (xattr)
+			xattr = xcache_lookup(xcache, atom);
+	}
+
+	tux3_xattrdirty(inode);
+	if (xattr) {
+		if (xattr->share) {
+			err = atomref(sb->atable, xattr->share, -1);
+			if (err)
+				goto error;
+		}
+		use -= remove_old(xcache, xattr);
 	}
-	xattr = xcache_limit(tux_inode(inode)->xcache);
+
+	/* Insert new */
+	xattr = xcache_limit(xcache);
 	//trace("expand by %i\n", more);
-	tux_inode(inode)->xcache->size += more;
+	xcache->size += more;
 	memcpy(xattr->body, data, (xattr->size = len));
 	xattr->atom = atom;
+	xattr->share = share;
 	tux3_mark_inode_dirty(inode);
 
 	use++;
-	if (use) {
-		/* FIXME: error check */
-		atomref(tux_sb(inode->i_sb)->atable, atom, use);
-	}
-
+	if (use)
+		return atomref(sb->atable, atom, use);
 	return 0;
+
+error:
+	if (share)
+		atomref(sb->atable, share, -1);
+	return err;
+}
+
+/* Drop references of xattr */
+static int xcache_put(struct inode *atable, struct xcache_entry *xattr,
+		      int use)
+{
+	int err = 0;
+
+	if (xattr->share)
+		err = atomref(atable, xattr->share, -1);
+	if (!err)
+		err = atomref(atable, xattr->atom, -use);
+	return err;
 }
 
 /* Inode is going to purge, remove xattrs */
@@ -661,7 +1131,7 @@ int xcache_remove_all(struct inode *inode)
 			 * FIXME: Inode is going to purse, what to do
 			 * if error ?
 			 */
-			int err = atomref(sb->atable, xattr->atom, -1);
+			int err = xcache_put(sb->atable, xattr, 1);
 			if (err)
 				return err;
 
@@ -693,6 +1163,10 @@ int get_xattr(struct inode *inode, const char *name, unsigned len, void *data,
 		ret = PTR_ERR(xattr);
 		goto out;
 	}
+	if (xattr->share) {
+		ret = xshare_read(atable, xattr->share, data, size);
+		goto out;
+	}
 	ret = xattr->size;
 	if (ret <= size)
 		memcpy(data, xattr->body, ret);
@@ -714,6 +1188,8 @@ int set_xattr(struct inode *inode, const char *name, unsigned len,
 
 	atom_t atom;
 	int err = make_atom(atable, name, len, &atom);
+	if (!err && atom > XATTR_ATOM_MAX)
+		err = -ENOSPC;
 	if (!err) {
 		err = xcache_update(inode, atom, data, size, flags);
 		if (err) {
@@ -747,12 +1223,13 @@ int del_xattr(struct inode *inode, const char *name, unsigned len)
 		}
 
 		tux3_xattrdirty(inode);
-		int used = remove_old(xcache, xattr);
-		if (used) {
-			tux3_mark_inode_dirty(inode);
-			/* FIXME: error check */
-			atomref(atable, atom, -used);
+		if (xattr->share) {
+			err = atomref(atable, xattr->share, -1);
+			if (err)
+				goto out;
 		}
+		err = atomref(atable, atom, -remove_old(xcache, xattr));
+		tux3_mark_inode_dirty(inode);
 	}
 out:
 	change_end(sb);
@@ -833,7 +1310,10 @@ unsigned encode_xsize(struct inode *inode)
 	struct xcache_entry *xlimit = xcache_limit(xcache);
 
 	while (xattr < xlimit) {
-		size += 2 + xatsize + xattr->size;
+		if (xattr->share)
+			size += 2 + atsize[XSHARE_ATTR];
+		else
+			size += 2 + xatsize + xattr->size;
 		xattr = xcache_next(xattr);
 	}
 	assert(xattr == xlimit);
@@ -850,13 +1330,22 @@ void *encode_xattrs(struct inode *inode, void *attrs, unsigned size)
 	struct xcache_entry *xattr = xcache->xattrs;
 	struct xcache_entry *xlimit = xcache_limit(xcache);
 	void *limit = attrs + size - 3;
+	unsigned version = tux_sb(inode->i_sb)->version;
 
 	while (xattr < xlimit) {
 		if (attrs >= limit)
 			break;
+		if (xattr->share) {
+			//shared xattr: kind+version:16, atom:16, share:32
+			attrs = encode_kind(attrs, XSHARE_ATTR, version);
+			attrs = encode16(attrs, xattr->atom);
+			attrs = encode32(attrs, xattr->share);
+			xattr = xcache_next(xattr);
+			continue;
+		}
 		//immediate xattr: kind+version:16, bytes:16, atom:16, data[bytes - 2]
 		//printf("xattr %x/%x ", xattr->atom, xattr->size);
-		attrs = encode_kind(attrs, XATTR_ATTR, tux_sb(inode->i_sb)->version);
+		attrs = encode_kind(attrs, XATTR_ATTR, version);
 		attrs = encode16(attrs, xattr->size + 2);
 		attrs = encode16(attrs, xattr->atom);
 		memcpy(attrs, xattr->body, xattr->size);
@@ -882,9 +1371,14 @@ unsigned decode_xsize(struct inode *inode, void *attrs, unsigned size)
 			// immediate xattr: kind+version:16, bytes:16, atom:16, data[bytes - 2]
 			attrs = decode16(attrs, &bytes);
 			attrs += bytes;
-			if (version == sb->version)
+			if (kind == XATTR_ATTR && version == sb->version)
 				total += sizeof(struct xcache_entry) + bytes - 2;
 			continue;
+		case XSHARE_ATTR:
+			/* Value is not cached, get_xattr() reads it */
+			if (version == sb->version)
+				total += sizeof(struct xcache_entry);
+			break;
 		}
 		attrs += atsize[kind];
 	}
@@ -907,6 +1401,7 @@ void *decode_xattr(struct inode *inode, void *attrs)
 	*xattr = (struct xcache_entry){
 		.atom = atom,
 		.size = bytes - 2,
+		.share = 0,
 	};
 	xsize = sizeof(*xattr) + xattr->size;
 	assert((void *)xattr + xsize <= limit);
@@ -917,3 +1412,26 @@ void *decode_xattr(struct inode *inode, void *attrs)
 
 	return attrs;
 }
+
+void *decode_xshare(struct inode *inode, void *attrs)
+{
+	// shared xattr: kind+version:16, atom:16, share:32
+	struct xcache *xcache = tux_inode(inode)->xcache;
+	struct xcache_entry *xattr = xcache_limit(xcache);
+	void *limit = xcache->xattrs + xcache->maxsize;
+	unsigned atom, share;
+
+	attrs = decode16(attrs, &atom);
+	attrs = decode32(attrs, &share);
+
+	/* FIXME: check limit!!! */
+	assert((void *)xattr + sizeof(*xattr) <= limit);
+	*xattr = (struct xcache_entry){
+		.atom = atom,
+		.size = 0,
+		.share = share,
+	};
+	xcache->size += sizeof(*xattr);
+
+	return attrs;
+}
@@ -0,0 +1,67 @@
+#include <string.h>
+#include <assert.h>
+
+#include <libklib/libklib.h>
+#include <libklib/percpu-refcount.h>
+
+/* Slot index + 1 of this thread (0 means not assigned yet) */
+__thread unsigned percpu_ref_thread_slot;
+static unsigned percpu_ref_next_slot;
+
+unsigned percpu_ref_alloc_slot(void)
+{
+	unsigned slot = __atomic_fetch_add(&percpu_ref_next_slot, 1,
+					   __ATOMIC_RELAXED);
+	return slot % PERCPU_REF_SLOTS + 1;
+}
+
+int percpu_ref_init(struct percpu_ref *ref, percpu_ref_func_t *release,
+		    unsigned int flags, gfp_t gfp)
+{
+	memset(ref->slots, 0, sizeof(ref->slots));
+	ref->release = release;
+	ref->dead = !!(flags & PERCPU_REF_INIT_DEAD);
+	ref->atomic = ref->dead || (flags & PERCPU_REF_INIT_ATOMIC);
+	/* Initial reference, released by percpu_ref_kill() */
+	ref->count = ref->dead ? 0 : 1;
+
+	return 0;
+}
+
+/* Collect per-thread counters into ->count */
+static void percpu_ref_switch_to_atomic(struct percpu_ref *ref)
+{
+	long count = 0;
+	int i;
+
+	for (i = 0; i < PERCPU_REF_SLOTS; i++) {
+		count += __atomic_exchange_n(&ref->slots[i].count, 0,
+					     __ATOMIC_ACQUIRE);
+	}
+	__atomic_add_fetch(&ref->count, count, __ATOMIC_RELAXED);
+	ref->atomic = true;
+}
+
+/* Drop the initial reference, and switch to atomic mode */
+void percpu_ref_kill(struct percpu_ref *ref)
+{
+	assert(!ref->dead);
+	ref->dead = true;
+	if (!ref->atomic)
+		percpu_ref_switch_to_atomic(ref);
+	percpu_ref_put(ref);
+}
+
+/* Make killed ref live again, with the initial reference */
+void percpu_ref_reinit(struct percpu_ref *ref)
+{
+	assert(percpu_ref_is_zero(ref));
+	ref->count = 1;
+	ref->dead = false;
+	ref->atomic = false;
+}
+
+bool percpu_ref_is_zero(struct percpu_ref *ref)
+{
+	return ref->atomic && !__atomic_load_n(&ref->count, __ATOMIC_ACQUIRE);
+}
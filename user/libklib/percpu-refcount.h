@@ -0,0 +1,93 @@
+#ifndef LIBKLIB_PERCPU_REFCOUNT_H
+#define LIBKLIB_PERCPU_REFCOUNT_H
+
+#include <stdbool.h>
+#include <libklib/types.h>
+#include <libklib/compiler.h>
+
+/*
+ * Userspace percpu_ref
+ *
+ * Like the kernel, while the ref is live, a reference is counted on
+ * per-thread counters (threads are spread over PERCPU_REF_SLOTS
+ * cachelines), so get/put from many threads don't bounce one shared
+ * cacheline. percpu_ref_kill() collects per-thread counters into
+ * ->count and switches to atomic mode, then ->release() is called
+ * when ->count reached zero.
+ *
+ * There is no RCU in userspace, so percpu_ref_kill() must not race
+ * with get/put on per-thread counters. (tux3 serializes the frontend
+ * and the backend by ->frontend_lock.)
+ */
+
+#define PERCPU_REF_SLOTS	16
+
+struct percpu_ref;
+typedef void (percpu_ref_func_t)(struct percpu_ref *);
+
+/* flags for percpu_ref_init() */
+enum {
+	PERCPU_REF_INIT_ATOMIC	= 1 << 0,	/* start in atomic mode */
+	PERCPU_REF_INIT_DEAD	= 1 << 1,	/* start dead, count is 0 */
+};
+
+struct percpu_ref_slot {
+	long count;
+} __attribute__((aligned(64)));
+
+struct percpu_ref {
+	long count;			/* count in atomic mode */
+	bool atomic;			/* in atomic mode */
+	bool dead;			/* killed */
+	percpu_ref_func_t *release;
+	struct percpu_ref_slot slots[PERCPU_REF_SLOTS];
+};
+
+extern __thread unsigned percpu_ref_thread_slot;
+unsigned percpu_ref_alloc_slot(void);
+
+static inline struct percpu_ref_slot *percpu_ref_slot(struct percpu_ref *ref)
+{
+	if (unlikely(!percpu_ref_thread_slot))
+		percpu_ref_thread_slot = percpu_ref_alloc_slot();
+	return &ref->slots[percpu_ref_thread_slot - 1];
+}
+
+int percpu_ref_init(struct percpu_ref *ref, percpu_ref_func_t *release,
+		    unsigned int flags, gfp_t gfp);
+void percpu_ref_kill(struct percpu_ref *ref);
+void percpu_ref_reinit(struct percpu_ref *ref);
+bool percpu_ref_is_zero(struct percpu_ref *ref);
+
+static inline void percpu_ref_exit(struct percpu_ref *ref)
+{
+}
+
+static inline void percpu_ref_get(struct percpu_ref *ref)
+{
+	if (likely(!ref->atomic))
+		__atomic_add_fetch(&percpu_ref_slot(ref)->count, 1,
+				   __ATOMIC_RELAXED);
+	else
+		__atomic_add_fetch(&ref->count, 1, __ATOMIC_RELAXED);
+}
+
+/* Get reference unless ref was killed */
+static inline bool percpu_ref_tryget_live(struct percpu_ref *ref)
+{
+	if (unlikely(ref->dead))
+		return false;
+	percpu_ref_get(ref);
+	return true;
+}
+
+static inline void percpu_ref_put(struct percpu_ref *ref)
+{
+	if (likely(!ref->atomic))
+		__atomic_sub_fetch(&percpu_ref_slot(ref)->count, 1,
+				   __ATOMIC_RELEASE);
+	else if (__atomic_sub_fetch(&ref->count, 1, __ATOMIC_ACQ_REL) == 0)
+		ref->release(ref);
+}
+
+#endif /* !LIBKLIB_PERCPU_REFCOUNT_H */
@@ -250,4 +250,29 @@
 #define rcu_assign_pointer(p, v) \
 	__rcu_assign_pointer((p), (v), __rcu)
 
+/*
+ * Userland doesn't run RCU readers concurrently with updaters, so
+ * read-side critical section is empty, and grace period is always
+ * elapsed.
+ */
+struct rcu_head {
+	struct rcu_head *next;
+	void (*func)(struct rcu_head *head);
+};
+
+static inline int rcu_read_lock_held(void)
+{
+	return 1;
+}
+
+static inline void rcu_read_lock(void)
+{
+}
+
+static inline void rcu_read_unlock(void)
+{
+}
+
+#define kfree_rcu(ptr, rcu_head)	free(ptr)
+
 #endif /* !LIBKLIB_RCUPDATE_H */
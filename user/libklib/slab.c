@@ -5,51 +5,365 @@
 #include <libklib/libklib.h>
 #include <libklib/slab.h>
 
+#ifdef HAVE_VALGRIND
+#include <valgrind/valgrind.h>
+#else
+#define RUNNING_ON_VALGRIND	0
+#endif
+
+/*
+ * Userspace slab allocator
+ *
+ * Objects are carved from slabs (chunks of at least SLAB_MIN_BYTES
+ * bytes), and are not returned to malloc until kmem_cache_destroy().
+ * Like the kernel, the constructor is called only when an object slot
+ * is created, so a freed object must be in constructed state. For a
+ * cache with constructor, the free pointer is placed after the object
+ * to not break the constructed state.
+ *
+ * Each thread has a magazine (small stack of free objects) per cache,
+ * so usually alloc/free is only push/pop without locking. If the
+ * magazine is empty or full, objects are moved between the magazine
+ * and cache->freelist under cache->lock, half of magazine at once.
+ *
+ * Magazines are linked to cache->magazines, and freed by
+ * kmem_cache_destroy() or by the exit of the thread.
+ *
+ * With SLAB_DEBUG, or if running on valgrind, caches pass through to
+ * malloc() for each object instead, so valgrind can find leaks and
+ * use-after-free of objects.
+ */
+
+#define SLAB_MIN_BYTES		(64 * 1024)
+#define SLAB_MIN_OBJS		16
+#define MAGAZINE_SIZE		32
+#define KMEM_MAX_CACHES		64
+
+#ifdef SLAB_DEBUG
+#define slab_passthrough()	1
+#else
+#define slab_passthrough()	RUNNING_ON_VALGRIND
+#endif
+
+struct kmem_magazine {
+	struct list_head list;		/* link for cache->magazines */
+	unsigned count;			/* number of objects in objs[] */
+	void *objs[MAGAZINE_SIZE];
+};
+
+struct kmem_magazine_slot {
+	unsigned long gen;		/* generation of cache */
+	struct kmem_magazine *mag;
+};
+
+/* Protects kmem_caches, kmem_cache_ids, and kmem_cache_gen */
+static pthread_mutex_t kmem_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(kmem_caches);
+static unsigned long kmem_cache_ids[BITS_TO_LONGS(KMEM_MAX_CACHES)];
+static unsigned long kmem_cache_gen;
+
+static pthread_key_t kmem_thread_key;
+static pthread_once_t kmem_thread_once = PTHREAD_ONCE_INIT;
+static __thread struct kmem_magazine_slot kmem_magazines[KMEM_MAX_CACHES];
+
+static inline void **free_pointer(struct kmem_cache *cachep, void *objp)
+{
+	return objp + cachep->offset;
+}
+
+/* Give back objects of magazine to cache->freelist */
+static void magazine_drain(struct kmem_cache *cachep, struct kmem_magazine *mag,
+			   unsigned count)
+{
+	while (count--) {
+		void *objp = mag->objs[--mag->count];
+		*free_pointer(cachep, objp) = cachep->freelist;
+		cachep->freelist = objp;
+		cachep->nr_free++;
+	}
+}
+
+/* Called at thread exit, give back objects of this thread to caches */
+static void kmem_thread_exit(void *unused)
+{
+	struct kmem_cache *cachep;
+
+	pthread_mutex_lock(&kmem_caches_lock);
+	list_for_each_entry(cachep, &kmem_caches, list) {
+		struct kmem_magazine_slot *slot = &kmem_magazines[cachep->id];
+		struct kmem_magazine *mag = slot->mag;
+
+		/* If generation is different, cache freed the magazine */
+		if (!mag || slot->gen != cachep->gen)
+			continue;
+
+		pthread_mutex_lock(&cachep->lock);
+		magazine_drain(cachep, mag, mag->count);
+		list_del(&mag->list);
+		pthread_mutex_unlock(&cachep->lock);
+
+		free(mag);
+		slot->mag = NULL;
+	}
+	pthread_mutex_unlock(&kmem_caches_lock);
+}
+
+static void kmem_thread_init(void)
+{
+	pthread_key_create(&kmem_thread_key, kmem_thread_exit);
+}
+
+static struct kmem_magazine *get_magazine(struct kmem_cache *cachep)
+{
+	struct kmem_magazine_slot *slot = &kmem_magazines[cachep->id];
+	struct kmem_magazine *mag;
+
+	if (likely(slot->mag && slot->gen == cachep->gen))
+		return slot->mag;
+
+	mag = malloc(sizeof(*mag));
+	if (!mag)
+		return NULL;
+	mag->count = 0;
+
+	/* Register destructor to give back objects at thread exit */
+	pthread_once(&kmem_thread_once, kmem_thread_init);
+	pthread_setspecific(kmem_thread_key, mag);
+
+	pthread_mutex_lock(&cachep->lock);
+	list_add(&mag->list, &cachep->magazines);
+	pthread_mutex_unlock(&cachep->lock);
+
+	slot->gen = cachep->gen;
+	slot->mag = mag;
+
+	return mag;
+}
+
+/* Allocate new slab, and add its objects to cache->freelist */
+static int cache_grow(struct kmem_cache *cachep)
+{
+	unsigned head = ALIGN(sizeof(void *), cachep->align);
+	void *slab, *objp;
+	unsigned i;
+	int err;
+
+	err = posix_memalign(&slab, cachep->align,
+			     head + cachep->size * cachep->objs_per_slab);
+	if (err)
+		return -ENOMEM;
+
+	*(void **)slab = cachep->slabs;
+	cachep->slabs = slab;
+
+	objp = slab + head;
+	for (i = 0; i < cachep->objs_per_slab; i++) {
+		if (cachep->ctor)
+			cachep->ctor(objp);
+		*free_pointer(cachep, objp) = cachep->freelist;
+		cachep->freelist = objp;
+		objp += cachep->size;
+	}
+	cachep->nr_free += cachep->objs_per_slab;
+	cachep->nr_objs += cachep->objs_per_slab;
+
+	return 0;
+}
+
+/* Allocate object by malloc() for passthrough cache */
+static void *passthrough_alloc(struct kmem_cache *cachep)
+{
+	void *objp;
+
+	if (posix_memalign(&objp, cachep->align, cachep->object_size))
+		return NULL;
+	if (cachep->ctor)
+		cachep->ctor(objp);
+
+	pthread_mutex_lock(&cachep->lock);
+	cachep->nr_objs++;
+	pthread_mutex_unlock(&cachep->lock);
+
+	return objp;
+}
+
+static void passthrough_free(struct kmem_cache *cachep, void *objp)
+{
+	pthread_mutex_lock(&cachep->lock);
+	cachep->nr_objs--;
+	pthread_mutex_unlock(&cachep->lock);
+
+	free(objp);
+}
+
+/* Fill magazine from cache->freelist */
+static int magazine_fill(struct kmem_cache *cachep, struct kmem_magazine *mag)
+{
+	unsigned count = MAGAZINE_SIZE / 2;
+
+	pthread_mutex_lock(&cachep->lock);
+	if (cachep->nr_free < count) {
+		int err = cache_grow(cachep);
+		if (err && !cachep->nr_free) {
+			pthread_mutex_unlock(&cachep->lock);
+			return err;
+		}
+	}
+	while (count-- && cachep->freelist) {
+		void *objp = cachep->freelist;
+		cachep->freelist = *free_pointer(cachep, objp);
+		cachep->nr_free--;
+		mag->objs[mag->count++] = objp;
+	}
+	pthread_mutex_unlock(&cachep->lock);
+
+	return 0;
+}
+
 struct kmem_cache *kmem_cache_create(const char *name, size_t size,
 				     size_t align, unsigned long flags,
 				     void (*ctor)(void *))
 {
 	struct kmem_cache *cachep;
+	unsigned id;
 
 	cachep = malloc(sizeof(*cachep));
-	if (cachep) {
-		cachep->name		= name;
-		cachep->object_size	= size;
-		cachep->align		= align;
-		cachep->flags		= flags;
-		cachep->ctor		= ctor;
+	if (!cachep)
+		return NULL;
+
+	if (flags & SLAB_HWCACHE_ALIGN)
+		align = max_t(size_t, align, 64);
+	align = max_t(size_t, align, sizeof(void *));
+
+	cachep->name		= name;
+	cachep->object_size	= size;
+	cachep->align		= align;
+	cachep->flags		= flags;
+	cachep->ctor		= ctor;
+	cachep->passthrough	= slab_passthrough();
+
+	/* Constructed object can't be used for free pointer */
+	cachep->offset = ctor ? ALIGN(size, sizeof(void *)) : 0;
+	cachep->size = ALIGN(max_t(size_t, size, cachep->offset + sizeof(void *)),
+			     align);
+	cachep->objs_per_slab = max_t(unsigned, SLAB_MIN_OBJS,
+				      SLAB_MIN_BYTES / cachep->size);
+
+	pthread_mutex_init(&cachep->lock, NULL);
+	cachep->freelist	= NULL;
+	cachep->nr_free		= 0;
+	cachep->nr_objs		= 0;
+	cachep->slabs		= NULL;
+	INIT_LIST_HEAD(&cachep->magazines);
+
+	pthread_mutex_lock(&kmem_caches_lock);
+	id = find_first_zero_bit(kmem_cache_ids, KMEM_MAX_CACHES);
+	if (id >= KMEM_MAX_CACHES) {
+		pthread_mutex_unlock(&kmem_caches_lock);
+		fprintf(stderr, "%s: too many caches\n", __func__);
+		free(cachep);
+		return NULL;
 	}
+	__set_bit(id, kmem_cache_ids);
+	cachep->id = id;
+	cachep->gen = ++kmem_cache_gen;
+	list_add(&cachep->list, &kmem_caches);
+	pthread_mutex_unlock(&kmem_caches_lock);
+
 	return cachep;
 }
 
 void kmem_cache_destroy(struct kmem_cache *cachep)
 {
+	struct kmem_magazine *mag, *safe;
+	unsigned long nr_free;
+	void *slab;
+
+	if (!cachep)
+		return;
+
+	pthread_mutex_lock(&kmem_caches_lock);
+	list_del(&cachep->list);
+	__clear_bit(cachep->id, kmem_cache_ids);
+	pthread_mutex_unlock(&kmem_caches_lock);
+
+	nr_free = cachep->nr_free;
+	list_for_each_entry_safe(mag, safe, &cachep->magazines, list) {
+		nr_free += mag->count;
+		list_del(&mag->list);
+		free(mag);
+	}
+	if (nr_free != cachep->nr_objs) {
+		fprintf(stderr, "%s: %s: %lu objects are still in use\n",
+			__func__, cachep->name, cachep->nr_objs - nr_free);
+	}
+
+	slab = cachep->slabs;
+	while (slab) {
+		void *next = *(void **)slab;
+		free(slab);
+		slab = next;
+	}
+
+	pthread_mutex_destroy(&cachep->lock);
 	free(cachep);
 }
 
 void kmem_cache_free(struct kmem_cache *cachep, void *objp)
 {
-	free(objp);
+	struct kmem_magazine *mag;
+
+	if (!objp)
+		return;
+
+	if (cachep->passthrough) {
+		passthrough_free(cachep, objp);
+		return;
+	}
+
+	mag = get_magazine(cachep);
+	if (unlikely(!mag)) {
+		pthread_mutex_lock(&cachep->lock);
+		*free_pointer(cachep, objp) = cachep->freelist;
+		cachep->freelist = objp;
+		cachep->nr_free++;
+		pthread_mutex_unlock(&cachep->lock);
+		return;
+	}
+
+	if (unlikely(mag->count == MAGAZINE_SIZE)) {
+		pthread_mutex_lock(&cachep->lock);
+		magazine_drain(cachep, mag, MAGAZINE_SIZE / 2);
+		pthread_mutex_unlock(&cachep->lock);
+	}
+	mag->objs[mag->count++] = objp;
 }
 
 void *kmem_cache_alloc(struct kmem_cache *cachep, gfp_t flags)
 {
+	struct kmem_magazine *mag;
 	void *objp;
 
-	if (cachep->align) {
-		int err;
-		err = posix_memalign(&objp, cachep->align, cachep->object_size);
-		if (err)
-			objp = NULL;
-	} else
-		objp = malloc(cachep->object_size);
+	if (cachep->passthrough) {
+		objp = passthrough_alloc(cachep);
+		if (!objp)
+			return NULL;
+		goto out;
+	}
 
-	if (objp) {
-		if (cachep->ctor)
-			cachep->ctor(objp);
-		if (flags & __GFP_ZERO)
-			memset(objp, 0, cachep->object_size);
+	mag = get_magazine(cachep);
+	if (unlikely(!mag))
+		return NULL;
+
+	if (unlikely(!mag->count)) {
+		if (magazine_fill(cachep, mag))
+			return NULL;
 	}
+	objp = mag->objs[--mag->count];
+out:
+
+	if (flags & __GFP_ZERO)
+		memset(objp, 0, cachep->object_size);
 
 	return objp;
 }
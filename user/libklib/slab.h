@@ -1,6 +1,7 @@
 #ifndef LIBKLIB_SLAB_H
 #define LIBKLIB_SLAB_H
 
+#include <pthread.h>
 #include <libklib/mm.h>
 
 /*
@@ -77,6 +78,21 @@ struct kmem_cache {
 	unsigned long flags;		/* Active flags on the slab */
 	const char *name;		/* Slab name for sysfs */
 	void (*ctor)(void *);		/* Called on object slot creation */
+
+	unsigned int size;		/* Object size including metadata */
+	unsigned int offset;		/* Offset of free pointer in object */
+	unsigned int objs_per_slab;	/* Number of objects per slab */
+	unsigned int id;		/* Index of per-thread magazine */
+	unsigned long gen;		/* Generation to validate magazine */
+	int passthrough;		/* Objects are malloc()ed one by one */
+
+	pthread_mutex_t lock;		/* Protects below */
+	void *freelist;			/* Free objects not in magazine */
+	unsigned long nr_free;		/* Number of objects in freelist */
+	unsigned long nr_objs;		/* Number of allocated object slots */
+	void *slabs;			/* List of slabs */
+	struct list_head magazines;	/* Magazines of threads */
+	struct list_head list;		/* Link for list of caches */
 };
 
 struct kmem_cache *kmem_cache_create(const char *, size_t, size_t,
@@ -3,8 +3,14 @@
 
 #include <libklib/typecheck.h>
 
+#include <pthread.h>
+
 /*
- * Provide wait queue stabs
+ * Provide wait queue by pthread
+ *
+ * Waker increments ->seq, so waiter can notice the wake up happened
+ * after it checked the condition. With this, the condition is
+ * checked without ->lock, like kernel.
  */
 
 struct __wait_queue {
@@ -12,6 +18,9 @@ struct __wait_queue {
 typedef struct __wait_queue wait_queue_t;
 
 struct __wait_queue_head {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned long seq;	/* incremented by each wake up */
 };
 typedef struct __wait_queue_head wait_queue_head_t;
 
@@ -20,7 +29,8 @@ typedef struct __wait_queue_head wait_queue_head_t;
 #define DECLARE_WAITQUEUE(name, tsk)					\
 	wait_queue_t name = __WAITQUEUE_INITIALIZER(name, tsk)
 
-#define __WAIT_QUEUE_HEAD_INITIALIZER(name)	{}
+#define __WAIT_QUEUE_HEAD_INITIALIZER(name)				\
+	{ PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 }
 
 #define DECLARE_WAIT_QUEUE_HEAD(name) \
 	wait_queue_head_t name = __WAIT_QUEUE_HEAD_INITIALIZER(name)
@@ -28,13 +38,47 @@ typedef struct __wait_queue_head wait_queue_head_t;
 #define init_waitqueue_head(q)				\
 do {							\
 	typecheck(wait_queue_head_t *, q);		\
+	pthread_mutex_init(&(q)->lock, NULL);		\
+	pthread_cond_init(&(q)->cond, NULL);		\
+	(q)->seq = 0;					\
 } while (0)
 
 #define DECLARE_WAIT_QUEUE_HEAD_ONSTACK(name) DECLARE_WAIT_QUEUE_HEAD(name)
 
+/* Snapshot of wake up sequence, take this before checking condition */
+static inline unsigned long wait_queue_seq(wait_queue_head_t *q)
+{
+	unsigned long seq;
+
+	pthread_mutex_lock(&q->lock);
+	seq = q->seq;
+	pthread_mutex_unlock(&q->lock);
+
+	return seq;
+}
+
+/* Sleep until wake up after the snapshot of wait_queue_seq() */
+static inline void wait_queue_sleep(wait_queue_head_t *q, unsigned long seq)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->seq == seq)
+		pthread_cond_wait(&q->cond, &q->lock);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Wake up all waiters, we don't have exclusive waiters */
+static inline void wait_queue_wake_all(wait_queue_head_t *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->seq++;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
 #define __wake_up(q, mode, nr, key)			\
 do {							\
 	typecheck(wait_queue_head_t *, q);		\
+	wait_queue_wake_all(q);				\
 } while (0)
 
 #define wake_up(x)			__wake_up(x, TASK_NORMAL, 1, NULL)
@@ -52,8 +96,10 @@ do {							\
 do {									\
 	typecheck(wait_queue_head_t, wq);				\
 	for (;;) {							\
+		unsigned long __seq = wait_queue_seq(&(wq));		\
 		if (condition)						\
 			break;						\
+		wait_queue_sleep(&(wq), __seq);				\
 	}								\
 } while (0)
 
@@ -11,19 +11,186 @@
 
 #include "tux3user.h"
 
+#ifndef trace
+#define trace trace_on
+#endif
+
 #include "kernel/namei.c"
 
+/*
+ * Dentry cache
+ *
+ * Userland doesn't have dcache of VFS, so each lookup had to search
+ * directory blocks. This caches the result of lookup by (parent inum,
+ * name), including negative result (inum == TUX_INVALID_INO).
+ *
+ * All directory changes on userland go through the functions in this
+ * file, and they update or drop the cached entries of changed names.
+ *
+ * Hit rates are counted in sb->dcachestat, and read by dcache_stat()
+ * (e.g. TUX3_IOC_DCACHESTAT of tux3fuse).
+ */
+#define DCACHE_HASH_SHIFT	14
+#define DCACHE_MAX		(1 << 16)
+
+struct dcache_entry {
+	struct hlist_node hash;		/* link for dcache_hash */
+	struct list_head lru;		/* link for dcache_lru */
+	struct sb *sb;
+	inum_t parent;			/* inum of directory */
+	inum_t inum;			/* TUX_INVALID_INO if negative */
+	u32 key;			/* hash of (parent, name) */
+	unsigned len;
+	char name[];
+};
+
+static struct hlist_head dcache_hash[1 << DCACHE_HASH_SHIFT];
+static LIST_HEAD(dcache_lru);
+static unsigned dcache_count;
+
+static u32 dcache_key(inum_t parent, const char *name, unsigned len)
+{
+	u64 hash = tux_name_hash(name, len);
+
+	return hash_64(parent ^ (hash << 16), 32);
+}
+
+static struct hlist_head *dcache_head(u32 key)
+{
+	return dcache_hash + hash_32(key, DCACHE_HASH_SHIFT);
+}
+
+static struct dcache_entry *dcache_lookup(struct inode *dir, const char *name,
+					  unsigned len)
+{
+	struct sb *sb = tux_sb(dir->i_sb);
+	inum_t parent = tux_inode(dir)->inum;
+	u32 key = dcache_key(parent, name, len);
+	struct dcache_entry *entry;
+
+	hlist_for_each_entry(entry, dcache_head(key), hash) {
+		if (entry->key == key && entry->sb == sb &&
+		    entry->parent == parent && entry->len == len &&
+		    !memcmp(entry->name, name, len)) {
+			/* Move to head of LRU */
+			list_move(&entry->lru, &dcache_lru);
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static void dcache_del(struct dcache_entry *entry)
+{
+	hlist_del(&entry->hash);
+	list_del(&entry->lru);
+	dcache_count--;
+	entry->sb->dcachestat.entries--;
+	free(entry);
+}
+
+/* Remember the result of lookup */
+static void dcache_add(struct inode *dir, const char *name, unsigned len,
+		       inum_t inum)
+{
+	struct dcache_entry *entry;
+
+	entry = dcache_lookup(dir, name, len);
+	if (entry) {
+		entry->inum = inum;
+		return;
+	}
+
+	entry = malloc(sizeof(*entry) + len);
+	if (!entry)
+		return;
+
+	entry->sb	= tux_sb(dir->i_sb);
+	entry->parent	= tux_inode(dir)->inum;
+	entry->inum	= inum;
+	entry->key	= dcache_key(entry->parent, name, len);
+	entry->len	= len;
+	memcpy(entry->name, name, len);
+
+	hlist_add_head(&entry->hash, dcache_head(entry->key));
+	list_add(&entry->lru, &dcache_lru);
+	entry->sb->dcachestat.entries++;
+	if (++dcache_count > DCACHE_MAX) {
+		entry = list_entry(dcache_lru.prev, struct dcache_entry, lru);
+		dcache_del(entry);
+	}
+}
+
+/* Forget the name, the result of change is unknown */
+static void dcache_forget(struct inode *dir, const char *name, unsigned len)
+{
+	struct dcache_entry *entry = dcache_lookup(dir, name, len);
+
+	if (entry)
+		dcache_del(entry);
+}
+
+/* Forget all cached entries of sb, and reset statistics */
+void dcache_invalidate(struct sb *sb)
+{
+	struct tux3_dcachestat *stat = &sb->dcachestat;
+	struct dcache_entry *entry, *n;
+
+	trace("hits %Lu, negative hits %Lu, misses %Lu",
+	      stat->hits, stat->neg_hits, stat->misses);
+
+	list_for_each_entry_safe(entry, n, &dcache_lru, lru) {
+		if (entry->sb == sb)
+			dcache_del(entry);
+	}
+	assert(!stat->entries);
+	memset(stat, 0, sizeof(*stat));
+}
+
+/* Read statistics of dentry cache for sb */
+void dcache_stat(struct sb *sb, struct tux3_dcachestat *stat)
+{
+	*stat = sb->dcachestat;
+}
+
 static int tuxlookup(struct inode *dir, struct dentry *dentry)
 {
+	struct tux3_dcachestat *stat = &tux_sb(dir->i_sb)->dcachestat;
+	const char *name = (const char *)dentry->d_name.name;
+	unsigned len = dentry->d_name.len;
+	struct dcache_entry *entry;
 	struct dentry *result;
 
+	entry = dcache_lookup(dir, name, len);
+	if (entry) {
+		struct inode *inode;
+
+		if (entry->inum == TUX_INVALID_INO) {
+			stat->neg_hits++;
+			return -ENOENT;
+		}
+
+		inode = tux3_iget(tux_sb(dir->i_sb), entry->inum);
+		if (!IS_ERR(inode)) {
+			stat->hits++;
+			dentry->d_inode = inode;
+			return 0;
+		}
+		/* Stale entry, lookup directory */
+		dcache_del(entry);
+	}
+	stat->misses++;
+
 	result = tux3_lookup(dir, dentry, 0);
 	if (result && IS_ERR(result))
 		return PTR_ERR(result);
 	assert(result == NULL);
 
-	if (!dentry->d_inode)
+	if (!dentry->d_inode) {
+		dcache_add(dir, name, len, TUX_INVALID_INO);
 		return -ENOENT;
+	}
+	dcache_add(dir, name, len, tux_inode(dentry->d_inode)->inum);
 
 	return 0;
 }
@@ -45,9 +212,22 @@ struct inode *tuxopen(struct inode *dir, const char *name, unsigned len)
 
 static int tux_check_exist(struct inode *dir, struct qstr *qstr)
 {
+	struct tux3_dcachestat *stat = &tux_sb(dir->i_sb)->dcachestat;
+	struct dcache_entry *dentry;
 	struct buffer_head *buffer;
 	tux_dirent *entry;
 
+	dentry = dcache_lookup(dir, (const char *)qstr->name, qstr->len);
+	if (dentry) {
+		if (dentry->inum == TUX_INVALID_INO) {
+			stat->neg_hits++;
+			return 0;
+		}
+		stat->hits++;
+		return -EEXIST;
+	}
+	stat->misses++;
+
 	entry = tux_find_dirent(dir, qstr, &buffer);
 	if (!IS_ERR(entry)) {
 		blockput(buffer);
@@ -69,8 +249,11 @@ struct inode *__tuxmknod(struct inode *dir, const char *name, unsigned len,
 	int err;
 
 	err = __tux3_mknod(dir, &dentry, iattr, rdev);
-	if (err)
+	if (err) {
+		dcache_forget(dir, name, len);
 		return ERR_PTR(err);
+	}
+	dcache_add(dir, name, len, tux_inode(dentry.d_inode)->inum);
 
 	return dentry.d_inode;
 }
@@ -112,9 +295,12 @@ struct inode *__tuxlink(struct inode *src_inode, struct inode *dir,
 	int err;
 
 	err = tux3_link(&src, dir, &dst);
-	if (err)
+	if (err) {
+		dcache_forget(dir, dstname, dstlen);
 		return ERR_PTR(err);
+	}
 	assert(dst.d_inode == src_inode);
+	dcache_add(dir, dstname, dstlen, tux_inode(src_inode)->inum);
 	return dst.d_inode;
 }
 
@@ -189,8 +375,11 @@ struct inode *__tuxsymlink(struct inode *dir, const char *name, unsigned len,
 
 	iattr->mode = S_IFLNK | S_IRWXUGO;
 	err = __tux3_symlink(dir, &dentry, iattr, symname);
-	if (err)
+	if (err) {
+		dcache_forget(dir, name, len);
 		return ERR_PTR(err);
+	}
+	dcache_add(dir, name, len, tux_inode(dentry.d_inode)->inum);
 	return dentry.d_inode;
 }
 
@@ -240,6 +429,10 @@ int tuxunlink(struct inode *dir, const char *name, unsigned len)
 		return err;
 
 	err = tux3_unlink(dir, &dentry);
+	if (err)
+		dcache_forget(dir, name, len);
+	else
+		dcache_add(dir, name, len, TUX_INVALID_INO);
 
 	/* This iput() will schedule deletion if i_nlink == 0 && i_count == 1 */
 	iput(dentry.d_inode);
@@ -265,8 +458,13 @@ int tuxrmdir(struct inode *dir, const char *name, unsigned len)
 		return err;
 
 	err = -ENOTDIR;
-	if (S_ISDIR(dentry.d_inode->i_mode))
+	if (S_ISDIR(dentry.d_inode->i_mode)) {
 		err = tux3_rmdir(dir, &dentry);
+		if (err)
+			dcache_forget(dir, name, len);
+		else
+			dcache_add(dir, name, len, TUX_INVALID_INO);
+	}
 
 	/* This iput() will schedule deletion if i_nlink == 0 && i_count == 1 */
 	iput(dentry.d_inode);
@@ -319,6 +517,14 @@ int tuxrename(struct inode *old_dir, const char *old_name, unsigned old_len,
 	}
 
 	err = tux3_rename(old_dir, &old, new_dir, &new);
+	if (err) {
+		dcache_forget(old_dir, old_name, old_len);
+		dcache_forget(new_dir, new_name, new_len);
+	} else {
+		dcache_add(old_dir, old_name, old_len, TUX_INVALID_INO);
+		dcache_add(new_dir, new_name, new_len,
+			   tux_inode(old.d_inode)->inum);
+	}
 out:
 	if (new.d_inode)
 		iput(new.d_inode);
@@ -58,6 +58,8 @@ int put_super(struct sb *sb)
 
 	__tux3_put_super(sb);
 
+	iattr_cache_invalidate(sb);
+	dcache_invalidate(sb);
 	inode_leak_check();
 
 	return 0;
@@ -198,10 +200,37 @@ error:
 
 int tux3_init_mem(void)
 {
-	return tux3_init_hole_cache();
+	int err;
+
+	err = tux3_init_hole_cache();
+	if (err)
+		goto error;
+	err = tux3_init_cursor_cache();
+	if (err)
+		goto error_cursor;
+	err = tux3_init_orphan_cache();
+	if (err)
+		goto error_orphan;
+	err = tux3_init_xcache_cache();
+	if (err)
+		goto error_xcache;
+
+	return 0;
+
+error_xcache:
+	tux3_destroy_orphan_cache();
+error_orphan:
+	tux3_destroy_cursor_cache();
+error_cursor:
+	tux3_destroy_hole_cache();
+error:
+	return err;
 }
 
 void tux3_exit_mem(void)
 {
+	tux3_destroy_xcache_cache();
+	tux3_destroy_orphan_cache();
+	tux3_destroy_cursor_cache();
 	tux3_destroy_hole_cache();
 }
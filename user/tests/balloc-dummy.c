@@ -77,6 +77,16 @@ int bfree_segs(struct sb *sb, struct block_segment *seg, int segs)
 	return 0;
 }
 
+void bfree_unpin(struct buffer_head **pin)
+{
+}
+
+int bfree_pinned(struct sb *sb, struct buffer_head **pin, block_t start,
+		 unsigned blocks)
+{
+	return bfree(sb, start, blocks);
+}
+
 int replay_update_bitmap(struct replay *rp, block_t start, unsigned count,
 			 int set)
 {
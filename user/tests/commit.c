@@ -39,6 +39,8 @@ static int buffer_is_allocated(struct sb *sb, struct buffer_head *buf)
 		return 0; /* buffer is defree block */
 	if (stash_walk(sb, &sb->deunify, check_defree_block) < 0)
 		return 0; /* buffer is deunify block */
+	if (stash_walk(sb, &sb->decommit, check_defree_block) < 0)
+		return 0; /* buffer is waiting commit block */
 	/* Set fake backend mark to modify backend objects. */
 	tux3_start_backend(sb);
 	struct block_segment seg;
@@ -756,6 +758,518 @@ static void test07(struct sb *sb)
 	clean_main(sb);
 }
 
+/* Test delta and unify scheduling by thresholds */
+static void test08(struct sb *sb)
+{
+	struct tux3_sched *sched = &sb->sched;
+	struct tux3_sched save = *sched;
+	struct tux_iattr iattr = { .mode = S_IFREG | 0644 };
+	struct inode *inode;
+	unsigned delta, logcount;
+	int i;
+
+	test_assert(make_tux3(sb) == 0);
+	test_assert(force_unify(sb) == 0);
+
+	/*
+	 * All triggers are disabled, create doesn't start new delta.
+	 * (Check delta transition, not commit, to not depend on whether
+	 * change_end() commits inline or leaves it to the flusher)
+	 */
+	sched->delta_blocks = sched->delta_inodes = sched->delta_msecs = 0;
+	sched->unify_logblocks = sched->unify_replay_msecs = 0;
+	delta = sb->next_delta;
+	inode = tuxcreate(sb->rootdir, "file1", 5, &iattr);
+	test_assert(!IS_ERR(inode));
+	iput(inode);
+	test_assert(sb->next_delta == delta);
+
+	/* Dirty inode count triggers delta transition */
+	sched->delta_inodes = 1;
+	inode = tuxcreate(sb->rootdir, "file2", 5, &iattr);
+	test_assert(!IS_ERR(inode));
+	iput(inode);
+	test_assert(sb->next_delta != delta);
+	sched->delta_inodes = 0;
+	test_assert(force_delta(sb) == 0);
+
+	/* Log blocks are accumulated without unify */
+	for (i = 0; i < 8; i++)
+		test_assert(force_delta(sb) == 0);
+	logcount = be32_to_cpu(sb->super.logcount);
+	test_assert(logcount >= 8);
+
+	/*
+	 * Log block count triggers unify, and logcount is reset.
+	 * (force_delta() doesn't unify, transition by change_end() instead.
+	 * Then force_delta() makes sure the unify delta was committed)
+	 */
+	sched->delta_inodes = 1;
+	sched->unify_logblocks = logcount;
+	inode = tuxcreate(sb->rootdir, "file3", 5, &iattr);
+	test_assert(!IS_ERR(inode));
+	iput(inode);
+	sched->delta_inodes = 0;
+	test_assert(force_delta(sb) == 0);
+	test_assert(be32_to_cpu(sb->super.logcount) < logcount);
+	sched->unify_logblocks = 0;
+
+	/* Estimated replay time triggers unify */
+	for (i = 0; i < 8; i++)
+		test_assert(force_delta(sb) == 0);
+	logcount = be32_to_cpu(sb->super.logcount);
+	sched->unify_replay_msecs = 1;
+	sched->replay_usecs = 1000 / logcount + 1;
+	sched->delta_inodes = 1;
+	inode = tuxcreate(sb->rootdir, "file4", 5, &iattr);
+	test_assert(!IS_ERR(inode));
+	iput(inode);
+	sched->delta_inodes = 0;
+	test_assert(force_delta(sb) == 0);
+	test_assert(be32_to_cpu(sb->super.logcount) < logcount);
+
+	/* Commit latency was measured */
+	test_assert(sched->commit_usecs > 0);
+
+	*sched = save;
+	test_assert(force_delta(sb) == 0);
+	clean_main(sb);
+}
+
+static double elapsed(struct timeval *start)
+{
+	struct timeval end, diff;
+	gettimeofday(&end, NULL);
+	timersub(&end, start, &diff);
+	return diff.tv_sec + diff.tv_usec / 1000000.0;
+}
+
+/* Test fsync skips commit if nothing changed, and fsync rate */
+static void test09(struct sb *sb)
+{
+	enum { loops = 100 };
+	struct tux_iattr iattr = { .mode = S_IFREG | 0644 };
+	struct timeval start;
+	double dirty_secs, clean_secs;
+	unsigned committed;
+	char name[16];
+	int i;
+
+	test_assert(make_tux3(sb) == 0);
+	test_assert(force_unify(sb) == 0);
+
+	/* fsync after change commits */
+	gettimeofday(&start, NULL);
+	for (i = 0; i < loops; i++) {
+		struct inode *inode;
+		int len = snprintf(name, sizeof(name), "file%d", i);
+
+		committed = sb->committed_delta;
+		inode = tuxcreate(sb->rootdir, name, len, &iattr);
+		test_assert(!IS_ERR(inode));
+		iput(inode);
+		test_assert(fsync_delta(sb) == 0);
+		test_assert(sb->committed_delta != committed);
+	}
+	dirty_secs = elapsed(&start);
+
+	/* fsync without change doesn't commit */
+	committed = sb->committed_delta;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < loops; i++)
+		test_assert(fsync_delta(sb) == 0);
+	clean_secs = elapsed(&start);
+	test_assert(sb->committed_delta == committed);
+
+	printf("fsync after create: %.0f/sec, fsync without change: %.0f/sec\n",
+	       loops / dirty_secs, loops / clean_secs);
+
+	clean_main(sb);
+}
+
+/* Background commit doesn't wait the commit block, and defers bfree */
+static void test10(struct sb *sb)
+{
+	struct tux3_sched *sched = &sb->sched;
+	struct tux3_sched save = *sched;
+	struct tux_iattr iattr = { .mode = S_IFREG | 0644 };
+	struct inode *inode;
+	block_t freeblocks;
+	char data[1024] = {};
+	int i;
+
+	test_assert(make_tux3(sb) == 0);
+	test_assert(force_unify(sb) == 0);
+	sched->delta_blocks = sched->delta_inodes = sched->delta_msecs = 0;
+	sched->unify_logblocks = sched->unify_replay_msecs = 0;
+
+	inode = tuxcreate(sb->rootdir, "file1", 5, &iattr);
+	test_assert(!IS_ERR(inode));
+	struct file *file = &(struct file){ .f_inode = inode };
+	for (i = 0; i < 64; i++)
+		test_assert(tuxwrite(file, data, sizeof(data)) == sizeof(data));
+	iput(inode);
+
+	/* Data integrity commit waits the commit block */
+	test_assert(force_delta(sb) == 0);
+	test_assert(!sb->commit_inflight);
+	freeblocks = sb->freeblocks;
+
+	/* Unlink by background commit */
+	sched->delta_inodes = 1;
+	test_assert(tuxunlink(sb->rootdir, "file1", 5) == 0);
+	sched->delta_inodes = 0;
+#if TUX3_FLUSHER == TUX3_FLUSHER_SYNC
+	/* Commit block is in flight, freed blocks are not applied yet */
+	test_assert(sb->commit_inflight);
+	test_assert(sb->freeblocks <= freeblocks);
+#endif
+
+	/* Next commit waits the previous commit block, then applies bfree */
+	test_assert(force_delta(sb) == 0);
+	test_assert(!sb->commit_inflight);
+	test_assert(sb->freeblocks > freeblocks);
+
+	*sched = save;
+	clean_main(sb);
+}
+
+/* Log chain links contiguous logblocks, and replay reads those at once */
+static void test11(struct sb *sb)
+{
+	struct replay *rp;
+	unsigned i, logcount;
+
+	test_assert(make_tux3(sb) == 0);
+	test_assert(force_unify(sb) == 0);
+
+	/* Make many logblocks in one delta */
+	tux3_start_backend(sb);
+	while (sb->lognext < 20)
+		log_delta(sb);
+	tux3_end_backend();
+	test_assert(force_delta(sb) == 0);
+
+	logcount = be32_to_cpu(sb->super.logcount);
+	test_assert(logcount >= 20);
+	test_assert(logchain_count(sb->super.logchain) > 1);
+	clean_sb(sb);
+
+	/* Each logblock must be loaded from the address in the chain */
+	rp = check_replay(sb);
+	test_assert(rp->blocknrs[logcount - 1] ==
+		    logchain_block(sb->super.logchain));
+	for (i = logcount - 1; i > 0; i--) {
+		struct buffer_head *buffer;
+		struct logblock *log;
+
+		buffer = peekblk(mapping(sb->logmap), i);
+		test_assert(buffer);
+		log = bufdata(buffer);
+		test_assert(log->magic == cpu_to_be16(TUX3_MAGIC_LOG));
+		test_assert(logchain_block(log->logchain) == rp->blocknrs[i - 1]);
+		blockput(buffer);
+	}
+	test_assert(replay_stage3(rp, 0) == 0);
+
+	clean_main(sb);
+}
+
+static int block_is_free(struct sb *sb, block_t block)
+{
+	struct block_segment seg;
+	unsigned blocks = 1;
+	int segs = 0;
+
+	tux3_start_backend(sb);
+	test_assert(!balloc_find_range(sb, &seg, 1, &segs, block, 1, &blocks));
+	tux3_end_backend();
+
+	return blocks == 0;	/* if blocks == 0, that block is free */
+}
+
+/* Bitmap updates are applied per bitmap block, but in log order per bit */
+static void test12(struct sb *sb)
+{
+	unsigned mapsize = 1 << (sb->blockbits + 3);
+	block_t x = sb->volblocks - 16, y = mapsize * 20 - 2;
+	struct replay *rp;
+
+	test_assert(make_tux3(sb) == 0);
+	test_assert(force_unify(sb) == 0);
+	test_assert(block_is_free(sb, x) && block_is_free(sb, x + 1));
+	test_assert(block_is_free(sb, y) && block_is_free(sb, y + 3));
+
+	/* Interleave bitmap blocks, and update x several times */
+	tux3_start_backend(sb);
+	log_balloc(sb, x, 1);
+	log_balloc(sb, y, 4);	/* over bitmap block boundary */
+	log_bfree(sb, x, 1);
+	log_balloc(sb, x, 2);
+	tux3_end_backend();
+	test_assert(force_delta(sb) == 0);
+	clean_sb(sb);
+
+	rp = check_replay(sb);
+	test_assert(!block_is_free(sb, x) && !block_is_free(sb, x + 1));
+	test_assert(!block_is_free(sb, y) && !block_is_free(sb, y + 3));
+	test_assert(replay_stage3(rp, 0) == 0);
+
+	clean_main(sb);
+}
+
+static unsigned nr_stashed;
+
+static int count_stashed(struct sb *sb, u64 val)
+{
+	nr_stashed++;
+	return 0;
+}
+
+static unsigned stash_count(struct sb *sb, struct stash *stash)
+{
+	nr_stashed = 0;
+	stash_walk(sb, stash, count_stashed);
+	return nr_stashed;
+}
+
+/* Deferred frees are coalesced, sorted, and applied */
+static void test13(struct sb *sb)
+{
+	enum { nr = 200 };
+	unsigned mapsize = 1 << (sb->blockbits + 3);
+	block_t x = mapsize * 10 - nr / 2, freeblocks;
+	struct block_segment seg = { .block = x, .count = nr + 10, };
+	struct stash defree;
+	unsigned i;
+
+	test_assert(make_tux3(sb) == 0);
+	test_assert(force_unify(sb) == 0);
+	for (i = 0; i < nr + 10; i++)
+		test_assert(block_is_free(sb, x + i));
+
+	tux3_start_backend(sb);
+	freeblocks = sb->freeblocks;
+	test_assert(balloc_use(sb, &seg, 1) == 0);
+	stash_init(&defree);
+
+	/* Adjacent frees in a row are merged on insert */
+	for (i = nr; i < nr + 10; i++)
+		test_assert(defer_bfree(sb, &defree, x + i, 1) == 0);
+	test_assert(stash_count(sb, &defree) == 1);
+
+	/* Shuffled frees over bitmap block boundary */
+	for (i = 0; i < nr; i++)
+		test_assert(defer_bfree(sb, &defree, x + (i * 37) % nr, 1) == 0);
+	test_assert(stash_count(sb, &defree) == nr + 1);
+
+	test_assert(sort_defer_bfree(&defree) == 0);
+	test_assert(stash_count(sb, &defree) == 1);
+
+	/* Can still stash after sort */
+	test_assert(defer_bfree(sb, &defree, x + nr + 20, 1) == 0);
+	test_assert(stash_count(sb, &defree) == 2);
+	destroy_defer_bfree(&defree);
+
+	test_assert(defer_bfree(sb, &defree, x + nr, 10) == 0);
+	for (i = 0; i < nr; i++)
+		test_assert(defer_bfree(sb, &defree, x + (i * 37) % nr, 1) == 0);
+	test_assert(apply_defer_bfree(sb, &defree) == 0);
+	test_assert(stash_count(sb, &defree) == 0);
+	test_assert(sb->freeblocks == freeblocks);
+	destroy_defer_bfree(&defree);
+	tux3_end_backend();
+
+	for (i = 0; i < nr + 10; i++)
+		test_assert(block_is_free(sb, x + i));
+
+	clean_main(sb);
+}
+
+/* Commit flight recorder keeps last commits with phase times and counters */
+static void test14(struct sb *sb)
+{
+	static struct tux_iattr iattr = { .mode = S_IFREG | S_IRWXU };
+	static char data[1024] = {};
+	struct tux3_commitstat *stat;
+	struct commit_record *rec;
+	struct inode *inode;
+	struct file *file;
+	unsigned i;
+
+	stat = malloc(sizeof(*stat));
+	test_assert(stat);
+
+	test_assert(make_tux3(sb) == 0);
+	test_assert(force_unify(sb) == 0);
+
+	inode = tuxcreate(sb->rootdir, "foo", 3, &iattr);
+	test_assert(!IS_ERR(inode));
+	file = &(struct file){ .f_inode = inode };
+	test_assert(tuxwrite(file, data, sizeof(data)) == sizeof(data));
+	iput(inode);
+	test_assert(force_delta(sb) == 0);
+
+	tux3_commitstat(sb, stat);
+	test_assert(stat->nr_records >= 2);
+	test_assert(stat->nr_records == stat->nr_commits);
+	rec = &stat->records[stat->nr_records - 2];
+	test_assert(rec->flags & COMMIT_RECORD_UNIFY);
+	rec = &stat->records[stat->nr_records - 1];
+	test_assert(!rec->err);
+	test_assert(!(rec->flags & COMMIT_RECORD_UNIFY));
+	test_assert(rec->counters.inodes >= 2);	/* foo and rootdir */
+	test_assert(rec->counters.buffers >= sizeof(data) >> sb->blockbits);
+	test_assert(rec->counters.logblocks > 0);
+	test_assert(rec->counters.bitmap_dirty == 0);
+
+	/* Ring keeps last records in commit order */
+	for (i = 0; i < TUX3_COMMIT_RECORDS + 10; i++)
+		test_assert(force_delta(sb) == 0);
+	tux3_commitstat(sb, stat);
+	test_assert(stat->nr_records == TUX3_COMMIT_RECORDS);
+	for (i = 1; i < stat->nr_records; i++) {
+		test_assert(stat->records[i].delta ==
+			    stat->records[i - 1].delta + 1);
+	}
+	test_assert(stat->records[i - 1].delta == sb->committed_delta);
+
+	free(stat);
+	clean_main(sb);
+}
+
+/*
+ * Save more than SAVE_INODE_BATCH dirty inodes in one delta. Those
+ * are saved over many ileaves, with leaf splits and itree depth
+ * growth. Then check all inodes after replay.
+ */
+static void test15(struct sb *sb)
+{
+	enum { nr = 300 };
+	static struct open_result results[nr];
+	struct tux_iattr iattr = { .mode = S_IFREG | S_IRWXU };
+	struct btree *itree = itree_btree(sb);
+	unsigned depth;
+	char data[32];
+	int i;
+
+	test_assert(make_tux3(sb) == 0);
+	test_assert(force_unify(sb) == 0);
+	depth = itree->root.depth;
+
+	for (i = 0; i < nr; i++) {
+		struct open_result *r = &results[i];
+		struct inode *inode;
+		struct file *file;
+
+		r->namelen = snprintf(r->name, sizeof(r->name), "f%03d", i);
+		inode = tuxcreate(sb->rootdir, r->name, r->namelen, &iattr);
+		test_assert(!IS_ERR(inode));
+		r->err = 0;
+		r->inum = tux_inode(inode)->inum;
+
+		/* Give different size and data to each inode */
+		memset(data, i, sizeof(data));
+		file = &(struct file){ .f_inode = inode };
+		test_assert(tuxwrite(file, data, i % 16 + 1) == i % 16 + 1);
+		iput(inode);
+	}
+	test_assert(force_delta(sb) == 0);
+	test_assert(itree->root.depth > depth);
+	clean_sb(sb);
+
+	fsck(sb);
+
+	check_files(sb, results, nr);
+	for (i = 0; i < nr; i++) {
+		struct open_result *r = &results[i];
+		struct inode *inode;
+		struct file *file;
+		char buf[sizeof(data)];
+
+		inode = tuxopen(sb->rootdir, r->name, r->namelen);
+		test_assert(!IS_ERR(inode));
+		test_assert(inode->i_size == i % 16 + 1);
+
+		memset(data, i, sizeof(data));
+		file = &(struct file){ .f_inode = inode };
+		test_assert(tuxread(file, buf, sizeof(buf)) == i % 16 + 1);
+		test_assert(!memcmp(buf, data, i % 16 + 1));
+		iput(inode);
+	}
+
+	clean_main(sb);
+}
+
+#if TUX3_FLUSHER == TUX3_FLUSHER_ASYNC_OWN
+enum { test16_threads = 8, test16_loops = 50 };
+
+struct test16_data {
+	struct sb *sb;
+	int id;
+};
+
+static void *test16_thread(void *arg)
+{
+	struct test16_data *data = arg;
+	struct sb *sb = data->sb;
+	struct tux_iattr iattr = { .mode = S_IFREG | 0644 };
+	char name[32];
+	int i;
+
+	for (i = 0; i < test16_loops; i++) {
+		struct inode *inode;
+		int len = snprintf(name, sizeof(name), "t%d-%d", data->id, i);
+
+		tux3_frontend_lock(sb);
+		inode = tuxcreate(sb->rootdir, name, len, &iattr);
+		test_assert(!IS_ERR(inode));
+		iput(inode);
+		test_assert(fsync_delta(sb) == 0);
+		tux3_frontend_unlock(sb);
+	}
+	return NULL;
+}
+
+/* Concurrent fsync callers are grouped into fewer commits */
+static void test16(struct sb *sb)
+{
+	enum { fsyncs = test16_threads * test16_loops };
+	struct test16_data data[test16_threads];
+	pthread_t threads[test16_threads];
+	struct timeval start;
+	unsigned committed, commits;
+	double secs;
+	int i;
+
+	test_assert(make_tux3(sb) == 0);
+	test_assert(force_unify(sb) == 0);
+	/* Frontend owns sb->frontend_lock after this */
+	test_assert(tux3_init_flusher(sb) == 0);
+
+	committed = sb->committed_delta;
+	gettimeofday(&start, NULL);
+	tux3_frontend_unlock(sb);
+	for (i = 0; i < test16_threads; i++) {
+		data[i] = (struct test16_data){ .sb = sb, .id = i, };
+		test_assert(!pthread_create(&threads[i], NULL, test16_thread,
+					    &data[i]));
+	}
+	for (i = 0; i < test16_threads; i++)
+		test_assert(!pthread_join(threads[i], NULL));
+	tux3_frontend_lock(sb);
+	secs = elapsed(&start);
+	commits = sb->committed_delta - committed;
+
+	test_assert(commits <= fsyncs);
+	printf("%d threads: %.2f commits per fsync, %.0f fsyncs/sec\n",
+	       test16_threads, (double)commits / fsyncs, fsyncs / secs);
+
+	tux3_exit_flusher(sb);
+	clean_main(sb);
+}
+#endif
+
 int main(int argc, char *argv[])
 {
 	if (argc < 2)
@@ -812,6 +1326,44 @@ int main(int argc, char *argv[])
 		test07(sb);
 	test_end();
 
+	if (test_start("test08"))
+		test08(sb);
+	test_end();
+
+	if (test_start("test09"))
+		test09(sb);
+	test_end();
+
+	if (test_start("test10"))
+		test10(sb);
+	test_end();
+
+	if (test_start("test11"))
+		test11(sb);
+	test_end();
+
+	if (test_start("test12"))
+		test12(sb);
+	test_end();
+
+	if (test_start("test13"))
+		test13(sb);
+	test_end();
+
+	if (test_start("test14"))
+		test14(sb);
+	test_end();
+
+	if (test_start("test15"))
+		test15(sb);
+	test_end();
+
+#if TUX3_FLUSHER == TUX3_FLUSHER_ASYNC_OWN
+	if (test_start("test16"))
+		test16(sb);
+	test_end();
+#endif
+
 	clean_main(sb);
 	return test_failures();
 }
@@ -9,6 +9,7 @@
 
 static void clean_main(struct sb *sb, struct inode *dir)
 {
+	tux3_dir_index_free(dir);
 	invalidate_buffers(dir->map);
 	free_map(dir->map);
 	put_super(sb);
@@ -118,6 +119,238 @@ static void test02(struct sb *sb, struct inode *dir)
 	clean_main(sb, dir);
 }
 
+static struct qstr test03_name(char *buf, int i)
+{
+	sprintf(buf, "file%i", i);
+	return (struct qstr){ .name = (unsigned char *)buf, .len = strlen(buf), };
+}
+
+/* Test lookup with hashed index */
+static void test03(struct sb *sb, struct inode *dir)
+{
+	struct inode *inode = rapid_open_inode(sb, NULL, S_IFREG);
+	struct buffer_head *buffer;
+	tux_dirent *entry;
+	char name[100];
+	int i, err;
+
+	change_begin_atomic(sb);
+
+	for (i = 0; i < 200; i++) {
+		struct qstr qstr = test03_name(name, i);
+
+		tux_inode(inode)->inum = i + 100;
+		err = tux_create_dirent(dir, &qstr, inode);
+		test_assert(!err);
+	}
+	test_assert((dir->i_size >> sb->blockbits) >= DIR_INDEX_MIN_BLOCKS);
+
+	/* Lookup builds index */
+	for (i = 0; i < 200; i++) {
+		struct qstr qstr = test03_name(name, i);
+
+		entry = tux_find_dirent(dir, &qstr, &buffer);
+		test_assert(!IS_ERR(entry));
+		test_assert(be64_to_cpu(entry->inum) == i + 100);
+		test_assert(tux_inode(dir)->dir_index);
+
+		/* Delete odd entries, index should be updated */
+		if (i & 1) {
+			err = tux_delete_dirent(dir, buffer, entry);
+			test_assert(!err);
+		} else
+			blockput(buffer);
+	}
+
+	/* Reuse deleted space, found by space map */
+	loff_t size = dir->i_size;
+	for (i = 200; i < 250; i++) {
+		struct qstr qstr = test03_name(name, i);
+
+		tux_inode(inode)->inum = i + 100;
+		err = tux_create_dirent(dir, &qstr, inode);
+		test_assert(!err);
+	}
+	test_assert(dir->i_size == size);
+
+	for (i = 0; i < 250; i++) {
+		struct qstr qstr = test03_name(name, i);
+
+		entry = tux_find_dirent(dir, &qstr, &buffer);
+		if (i < 200 && (i & 1))
+			test_assert(PTR_ERR(entry) == -ENOENT);
+		else {
+			test_assert(!IS_ERR(entry));
+			test_assert(be64_to_cpu(entry->inum) == i + 100);
+			blockput(buffer);
+		}
+	}
+
+	change_end_atomic(sb);
+
+	free_map(inode->map);
+	clean_main(sb, dir);
+}
+
+/* Test emptiness check by the count of live entries */
+static void test04(struct sb *sb, struct inode *dir)
+{
+	struct inode *inode = rapid_open_inode(sb, NULL, S_IFREG);
+	struct buffer_head *buffer;
+	tux_dirent *entry;
+	char name[100];
+	int i, err;
+
+	change_begin_atomic(sb);
+
+	for (i = 0; i < 20; i++) {
+		struct qstr qstr = test03_name(name, i);
+
+		tux_inode(inode)->inum = i + 100;
+		err = tux_create_dirent(dir, &qstr, inode);
+		test_assert(!err);
+	}
+
+	/* First check counts entries */
+	test_assert(tux_inode(dir)->dir_entries == -1);
+	test_assert(tux_dir_is_empty(dir) == -ENOTEMPTY);
+	test_assert(tux_inode(dir)->dir_entries == 20);
+
+	/* Then, the count is updated by create and delete */
+	for (i = 0; i < 20; i++) {
+		struct qstr qstr = test03_name(name, i);
+
+		entry = tux_find_dirent(dir, &qstr, &buffer);
+		test_assert(!IS_ERR(entry));
+		err = tux_delete_dirent(dir, buffer, entry);
+		test_assert(!err);
+		test_assert(tux_inode(dir)->dir_entries == 19 - i);
+	}
+	test_assert(tux_dir_is_empty(dir) == 0);
+
+	struct qstr qstr = test03_name(name, 0);
+	err = tux_create_dirent(dir, &qstr, inode);
+	test_assert(!err);
+	test_assert(tux_dir_is_empty(dir) == -ENOTEMPTY);
+
+	/* Rescan agrees with the count */
+	test_assert(tux_dir_count_scan(dir) == 1);
+
+	/* "." of dir itself is not counted */
+	struct qstr dot = { .name = (unsigned char *)".", .len = 1, };
+	tux_inode(dir)->inum = 99;
+	err = tux_create_dirent(dir, &dot, dir);
+	test_assert(!err);
+	test_assert(tux_inode(dir)->dir_entries == 1);
+	test_assert(tux_dir_count_scan(dir) == 1);
+
+	/* "." which doesn't point to dir is counted */
+	err = tux_create_dirent(dir, &dot, inode);
+	test_assert(!err);
+	test_assert(tux_inode(dir)->dir_entries == 2);
+	test_assert(tux_dir_count_scan(dir) == 2);
+
+	entry = tux_find_dirent(dir, &dot, &buffer);
+	test_assert(!IS_ERR(entry));
+	err = tux_delete_dirent(dir, buffer, entry);
+	test_assert(!err);
+	test_assert(tux_inode(dir)->dir_entries ==
+		    tux_dir_count_scan(dir));
+
+	change_end_atomic(sb);
+
+	free_map(inode->map);
+	clean_main(sb, dir);
+}
+
+static int test05_filldir(void *data, const char *name, int namelen,
+			  loff_t offset, u64 inum, unsigned type)
+{
+	int *count = data;
+
+	test_assert(inum >= 100 + 190);
+	(*count)++;
+
+	return 0;
+}
+
+/* Test readdir skips empty blocks by index */
+static void test05(struct sb *sb, struct inode *dir)
+{
+	struct file *file = &(struct file){ .f_inode = dir };
+	struct inode *inode = rapid_open_inode(sb, NULL, S_IFREG);
+	struct buffer_head *buffer;
+	struct dir_index *index;
+	tux_dirent *entry;
+	char name[100];
+	int i, err, count;
+
+	change_begin_atomic(sb);
+
+	for (i = 0; i < 200; i++) {
+		struct qstr qstr = test03_name(name, i);
+
+		tux_inode(inode)->inum = i + 100;
+		err = tux_create_dirent(dir, &qstr, inode);
+		test_assert(!err);
+	}
+
+	/* Delete all except last 10 entries, it makes empty blocks */
+	for (i = 0; i < 190; i++) {
+		struct qstr qstr = test03_name(name, i);
+
+		entry = tux_find_dirent(dir, &qstr, &buffer);
+		test_assert(!IS_ERR(entry));
+		err = tux_delete_dirent(dir, buffer, entry);
+		test_assert(!err);
+	}
+
+	index = tux_inode(dir)->dir_index;
+	test_assert(index);
+	block_t live = dir_space_next_live(index, 0);
+	test_assert(live > 0);
+
+	count = 0;
+	err = tux_readdir(file, &count, test05_filldir);
+	test_assert(!err);
+	test_assert(count == 10);
+	test_assert(file->f_pos == dir->i_size);
+
+	/* Readdir from the middle of empty blocks */
+	count = 0;
+	file->f_pos = sb->blocksize;
+	err = tux_readdir(file, &count, test05_filldir);
+	test_assert(!err);
+	test_assert(count == 10);
+
+	/* Reused block is visible again */
+	struct qstr qstr = test03_name(name, 1000);
+	tux_inode(inode)->inum = 1000;
+	err = tux_create_dirent(dir, &qstr, inode);
+	test_assert(!err);
+	test_assert(dir_space_next_live(index, 0) < live);
+
+	count = 0;
+	file->f_pos = 0;
+	err = tux_readdir(file, &count, test05_filldir);
+	test_assert(!err);
+	test_assert(count == 11);
+
+	/* Readdir doesn't build index */
+	tux3_dir_index_free(dir);
+	count = 0;
+	file->f_pos = 0;
+	err = tux_readdir(file, &count, test05_filldir);
+	test_assert(!err);
+	test_assert(count == 11);
+	test_assert(!tux_inode(dir)->dir_index);
+
+	change_end_atomic(sb);
+
+	free_map(inode->map);
+	clean_main(sb, dir);
+}
+
 int main(int argc, char *argv[])
 {
 	struct dev *dev = &(struct dev){ .bits = 8 };
@@ -143,6 +376,18 @@ int main(int argc, char *argv[])
 		test02(sb, dir);
 	test_end();
 
+	if (test_start("test03"))
+		test03(sb, dir);
+	test_end();
+
+	if (test_start("test04"))
+		test04(sb, dir);
+	test_end();
+
+	if (test_start("test05"))
+		test05(sb, dir);
+	test_end();
+
 	clean_main(sb, dir);
 	return test_failures();
 }
@@ -373,6 +373,124 @@ static void test05(struct sb *sb, struct inode *inode)
 	clean_main(sb, inode);
 }
 
+/* Test map_region() with hole extents */
+static void test06(struct sb *sb, struct inode *inode)
+{
+	struct block_segment seg[32];
+	int segs;
+
+	/* Set fake backend mark to modify backend objects. */
+	tux3_start_backend(sb);
+	segs = d_map_region(inode, 0, 8, seg, ARRAY_SIZE(seg), MAP_WRITE);
+	test_assert(segs > 0);
+	tux3_end_backend();
+
+	/* Add truncate holes, second one is merged to first one */
+	change_begin_atomic(sb);
+	test_assert(!tux3_add_truncate_hole(inode, 6 << sb->blockbits));
+	test_assert(!tux3_add_truncate_hole(inode, 4 << sb->blockbits));
+	tux3_mark_inode_dirty(inode);
+	change_end_atomic(sb);
+
+	test_assert(tux3_is_hole(inode, 4, 4));
+	test_assert(tux3_is_hole(inode, 6, 100));
+	test_assert(!tux3_is_hole(inode, 3, 2));
+	test_assert(!tux3_is_hole(inode, 0, 1));
+
+	/* Blocks after hole start are mapped as hole */
+	segs = map_region(inode, 0, 8, seg, ARRAY_SIZE(seg), MAP_READ);
+	test_assert(segs >= 2);
+	test_assert(seg[segs - 1].state == BLOCK_SEG_HOLE);
+	test_assert(seg[segs - 1].count == 4);
+
+	/* Whole region is hole */
+	segs = map_region(inode, 5, 2, seg, ARRAY_SIZE(seg), MAP_READ);
+	test_assert(segs == 1);
+	test_assert(seg[0].state == BLOCK_SEG_HOLE);
+	test_assert(seg[0].count == 2);
+
+	/* Clear dirty page to prevent to call map_region again */
+	change_begin_atomic(sb);
+	truncate_inode_pages(mapping(inode), 0);
+	change_end_atomic(sb);
+
+	/* Holes were applied to dtree */
+	test_assert(force_delta(sb) == 0);
+	test_assert(!tux_inode(inode)->hole_index);
+	test_assert(!tux3_is_hole(inode, 4, 4));
+
+	clean_main(sb, inode);
+}
+
+/* Physical block of index in seg[], or 0 if hole */
+static block_t seg_block(struct block_segment *seg, int segs, block_t index)
+{
+	for (int i = 0; i < segs; i++) {
+		if (index < seg[i].count) {
+			if (seg[i].state == BLOCK_SEG_HOLE)
+				return 0;
+			return seg[i].block + index;
+		}
+		index -= seg[i].count;
+	}
+	assert(0);
+	return 0;
+}
+
+/* Test map_region() with holes in middle of mapped extent */
+static void test07(struct sb *sb, struct inode *inode)
+{
+	struct block_segment orig[32], seg[32];
+	int orig_segs, segs;
+
+	/* Set fake backend mark to modify backend objects. */
+	tux3_start_backend(sb);
+	orig_segs = d_map_region(inode, 0, 8, orig, ARRAY_SIZE(orig),
+				 MAP_WRITE);
+	test_assert(orig_segs > 0);
+	tux3_end_backend();
+
+	/* Holes [2, 5) and [6, 7) */
+	change_begin_atomic(sb);
+	test_assert(!tux3_add_hole(inode, 2, 3));
+	test_assert(!tux3_add_hole(inode, 6, 1));
+	change_end_atomic(sb);
+
+	/* Blocks outside of holes keep the mapping */
+	segs = map_region(inode, 0, 8, seg, ARRAY_SIZE(seg), MAP_READ);
+	test_assert(segs >= 5);
+	for (block_t i = 0; i < 8; i++) {
+		block_t block = seg_block(seg, segs, i);
+
+		if ((2 <= i && i < 5) || i == 6)
+			test_assert(block == 0);
+		else
+			test_assert(block == seg_block(orig, orig_segs, i));
+	}
+
+	/* No space for all segments, mapped region is shortened */
+	segs = map_region(inode, 0, 8, seg, 2, MAP_READ);
+	test_assert(segs == 2);
+	test_assert(seg[0].state != BLOCK_SEG_HOLE);
+	test_assert(seg[0].count == 2);
+	test_assert(seg[1].state == BLOCK_SEG_HOLE);
+	test_assert(seg[1].count == 3);
+
+	/* Backend can't apply those holes yet, so clear */
+	change_begin_atomic(sb);
+	test_assert(tux3_clear_hole(inode, tux3_get_current_delta()));
+	change_end_atomic(sb);
+	test_assert(!tux_inode(inode)->hole_index);
+
+	/* Clear dirty page to prevent to call map_region again */
+	change_begin_atomic(sb);
+	truncate_inode_pages(mapping(inode), 0);
+	change_end_atomic(sb);
+
+	test_assert(force_delta(sb) == 0);
+	clean_main(sb, inode);
+}
+
 int main(int argc, char *argv[])
 {
 	if (argc < 2)
@@ -427,6 +545,14 @@ int main(int argc, char *argv[])
 		test05(sb, inode);
 	test_end();
 
+	if (test_start("test06"))
+		test06(sb, inode);
+	test_end();
+
+	if (test_start("test07"))
+		test07(sb, inode);
+	test_end();
+
 	clean_main(sb, inode);
 	return test_failures();
 }
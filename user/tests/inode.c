@@ -186,6 +186,246 @@ static void test03(struct sb *sb)
 	clean_main(sb);
 }
 
+/* Test inum allocation across inum map region, and reuse of freed inum */
+static void test04(struct sb *sb)
+{
+	struct tux_iattr *iattr = &(struct tux_iattr){ .mode = S_IFREG };
+	struct inode *inode1, *inode2, *inode3;
+	int err;
+
+	change_begin_atomic(sb);
+
+	/* Last inum of first region, then next goes to next region */
+	inode1 = tux_create_specific_inode(sb->rootdir, 0x7fff, iattr, 0);
+	test_assert(!IS_ERR(inode1));
+	unlock_new_inode(inode1);
+	inode2 = tux_create_specific_inode(sb->rootdir, 0x7fff, iattr, 0);
+	test_assert(!IS_ERR(inode2));
+	unlock_new_inode(inode2);
+
+	change_end_atomic(sb);
+
+	test_assert(tux_inode(inode1)->inum == 0x7fff);
+	test_assert(tux_inode(inode2)->inum == 0x8000);
+
+	err = tux3_flush_inode_hack(inode1);
+	test_assert(!err);
+	err = tux3_flush_inode_hack(inode2);
+	test_assert(!err);
+	iput(inode2);
+
+	/* Delete inode1, then its inum can be allocated again */
+	inode1->i_nlink--;
+	iput(inode1);
+	force_delta(sb);
+
+	change_begin_atomic(sb);
+	inode3 = tux_create_specific_inode(sb->rootdir, 0x7fff, iattr, 0);
+	test_assert(!IS_ERR(inode3));
+	unlock_new_inode(inode3);
+	change_end_atomic(sb);
+
+	test_assert(tux_inode(inode3)->inum == 0x7fff);
+	iput(inode3);
+
+	force_delta(sb);
+	clean_main(sb);
+}
+
+/* Test evicted clean inode is reinstantiated from attribute cache */
+static void test05(struct sb *sb)
+{
+	struct tux_iattr iattr = { .mode = S_IFREG | S_IRWXU };
+	char name[] = "foo", buf[] = "hello world!", data[100];
+	unsigned long hits;
+	struct inode *inode;
+	struct file *file;
+	inum_t inum;
+	int err, got, size = strlen(buf);
+
+	inode = tuxcreate(sb->rootdir, name, strlen(name), &iattr);
+	test_assert(!IS_ERR(inode));
+	inum = tux_inode(inode)->inum;
+
+	file = &(struct file){ .f_inode = inode };
+	got = tuxwrite(file, buf, size);
+	test_assert(got == size);
+	err = set_xattr(inode, name, strlen(name), buf, size, 0);
+	test_assert(!err);
+
+	/* Make inode clean, then evict */
+	force_delta(sb);
+	iput(inode);
+	test_assert(iattr_cache_lookup(sb, inum));
+
+	hits = iattr_cache_hits;
+	inode = tux3_iget(sb, inum);
+	test_assert(!IS_ERR(inode));
+	test_assert(iattr_cache_hits == hits + 1);
+	test_assert(!iattr_cache_lookup(sb, inum));
+	test_assert(inode->i_mode == iattr.mode);
+	test_assert(inode->i_size == size);
+	test_assert(inode->i_nlink == 1);
+
+	/* Check data and xattr */
+	file = &(struct file){ .f_inode = inode };
+	memset(data, 0, sizeof(data));
+	got = tuxread(file, data, sizeof(data));
+	test_assert(got == size);
+	test_assert(!memcmp(data, buf, size));
+	got = get_xattr(inode, name, strlen(name), data, sizeof(data));
+	test_assert(got == size);
+	test_assert(!memcmp(data, buf, size));
+	iput(inode);
+
+	force_delta(sb);
+	clean_main(sb);
+}
+
+/* Test small file is saved as inline data, and moved to dtree on grow */
+static void test06(struct sb *sb)
+{
+	struct tux_iattr iattr = { .mode = S_IFREG | S_IRWXU };
+	char name[] = "foo", buf[] = "hello world!", data[100];
+	struct inode *inode;
+	struct file *file;
+	inum_t inum;
+	int got, size = strlen(buf);
+
+	inode = tuxcreate(sb->rootdir, name, strlen(name), &iattr);
+	test_assert(!IS_ERR(inode));
+	inum = tux_inode(inode)->inum;
+	file = &(struct file){ .f_inode = inode };
+	got = tuxwrite(file, buf, size);
+	test_assert(got == size);
+	force_delta(sb);
+
+	test_assert(!has_root(&tux_inode(inode)->btree));
+	test_assert(tux_inode(inode)->inline_size == size);
+	iput(inode);
+
+	/* Decode inline data from itree */
+	iattr_cache_invalidate(sb);
+	inode = tux3_iget(sb, inum);
+	test_assert(!IS_ERR(inode));
+	test_assert(tux_inode(inode)->inline_size == size);
+	file = &(struct file){ .f_inode = inode };
+	memset(data, 0, sizeof(data));
+	got = tuxread(file, data, sizeof(data));
+	test_assert(got == size);
+	test_assert(!memcmp(data, buf, size));
+
+	/* Grow file, then inline data is moved to block 0 */
+	tuxseek(file, 2 * sb->blocksize);
+	got = tuxwrite(file, buf, size);
+	test_assert(got == size);
+	force_delta(sb);
+
+	test_assert(has_root(&tux_inode(inode)->btree));
+	test_assert(!tux_inode(inode)->inline_data);
+	iput(inode);
+
+	iattr_cache_invalidate(sb);
+	inode = tux3_iget(sb, inum);
+	test_assert(!IS_ERR(inode));
+	file = &(struct file){ .f_inode = inode };
+	memset(data, 0, sizeof(data));
+	got = tuxread(file, data, size);
+	test_assert(got == size);
+	test_assert(!memcmp(data, buf, size));
+	tuxseek(file, 2 * sb->blocksize);
+	got = tuxread(file, data, sizeof(data));
+	test_assert(got == size);
+	test_assert(!memcmp(data, buf, size));
+
+	iput(inode);
+
+	/* Expand by truncate, then inline data is moved to block 0 */
+	inode = tuxcreate(sb->rootdir, "bar", 3, &iattr);
+	test_assert(!IS_ERR(inode));
+	inum = tux_inode(inode)->inum;
+	file = &(struct file){ .f_inode = inode };
+	got = tuxwrite(file, buf, size);
+	test_assert(got == size);
+	force_delta(sb);
+	test_assert(tux_inode(inode)->inline_size == size);
+	test_assert(tuxtruncate(inode, 2 * sb->blocksize) == 0);
+	force_delta(sb);
+	test_assert(!tux_inode(inode)->inline_data);
+	iput(inode);
+
+	iattr_cache_invalidate(sb);
+	inode = tux3_iget(sb, inum);
+	test_assert(!IS_ERR(inode));
+	file = &(struct file){ .f_inode = inode };
+	memset(data, 0xff, sizeof(data));
+	got = tuxread(file, data, sizeof(data));
+	test_assert(got == sizeof(data));
+	test_assert(!memcmp(data, buf, size));
+	test_assert(!data[size] && !data[sizeof(data) - 1]);
+	iput(inode);
+
+	force_delta(sb);
+	clean_main(sb);
+}
+
+/* Lookup results are cached, and updated by namespace changes */
+static void test07(struct sb *sb)
+{
+	struct tux_iattr iattr = { .mode = S_IFREG | S_IRWXU };
+	struct inode *dir = sb->rootdir, *inode;
+	struct tux3_dcachestat stat;
+	inum_t inum;
+
+	/* Negative entry */
+	dcache_invalidate(sb);
+	inode = tuxopen(dir, "a", 1);
+	test_assert(PTR_ERR(inode) == -ENOENT);
+	inode = tuxopen(dir, "a", 1);
+	test_assert(PTR_ERR(inode) == -ENOENT);
+	dcache_stat(sb, &stat);
+	test_assert(stat.misses == 1 && stat.neg_hits == 1 && !stat.hits);
+	test_assert(stat.entries == 1);
+
+	/* Create replaces negative entry */
+	inode = tuxcreate(dir, "a", 1, &iattr);
+	test_assert(!IS_ERR(inode));
+	inum = tux_inode(inode)->inum;
+	iput(inode);
+	inode = tuxopen(dir, "a", 1);
+	test_assert(!IS_ERR(inode));
+	test_assert(tux_inode(inode)->inum == inum);
+	iput(inode);
+	inode = tuxcreate(dir, "a", 1, &iattr);
+	test_assert(PTR_ERR(inode) == -EEXIST);
+	dcache_stat(sb, &stat);
+	test_assert(stat.hits == 2 && stat.entries == 1);
+
+	/* Rename */
+	test_assert(!tuxrename(dir, "a", 1, dir, "b", 1));
+	inode = tuxopen(dir, "a", 1);
+	test_assert(PTR_ERR(inode) == -ENOENT);
+	inode = tuxopen(dir, "b", 1);
+	test_assert(!IS_ERR(inode));
+	test_assert(tux_inode(inode)->inum == inum);
+	iput(inode);
+
+	/* Unlink */
+	test_assert(!tuxunlink(dir, "b", 1));
+	inode = tuxopen(dir, "b", 1);
+	test_assert(PTR_ERR(inode) == -ENOENT);
+
+	/* Lookup without cache agrees, and statistics was reset */
+	dcache_invalidate(sb);
+	inode = tuxopen(dir, "b", 1);
+	test_assert(PTR_ERR(inode) == -ENOENT);
+	dcache_stat(sb, &stat);
+	test_assert(stat.misses == 1 && !stat.hits && !stat.neg_hits);
+
+	force_delta(sb);
+	clean_main(sb);
+}
+
 int main(int argc, char *argv[])
 {
 	if (argc < 2)
@@ -230,6 +470,22 @@ int main(int argc, char *argv[])
 		test03(sb);
 	test_end();
 
+	if (test_start("test04"))
+		test04(sb);
+	test_end();
+
+	if (test_start("test05"))
+		test05(sb);
+	test_end();
+
+	if (test_start("test06"))
+		test06(sb);
+	test_end();
+
+	if (test_start("test07"))
+		test07(sb);
+	test_end();
+
 	clean_main(sb);
 	return test_failures();
 }
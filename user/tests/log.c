@@ -27,7 +27,11 @@ static void check(struct sb *sb, u8 intent)
 	test_assert(sb->logbuf);
 	log = bufdata(sb->logbuf);
 	test_assert(sb->logtop >= sb->logpos);
-	test_assert((sb->logpos - log->data) == log_size[intent]);
+	if (log->data[0] == LOG_BITMAP_BATCH)
+		test_assert(log->data[1] == intent);
+	else
+		test_assert(log->data[0] == intent);
+	test_assert((sb->logpos - log->data) == log_entry_size(log->data));
 	log_finish(sb);
 }
 
@@ -91,6 +95,65 @@ static void test01(struct sb *sb)
 	clean_main(sb);
 }
 
+/* Bitmap logs are batched, and decoded back */
+static void test02(struct sb *sb)
+{
+	enum { nr = 100 };
+	struct log_batch batch;
+	struct logblock *log;
+	unsigned char *p;
+	block_t block;
+	unsigned count, i;
+
+	/* Allocation churn: many small segments in a row */
+	for (i = 0; i < nr; i++)
+		log_balloc(sb, 1000 + i * 3, 2);
+	/* Different intent, and other log break the batch */
+	log_bfree(sb, 500, 1);
+	/* Same intent with smaller block: backward delta in batch */
+	log_bfree(sb, 400, 2);
+	log_delta(sb);
+	log_bfree(sb, 10, 1);
+
+	log = bufdata(sb->logbuf);
+	/* Much smaller than fixed size logs */
+	test_assert(sb->logpos - log->data < nr * log_size[LOG_BALLOC] / 4);
+
+	p = log->data;
+	test_assert(*p == LOG_BITMAP_BATCH);
+	log_batch_init(&batch, p);
+	test_assert(batch.intent == LOG_BALLOC);
+	for (i = 0; i < nr; i++) {
+		test_assert(log_batch_next(&batch, &block, &count) == 1);
+		test_assert(block == 1000 + i * 3);
+		test_assert(count == 2);
+	}
+	test_assert(log_batch_next(&batch, &block, &count) == 0);
+
+	/* New intent starts new batch, first block is encoded from 0 */
+	p += log_entry_size(p);
+	log_batch_init(&batch, p);
+	test_assert(batch.intent == LOG_BFREE);
+	test_assert(log_batch_next(&batch, &block, &count) == 1);
+	test_assert(block == 500 && count == 1);
+	/* Backward difference from previous entry */
+	test_assert(log_batch_next(&batch, &block, &count) == 1);
+	test_assert(block == 400 && count == 2);
+	test_assert(log_batch_next(&batch, &block, &count) == 0);
+
+	p += log_entry_size(p);
+	test_assert(*p == LOG_DELTA);
+	p += log_entry_size(p);
+	log_batch_init(&batch, p);
+	test_assert(log_batch_next(&batch, &block, &count) == 1);
+	test_assert(block == 10 && count == 1);
+	p += log_entry_size(p);
+	test_assert(p == sb->logpos);
+
+	log_finish(sb);
+	clean_main(sb);
+}
+
 int main(int argc, char *argv[])
 {
 	struct dev *dev = &(struct dev){ .bits = 8 };
@@ -115,6 +178,10 @@ int main(int argc, char *argv[])
 		test01(sb);
 	test_end();
 
+	if (test_start("test02"))
+		test02(sb);
+	test_end();
+
 	tux3_end_backend();
 
 	clean_main(sb);
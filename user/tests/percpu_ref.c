@@ -0,0 +1,208 @@
+/*
+ * Userspace percpu_ref (libklib/percpu-refcount.c)
+ */
+
+#include <pthread.h>
+#include "tux3user.h"
+#include "test.h"
+
+static int nr_release;
+
+static void release(struct percpu_ref *ref)
+{
+	nr_release++;
+}
+
+/* Lifetime like delta_ref: dead -> reinit -> get/put -> kill -> release */
+static void test01(void)
+{
+	struct percpu_ref ref;
+
+	test_assert(!percpu_ref_init(&ref, release, PERCPU_REF_INIT_DEAD, 0));
+	test_assert(percpu_ref_is_zero(&ref));
+	test_assert(!percpu_ref_tryget_live(&ref));
+
+	percpu_ref_reinit(&ref);
+	test_assert(!percpu_ref_is_zero(&ref));
+	test_assert(percpu_ref_tryget_live(&ref));
+	test_assert(percpu_ref_tryget_live(&ref));
+	percpu_ref_put(&ref);
+
+	/* Killed, but still one reference */
+	percpu_ref_kill(&ref);
+	test_assert(!percpu_ref_tryget_live(&ref));
+	test_assert(!percpu_ref_is_zero(&ref));
+	test_assert(nr_release == 0);
+
+	/* Last put releases */
+	percpu_ref_put(&ref);
+	test_assert(percpu_ref_is_zero(&ref));
+	test_assert(nr_release == 1);
+
+	/* Reuse, and kill without reference */
+	percpu_ref_reinit(&ref);
+	percpu_ref_kill(&ref);
+	test_assert(nr_release == 2);
+
+	percpu_ref_exit(&ref);
+}
+
+struct thread_data {
+	struct percpu_ref *ref;
+	int loops;
+	int held;
+};
+
+static void *test02_thread(void *arg)
+{
+	struct thread_data *data = arg;
+	int i;
+
+	for (i = 0; i < data->loops; i++) {
+		percpu_ref_get(data->ref);
+		percpu_ref_put(data->ref);
+	}
+	/* Keep references over kill */
+	for (i = 0; i < data->held; i++)
+		percpu_ref_get(data->ref);
+	return NULL;
+}
+
+/* References from threads are counted on per-thread counters */
+static void test02(void)
+{
+	enum { nr = PERCPU_REF_SLOTS * 2 };
+	struct thread_data data[nr];
+	pthread_t thread[nr];
+	struct percpu_ref ref;
+	int i, j;
+
+	nr_release = 0;
+	test_assert(!percpu_ref_init(&ref, release, 0, 0));
+	for (i = 0; i < nr; i++) {
+		data[i] = (struct thread_data){
+			.ref = &ref, .loops = 10000, .held = i % 3,
+		};
+		test_assert(!pthread_create(&thread[i], NULL, test02_thread,
+					    &data[i]));
+	}
+	for (i = 0; i < nr; i++)
+		test_assert(!pthread_join(thread[i], NULL));
+
+	percpu_ref_kill(&ref);
+	for (i = 0; i < nr; i++) {
+		for (j = 0; j < data[i].held; j++) {
+			test_assert(nr_release == 0);
+			percpu_ref_put(&ref);
+		}
+	}
+	test_assert(nr_release == 1);
+	test_assert(percpu_ref_is_zero(&ref));
+
+	percpu_ref_exit(&ref);
+}
+
+struct bench_data {
+	struct percpu_ref *ref;
+	long *shared;
+	int loops;
+};
+
+static void *bench_percpu(void *arg)
+{
+	struct bench_data *data = arg;
+	int i;
+
+	for (i = 0; i < data->loops; i++) {
+		if (percpu_ref_tryget_live(data->ref))
+			percpu_ref_put(data->ref);
+	}
+	return NULL;
+}
+
+/* Same with old delta_get()/delta_put() on shared atomic counter */
+static void *bench_shared(void *arg)
+{
+	struct bench_data *data = arg;
+	int i;
+
+	for (i = 0; i < data->loops; i++) {
+		long old = __atomic_load_n(data->shared, __ATOMIC_RELAXED);
+		while (old && !__atomic_compare_exchange_n(data->shared, &old,
+				old + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			;
+		__atomic_sub_fetch(data->shared, 1, __ATOMIC_ACQ_REL);
+	}
+	return NULL;
+}
+
+static double run_threads(void *(*fn)(void *), struct bench_data *data,
+			  int threads)
+{
+	struct timeval start, end, diff;
+	pthread_t thread[threads];
+	int i;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < threads; i++)
+		test_assert(!pthread_create(&thread[i], NULL, fn, data));
+	for (i = 0; i < threads; i++)
+		test_assert(!pthread_join(thread[i], NULL));
+	gettimeofday(&end, NULL);
+	timersub(&end, &start, &diff);
+
+	return diff.tv_sec + diff.tv_usec / 1000000.0;
+}
+
+/*
+ * Scalability benchmark: change_begin/end pairs of concurrent
+ * frontend (e.g. create) with percpu_ref and with shared counter.
+ *
+ * This measures only the bare refcount. It doesn't run the tux3
+ * delta path (delta_get()/delta_put(), transition and flush), and
+ * userland frontend is serialized by sb->frontend_lock anyway, so the
+ * numbers don't tell the cost of tux3 operations.
+ */
+static void test03(void)
+{
+	static const int nr_threads[] = { 1, 2, 4, 8 };
+	struct percpu_ref ref;
+	long shared = 1;
+	struct bench_data data = {
+		.ref = &ref, .shared = &shared, .loops = 1000000,
+	};
+	int i;
+
+	test_assert(!percpu_ref_init(&ref, release, 0, 0));
+	for (i = 0; i < ARRAY_SIZE(nr_threads); i++) {
+		int threads = nr_threads[i];
+		double percpu_secs = run_threads(bench_percpu, &data, threads);
+		double shared_secs = run_threads(bench_shared, &data, threads);
+
+		printf("%d threads: percpu_ref %.1f Mops/sec, "
+		       "shared counter %.1f Mops/sec\n", threads,
+		       threads * data.loops / percpu_secs / 1e6,
+		       threads * data.loops / shared_secs / 1e6);
+	}
+	test_assert(shared == 1);
+	percpu_ref_exit(&ref);
+}
+
+int main(int argc, char *argv[])
+{
+	test_init(argv[0]);
+
+	if (test_start("test01"))
+		test01();
+	test_end();
+
+	if (test_start("test02"))
+		test02();
+	test_end();
+
+	if (test_start("test03"))
+		test03();
+	test_end();
+
+	return test_failures();
+}
@@ -0,0 +1,241 @@
+/*
+ * Userspace slab allocator (libklib/slab.c)
+ */
+
+#include <pthread.h>
+#include "tux3user.h"
+#include "test.h"
+
+struct object {
+	int constructed;
+	char data[52];
+};
+
+static int nr_ctor;
+
+static void object_ctor(void *mem)
+{
+	struct object *obj = mem;
+	obj->constructed = 1;
+	nr_ctor++;
+}
+
+/* Object is reused, and constructor is called only once for slot */
+static void test01(void)
+{
+	struct kmem_cache *cachep;
+	struct object *obj, *obj2;
+
+	cachep = kmem_cache_create("test01", sizeof(struct object), 0, 0,
+				   object_ctor);
+	test_assert(cachep);
+
+	obj = kmem_cache_alloc(cachep, GFP_NOFS);
+	test_assert(obj);
+	test_assert(obj->constructed);
+	int ctors = nr_ctor;
+
+	/* Freed object must be in constructed state, and is reused */
+	kmem_cache_free(cachep, obj);
+	obj2 = kmem_cache_alloc(cachep, GFP_NOFS);
+	test_assert(obj2->constructed);
+	if (!cachep->passthrough) {
+		test_assert(obj2 == obj);
+		test_assert(nr_ctor == ctors);
+	}
+	kmem_cache_free(cachep, obj2);
+
+	/* Zeroed alloc */
+	obj = kmem_cache_zalloc(cachep, GFP_NOFS);
+	test_assert(obj);
+	test_assert(!obj->constructed);
+	kmem_cache_free(cachep, obj);
+
+	kmem_cache_destroy(cachep);
+}
+
+/* Many objects over magazine and slab size, all distinct and aligned */
+static void test02(void)
+{
+	enum { nr = 10000 };
+	struct kmem_cache *cachep;
+	void **objs;
+	int i, j;
+
+	cachep = kmem_cache_create("test02", 24, 0, SLAB_HWCACHE_ALIGN, NULL);
+	test_assert(cachep);
+
+	objs = malloc(sizeof(*objs) * nr);
+	test_assert(objs);
+
+	for (j = 0; j < 2; j++) {
+		for (i = 0; i < nr; i++) {
+			objs[i] = kmem_cache_alloc(cachep, GFP_NOFS);
+			test_assert(objs[i]);
+			test_assert(!((unsigned long)objs[i] & 63));
+			memset(objs[i], i, 24);
+		}
+		for (i = 0; i < nr; i++) {
+			unsigned char *p = objs[i];
+			test_assert(p[0] == (unsigned char)i);
+			test_assert(p[23] == (unsigned char)i);
+		}
+		/* Free in different order with alloc */
+		for (i = 0; i < nr; i += 2)
+			kmem_cache_free(cachep, objs[i]);
+		for (i = 1; i < nr; i += 2)
+			kmem_cache_free(cachep, objs[i]);
+	}
+
+	free(objs);
+	kmem_cache_destroy(cachep);
+}
+
+struct thread_data {
+	struct kmem_cache *cachep;
+	void *objs[100];
+};
+
+static void *test03_thread(void *arg)
+{
+	struct thread_data *data = arg;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(data->objs); i++)
+		data->objs[i] = kmem_cache_alloc(data->cachep, GFP_NOFS);
+	/* Free half, those are given back to cache at thread exit */
+	for (i = 0; i < ARRAY_SIZE(data->objs) / 2; i++) {
+		kmem_cache_free(data->cachep, data->objs[i]);
+		data->objs[i] = NULL;
+	}
+	return NULL;
+}
+
+/* Object allocated by other thread, and magazine of exited thread */
+static void test03(void)
+{
+	struct thread_data data;
+	pthread_t thread;
+	int i;
+
+	data.cachep = kmem_cache_create("test03", 100, 0, 0, NULL);
+	test_assert(data.cachep);
+
+	test_assert(!pthread_create(&thread, NULL, test03_thread, &data));
+	test_assert(!pthread_join(thread, NULL));
+
+	/* Objects freed by exited thread were given back to cache */
+	test_assert(data.cachep->nr_free ==
+		    data.cachep->nr_objs - ARRAY_SIZE(data.objs) / 2 ||
+		    data.cachep->passthrough);
+
+	for (i = 0; i < ARRAY_SIZE(data.objs); i++) {
+		if (data.objs[i]) {
+			test_assert(i >= ARRAY_SIZE(data.objs) / 2);
+			kmem_cache_free(data.cachep, data.objs[i]);
+		}
+	}
+
+	kmem_cache_destroy(data.cachep);
+}
+
+static double elapsed(struct timeval *start)
+{
+	struct timeval end, diff;
+	gettimeofday(&end, NULL);
+	timersub(&end, start, &diff);
+	return diff.tv_sec + diff.tv_usec / 1000000.0;
+}
+
+/* Allocation rate benchmark: cursor-sized objects, alloc/free in a loop */
+static void test04(void)
+{
+	enum { loops = 100000, batch = 16, size = 136 };
+	struct kmem_cache *cachep;
+	struct timeval start;
+	void *objs[batch];
+	double slab_secs, malloc_secs;
+	int i, j;
+
+	cachep = kmem_cache_create("test04", size, 0, 0, NULL);
+	test_assert(cachep);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < loops; i++) {
+		for (j = 0; j < batch; j++)
+			objs[j] = kmem_cache_alloc(cachep, GFP_NOFS);
+		for (j = 0; j < batch; j++)
+			kmem_cache_free(cachep, objs[j]);
+	}
+	slab_secs = elapsed(&start);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < loops; i++) {
+		for (j = 0; j < batch; j++)
+			objs[j] = malloc(size);
+		for (j = 0; j < batch; j++)
+			free(objs[j]);
+	}
+	malloc_secs = elapsed(&start);
+
+	printf("kmem_cache_alloc: %.1f Mops/sec, malloc: %.1f Mops/sec\n",
+	       loops * batch / slab_secs / 1e6,
+	       loops * batch / malloc_secs / 1e6);
+
+	kmem_cache_destroy(cachep);
+}
+
+/* Passthrough cache (SLAB_DEBUG or valgrind) allocates by malloc() */
+static void test05(void)
+{
+	struct kmem_cache *cachep;
+	struct object *objs[100];
+	int i;
+
+	cachep = kmem_cache_create("test05", sizeof(struct object), 0,
+				   SLAB_HWCACHE_ALIGN, object_ctor);
+	test_assert(cachep);
+	cachep->passthrough = 1;
+
+	for (i = 0; i < ARRAY_SIZE(objs); i++) {
+		objs[i] = kmem_cache_alloc(cachep, GFP_NOFS);
+		test_assert(objs[i]);
+		test_assert(objs[i]->constructed);
+		test_assert(!((unsigned long)objs[i] & 63));
+	}
+	/* Only objects in use are counted */
+	test_assert(cachep->nr_objs == ARRAY_SIZE(objs));
+	test_assert(cachep->nr_free == 0);
+	for (i = 0; i < ARRAY_SIZE(objs); i++)
+		kmem_cache_free(cachep, objs[i]);
+	test_assert(cachep->nr_objs == 0);
+
+	kmem_cache_destroy(cachep);
+}
+
+int main(int argc, char *argv[])
+{
+	test_init(argv[0]);
+
+	if (test_start("test01"))
+		test01();
+	test_end();
+
+	if (test_start("test02"))
+		test02();
+	test_end();
+
+	if (test_start("test03"))
+		test03();
+	test_end();
+
+	if (test_start("test04"))
+		test04();
+	test_end();
+
+	if (test_start("test05"))
+		test05();
+	test_end();
+
+	return test_failures();
+}
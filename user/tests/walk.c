@@ -0,0 +1,190 @@
+/*
+ * Readahead of btree walker (walk.c)
+ */
+
+#include "tux3user.h"
+#include "diskio.h"
+#include "test.h"
+
+#ifndef trace
+#define trace trace_off
+#endif
+
+/* Record readahead hints of walker, then pass to diskreadahead() */
+static struct walk_hint {
+	block_t block;
+	unsigned count;
+} hints[1024];
+static int nr_hints;
+
+static int test_diskreadahead(int fd, size_t count, off_t offset)
+{
+	assert(nr_hints < ARRAY_SIZE(hints));
+	hints[nr_hints].block = offset >> 8;
+	hints[nr_hints].count = count >> 8;
+	nr_hints++;
+	return diskreadahead(fd, count, offset);
+}
+#define diskreadahead	test_diskreadahead
+
+#include "../walk.c"
+
+void *unuse_walk_ileaf = walk_ileaf;	/* test doesn't use this */
+
+static void clean_main(struct sb *sb, struct inode *inode)
+{
+	iput(inode);
+	put_super(sb);
+	tux3_exit_mem();
+}
+
+/* Was block hinted before it is read? */
+static int is_hinted(block_t block)
+{
+	for (int i = 0; i < nr_hints; i++) {
+		if (hints[i].block <= block &&
+		    block < hints[i].block + hints[i].count)
+			return 1;
+	}
+	return 0;
+}
+
+struct test01_data {
+	int bnodes, children, leaves, blocks;
+};
+
+static void test01_bnode(struct btree *btree, struct buffer_head *buffer,
+			 int level, void *data)
+{
+	struct test01_data *ctx = data;
+	struct bnode *bnode = bufdata(buffer);
+
+	if (level)
+		test_assert(is_hinted(bufindex(buffer)));
+	ctx->bnodes++;
+	ctx->children += bcount(bnode);
+}
+
+static void test01_data(struct btree *btree, struct buffer_head *leafbuf,
+			struct buffer_head *buffer, block_t block,
+			void *callback, void *data)
+{
+	struct test01_data *ctx = data;
+
+	test_assert(is_hinted(block));
+	ctx->blocks++;
+}
+
+static void test01_extent(struct btree *btree, struct buffer_head *leafbuf,
+			  block_t index, block_t block, unsigned count,
+			  void *data)
+{
+	walk_extent(btree, leafbuf, index, block, count, test01_data, NULL,
+		    data);
+}
+
+static void test01_leaf(struct btree *btree, struct buffer_head *leafbuf,
+			void *data)
+{
+	struct test01_data *ctx = data;
+	struct walk_dleaf_ops ops = { .extent = test01_extent, };
+
+	/* Leaf was hinted by parent bnode */
+	test_assert(is_hinted(bufindex(leafbuf)));
+	ctx->leaves++;
+	walk_dleaf(btree, leafbuf, &ops, data);
+}
+
+/* Tree blocks and data extents are hinted before walker reads them */
+static void test01(struct sb *sb, struct inode *inode)
+{
+	enum { nr_blocks = 100 };
+	struct file *file = &(struct file){ .f_inode = inode };
+	struct test01_data ctx = {};
+	struct walk_btree_ops ops = {
+		.bnode	= test01_bnode,
+		.leaf	= test01_leaf,
+	};
+	char buf[256];
+	int i;
+
+	/* Discontiguous blocks make many extents, then multi-level dtree */
+	for (i = 0; i < nr_blocks; i++) {
+		memset(buf, i, sizeof(buf));
+		tuxseek(file, (loff_t)(i * 2) << sb->blockbits);
+		test_assert(tuxwrite(file, buf, sizeof(buf)) == sizeof(buf));
+	}
+	test_assert(force_delta(sb) == 0);
+	test_assert(tux_inode(inode)->btree.root.depth >= 1);
+
+	nr_hints = 0;
+	walk_btree(&tux_inode(inode)->btree, &ops, &ctx);
+
+	test_assert(ctx.bnodes >= 1);
+	test_assert(ctx.leaves == ctx.children - ctx.bnodes + 1);
+	test_assert(ctx.blocks == nr_blocks);
+	/* Contiguous children are merged into one hint */
+	test_assert(nr_hints <= ctx.children + nr_blocks);
+
+	clean_main(sb, inode);
+}
+
+/* Long extent is hinted up to WALK_READAHEAD_MAX blocks at once */
+static void test02(struct sb *sb, struct inode *inode)
+{
+	nr_hints = 0;
+	walk_readahead(sb, 10, WALK_READAHEAD_MAX * 2);
+	test_assert(nr_hints == 1);
+	test_assert(hints[0].block == 10);
+	test_assert(hints[0].count == WALK_READAHEAD_MAX);
+
+	clean_main(sb, inode);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2)
+		error_exit("usage: %s <volname>", argv[0]);
+
+	char *name = argv[1];
+	int fd = open(name, O_CREAT|O_TRUNC|O_RDWR, S_IRUSR|S_IWUSR);
+	u64 size = 1 << 24;
+	assert(!ftruncate(fd, size));
+
+	int err = tux3_init_mem();
+	assert(!err);
+
+	struct dev *dev = &(struct dev){ .fd = fd, .bits = 8 };
+	init_buffers(dev, 1 << 20, 2);
+
+	struct sb *sb = rapid_sb(dev);
+	sb->super = INIT_DISKSB(dev->bits, size >> dev->bits);
+	setup_sb(sb, &sb->super);
+
+	sb->volmap = tux_new_volmap(sb);
+	assert(sb->volmap);
+	sb->logmap = tux_new_logmap(sb);
+	assert(sb->logmap);
+
+	test_assert(make_tux3(sb) == 0);
+
+	struct tux_iattr iattr = { .mode = S_IFREG | 0644, };
+	struct inode *inode = tuxcreate(sb->rootdir, "foo", 3, &iattr);
+	test_assert(inode);
+
+	test_assert(force_unify(sb) == 0);
+
+	test_init(argv[0]);
+
+	if (test_start("test01"))
+		test01(sb, inode);
+	test_end();
+
+	if (test_start("test02"))
+		test02(sb, inode);
+	test_end();
+
+	clean_main(sb, inode);
+
+	return test_failures();
+}
@@ -281,6 +281,261 @@ static void test02(struct sb *sb)
 	clean_main(sb);
 }
 
+/* Test atom cache is consistent with atom dictionary */
+static void test03(struct sb *sb)
+{
+	struct inode *atable = sb->atable;
+	atom_t atoms[100];
+	char name[16];
+	int i, len, err;
+
+	change_begin_atomic(sb);
+	mutex_lock(&atable->i_mutex);
+
+	for (i = 0; i < ARRAY_SIZE(atoms); i++) {
+		len = snprintf(name, sizeof(name), "atom-%d", i);
+		err = make_atom(atable, name, len, &atoms[i]);
+		test_assert(!err);
+		err = atomref(atable, atoms[i], 1);
+		test_assert(!err);
+	}
+	test_assert(sb->atom_cache);
+
+	/* Kill even atoms */
+	for (i = 0; i < ARRAY_SIZE(atoms); i += 2) {
+		err = atomref(atable, atoms[i], -1);
+		test_assert(!err);
+	}
+
+	for (int pass = 0; pass < 2; pass++) {
+		for (i = 0; i < ARRAY_SIZE(atoms); i++) {
+			char buf[16];
+			atom_t atom;
+
+			len = snprintf(name, sizeof(name), "atom-%d", i);
+			err = find_atom(atable, name, len, &atom);
+			if (i & 1) {
+				test_assert(!err);
+				test_assert(atom == atoms[i]);
+				err = unatom(atable, atom, buf, sizeof(buf));
+				test_assert(err == len);
+				test_assert(!memcmp(buf, name, len));
+			} else
+				test_assert(err == -ENODATA);
+		}
+
+		/* Drop cache, then rebuild it from atom dictionary */
+		tux3_atom_cache_free(sb);
+	}
+
+	mutex_unlock(&atable->i_mutex);
+	change_end_atomic(sb);
+
+	test_assert(force_delta(sb) == 0);
+	clean_main(sb);
+}
+
+/* Test shared xattr value */
+static void test04(struct sb *sb)
+{
+	struct inode *atable = sb->atable;
+	struct tux_iattr iattr = { .mode = S_IFREG, };
+	struct inode *inode[3];
+	const char *label = "system_u:object_r:etc_t:s0";
+	char buf[64], key[64];
+	atom_t share;
+	int i, err;
+
+	/* Share value if the size is 8 bytes or more */
+	sb->xattr_share = 8;
+
+	for (i = 0; i < ARRAY_SIZE(inode); i++) {
+		snprintf(buf, sizeof(buf), "file%d", i);
+		inode[i] = tuxcreate(sb->rootdir, buf, strlen(buf), &iattr);
+		test_assert(inode[i]);
+
+		err = set_xattr(inode[i], "security.selinux", 16, label,
+				strlen(label), 0);
+		test_assert(!err);
+		/* Too small to share */
+		err = set_xattr(inode[i], "user.small", 10, "abc", 3, 0);
+		test_assert(!err);
+	}
+
+	/* First user stores value, then others have the same value atom */
+	struct xcache_entry *xattr[3];
+	for (i = 0; i < ARRAY_SIZE(inode); i++) {
+		atom_t atom;
+		err = find_atom(atable, "security.selinux", 16, &atom);
+		test_assert(!err);
+		xattr[i] = xcache_lookup(tux_inode(inode[i])->xcache, atom);
+		test_assert(!IS_ERR(xattr[i]));
+	}
+	test_assert(!xattr[0]->share);
+	test_assert(xattr[0]->size == strlen(label));
+	test_assert(xattr[1]->share);
+	test_assert(xattr[1]->size == 0);
+	test_assert(xattr[1]->share == xattr[2]->share);
+	share = xattr[1]->share;
+
+	/* Shared xattr is encoded without value */
+	unsigned xsize = encode_xsize(inode[1]);
+	test_assert(xsize == 2 + atsize[XSHARE_ATTR] + 2 + atsize[XATTR_ATTR] + 3);
+	char attrs[64];
+	char *top = encode_xattrs(inode[1], attrs, sizeof(attrs));
+	test_assert(top - attrs == xsize);
+
+	/* Decode keeps only value atom, value is read by get_xattr() */
+	free_xcache(inode[1]);
+	err = new_xcache(inode[1], decode_xsize(inode[1], attrs, xsize));
+	test_assert(!err);
+	test_assert(decode_attrs(inode[1], attrs, xsize) == top);
+	test_assert(tux_inode(inode[1])->xcache->size ==
+		    2 * sizeof(struct xcache_entry) + 3);
+
+	for (i = 0; i < ARRAY_SIZE(inode); i++) {
+		err = get_xattr(inode[i], "security.selinux", 16, buf,
+				sizeof(buf));
+		test_assert(err == strlen(label));
+		test_assert(!memcmp(buf, label, err));
+		err = get_xattr(inode[i], "user.small", 10, buf, sizeof(buf));
+		test_assert(err == 3);
+		test_assert(!memcmp(buf, "abc", 3));
+	}
+	/* Query size, and too small buffer */
+	err = get_xattr(inode[1], "security.selinux", 16, NULL, 0);
+	test_assert(err == strlen(label));
+	err = get_xattr(inode[1], "security.selinux", 16, buf, 4);
+	test_assert(err == -ERANGE);
+
+	/* Value is alive until last user is removed */
+	key[0] = '\0';
+	memcpy(key + 1, label, strlen(label));
+	for (i = 0; i < ARRAY_SIZE(inode); i++) {
+		atom_t atom;
+
+		mutex_lock(&atable->i_mutex);
+		err = find_atom(atable, key, strlen(label) + 1, &atom);
+		mutex_unlock(&atable->i_mutex);
+		test_assert(!err);
+		test_assert(atom == share);
+
+		err = del_xattr(inode[i], "security.selinux", 16);
+		test_assert(!err);
+	}
+	mutex_lock(&atable->i_mutex);
+	err = find_atom(atable, key, strlen(label) + 1, &share);
+	mutex_unlock(&atable->i_mutex);
+	test_assert(err == -ENODATA);
+
+	for (i = 0; i < ARRAY_SIZE(inode); i++)
+		iput(inode[i]);
+
+	test_assert(force_delta(sb) == 0);
+	clean_main(sb);
+}
+
+/* Test many distinct shared values, and atom limit of shared value */
+static void test05(struct sb *sb)
+{
+	struct inode *atable = sb->atable;
+	struct tux_iattr iattr = { .mode = S_IFREG, };
+	enum { nr_values = 32, nr_shared = 24, };
+	struct inode *inode[nr_values * 2];
+	char value[32], buf[32];
+	atom_t atom, share[nr_values];
+	int i, j, err;
+
+	sb->xattr_share = 8;
+
+	for (i = 0; i < ARRAY_SIZE(inode); i++) {
+		snprintf(buf, sizeof(buf), "file%d", i);
+		inode[i] = tuxcreate(sb->rootdir, buf, strlen(buf), &iattr);
+		test_assert(inode[i]);
+	}
+
+	/* Unique value is not shared, and doesn't make value atom */
+	err = set_xattr(inode[0], "user.unique", 11, "unique value", 12, 0);
+	test_assert(!err);
+	mutex_lock(&atable->i_mutex);
+	err = find_atom(atable, "\0unique value", 13, &atom);
+	mutex_unlock(&atable->i_mutex);
+	test_assert(err == -ENODATA);
+
+	/* Make name atom, then leave only nr_shared atoms for values */
+	change_begin_atomic(sb);
+	mutex_lock(&atable->i_mutex);
+	err = make_atom(atable, "user.value", 10, &atom);
+	mutex_unlock(&atable->i_mutex);
+	change_end_atomic(sb);
+	test_assert(!err);
+	test_assert(!sb->freeatom);
+	test_assert(sb->atomgen < XSHARE_ATOM_MAX - nr_shared);
+	sb->atomgen = XSHARE_ATOM_MAX - nr_shared;
+
+	/* Same value on a pair of inodes, the second one shares */
+	for (i = 0; i < nr_values; i++) {
+		struct xcache_entry *xattr;
+
+		snprintf(value, sizeof(value), "shared value %02d", i);
+		for (j = 2 * i; j < 2 * i + 2; j++) {
+			err = set_xattr(inode[j], "user.value", 10, value,
+					strlen(value), 0);
+			test_assert(!err);
+		}
+
+		xattr = xcache_lookup(tux_inode(inode[2 * i])->xcache, atom);
+		test_assert(!IS_ERR(xattr));
+		test_assert(!xattr->share);
+		xattr = xcache_lookup(tux_inode(inode[2 * i + 1])->xcache, atom);
+		test_assert(!IS_ERR(xattr));
+		share[i] = xattr->share;
+		if (i < nr_shared) {
+			test_assert(share[i]);
+			test_assert(share[i] < XSHARE_ATOM_MAX);
+		} else {
+			/* No atom left for value, stored in inode */
+			test_assert(!share[i]);
+		}
+	}
+	test_assert(sb->atomgen == XSHARE_ATOM_MAX);
+
+	/* Name atom still can be made, and existing value is shared */
+	err = set_xattr(inode[1], "user.last", 9, "shared value 00", 15, 0);
+	test_assert(!err);
+	mutex_lock(&atable->i_mutex);
+	err = find_atom(atable, "user.last", 9, &atom);
+	mutex_unlock(&atable->i_mutex);
+	test_assert(!err);
+	test_assert(atom == XSHARE_ATOM_MAX);
+	struct xcache_entry *xattr;
+	xattr = xcache_lookup(tux_inode(inode[1])->xcache, atom);
+	test_assert(!IS_ERR(xattr));
+	test_assert(xattr->share == share[0]);
+
+	/* Distinct values are read back from each shared atom */
+	for (i = 0; i < nr_values; i++) {
+		snprintf(value, sizeof(value), "shared value %02d", i);
+		for (j = 2 * i; j < 2 * i + 2; j++) {
+			err = get_xattr(inode[j], "user.value", 10, buf,
+					sizeof(buf));
+			test_assert(err == strlen(value));
+			test_assert(!memcmp(buf, value, err));
+		}
+		for (j = 0; j < i; j++)
+			test_assert(!share[i] || share[i] != share[j]);
+	}
+	err = get_xattr(inode[1], "user.last", 9, buf, sizeof(buf));
+	test_assert(err == 15);
+	test_assert(!memcmp(buf, "shared value 00", 15));
+
+	for (i = 0; i < ARRAY_SIZE(inode); i++)
+		iput(inode[i]);
+
+	test_assert(force_delta(sb) == 0);
+	clean_main(sb);
+}
+
 int main(int argc, char *argv[])
 {
 	if (argc < 2)
@@ -323,6 +578,18 @@ int main(int argc, char *argv[])
 		test02(sb);
 	test_end();
 
+	if (test_start("test03"))
+		test03(sb);
+	test_end();
+
+	if (test_start("test04"))
+		test04(sb);
+	test_end();
+
+	if (test_start("test05"))
+		test05(sb);
+	test_end();
+
 	clean_main(sb);
 	return test_failures();
 }
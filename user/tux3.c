@@ -87,6 +87,93 @@ static int mkfs(const char *volname, struct sb *sb, unsigned blocksize)
 	return make_tux3(sb);
 }
 
+/* Show commit flight recorder of mounted tux3fuse, via ioctl */
+static int commitstat_main(const char *path)
+{
+	static const char *phases[COMMIT_PHASES] = {
+		[COMMIT_PHASE_STAGE]	= "stage",
+		[COMMIT_PHASE_UNIFY]	= "unify",
+		[COMMIT_PHASE_BTREE]	= "btree",
+		[COMMIT_PHASE_LOG]	= "log",
+		[COMMIT_PHASE_IOWAIT]	= "iowait",
+		[COMMIT_PHASE_COMMIT]	= "commit",
+		[COMMIT_PHASE_POST]	= "post",
+	};
+	struct tux3_commitstat *stat;
+	int fd, err = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		strerror_exit(1, errno, "could not open '%s'", path);
+
+	stat = malloc(sizeof(*stat));
+	if (!stat) {
+		err = -ENOMEM;
+		goto out;
+	}
+	if (ioctl(fd, TUX3_IOC_COMMITSTAT, stat) < 0) {
+		err = -errno;
+		goto out_free;
+	}
+
+	printf("%Lu commits, last %u:\n", stat->nr_commits, stat->nr_records);
+	printf("%8s %-5s %4s %8s", "delta", "flags", "err", "total");
+	for (int i = 0; i < COMMIT_PHASES; i++)
+		printf(" %8s", phases[i]);
+	printf(" %7s %7s %7s %7s %7s\n",
+	       "inodes", "buffers", "log", "bitmap", "defree");
+
+	for (unsigned i = 0; i < stat->nr_records; i++) {
+		struct commit_record *rec = &stat->records[i];
+
+		printf("%8u %c%c    %4d %8u", rec->delta,
+		       rec->flags & COMMIT_RECORD_UNIFY ? 'U' : '-',
+		       rec->flags & COMMIT_RECORD_SYNC ? 'S' : '-',
+		       rec->err, rec->total_usecs);
+		for (int j = 0; j < COMMIT_PHASES; j++)
+			printf(" %8u", rec->phase_usecs[j]);
+		printf(" %7u %7u %7u %7u %7u\n",
+		       rec->counters.inodes, rec->counters.buffers,
+		       rec->counters.logblocks, rec->counters.bitmap_dirty,
+		       rec->counters.defree);
+	}
+
+out_free:
+	free(stat);
+out:
+	close(fd);
+	return err;
+}
+
+/* Show dentry cache statistics of mounted tux3fuse, via ioctl */
+static int dcachestat_main(const char *path)
+{
+	struct tux3_dcachestat stat;
+	u64 lookups;
+	int fd, err = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		strerror_exit(1, errno, "could not open '%s'", path);
+
+	if (ioctl(fd, TUX3_IOC_DCACHESTAT, &stat) < 0) {
+		err = -errno;
+		goto out;
+	}
+
+	lookups = stat.hits + stat.neg_hits + stat.misses;
+	printf("entries %Lu, lookups %Lu\n", stat.entries, lookups);
+	printf("hits %Lu, negative hits %Lu, misses %Lu", stat.hits,
+	       stat.neg_hits, stat.misses);
+	if (lookups)
+		printf(" (hit rate %.1f%%)",
+		       100.0 * (stat.hits + stat.neg_hits) / lookups);
+	printf("\n");
+out:
+	close(fd);
+	return err;
+}
+
 static void usage(struct options *options, const char *progname,
 		  const char *cmdname, const char *name, const char *blurb)
 {
@@ -160,7 +247,7 @@ int main(int argc, char *argv[])
 
 		CMD_DELTA, CMD_UNIFY,
 		CMD_READ, CMD_WRITE, CMD_GET, CMD_SET, CMD_STAT, CMD_DELETE,
-		CMD_TRUNCATE, CMD_UNKNOWN,
+		CMD_TRUNCATE, CMD_COMMITSTAT, CMD_DCACHESTAT, CMD_UNKNOWN,
 	};
 
 	static char *commands[] = {
@@ -171,7 +258,8 @@ int main(int argc, char *argv[])
 		[CMD_READ] = "read", [CMD_WRITE] = "write",
 		[CMD_GET] = "get", [CMD_SET] = "set",
 		[CMD_STAT] = "stat", [CMD_DELETE] = "delete",
-		[CMD_TRUNCATE] = "truncate",
+		[CMD_TRUNCATE] = "truncate", [CMD_COMMITSTAT] = "commitstat",
+		[CMD_DCACHESTAT] = "dcachestat",
 	};
 
 	struct options options[] = {
@@ -547,6 +635,22 @@ int main(int argc, char *argv[])
 			goto error;
 		break;
 
+	case CMD_COMMITSTAT:
+		command_options(&argc, &args, onlyhelp, 3, progname, command,
+				"<path on tux3fuse>", &vars);
+		err = commitstat_main(vars.volname);
+		if (err)
+			goto error;
+		break;
+
+	case CMD_DCACHESTAT:
+		command_options(&argc, &args, onlyhelp, 3, progname, command,
+				"<path on tux3fuse>", &vars);
+		err = dcachestat_main(vars.volname);
+		if (err)
+			goto error;
+		break;
+
 	default:
 		error_exit("'%s' is not a command", command);
 	}
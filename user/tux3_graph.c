@@ -1130,7 +1130,7 @@ static void draw_log_pre(struct sb *sb, struct buffer_head *buffer,
 		bufindex(buffer), bufindex(buffer), bufindex(buffer),
 		buffer_dirty(buffer) ? ", dirty" : "",
 		be16_to_cpu(log->magic), be16_to_cpu(log->bytes),
-		be64_to_cpu(log->logchain));
+		logchain_block(log->logchain));
 }
 
 static void draw_log(struct sb *sb, struct buffer_head *buffer,
@@ -1275,7 +1275,7 @@ static void draw_log_post(struct sb *sb, struct buffer_head *buffer,
 		/* write link: logblock -> logblock */
 		fprintf(gi->fp,
 			"logchain_%llu:f0:e -> logchain_%llu:n;\n",
-			bufindex(buffer), be64_to_cpu(log->logchain));
+			bufindex(buffer), logchain_block(log->logchain));
 	}
 }
 
@@ -1333,7 +1333,7 @@ static void draw_sb(struct graph_info *gi, struct sb *sb)
 		be64_to_cpu(txsb->nextblock),
 		be64_to_cpu(txsb->atomdictsize),
 		be32_to_cpu(txsb->freeatom), be32_to_cpu(txsb->atomgen),
-		be64_to_cpu(txsb->logchain), be64_to_cpu(txsb->logchain),
+		logchain_block(txsb->logchain), logchain_block(txsb->logchain),
 		be32_to_cpu(txsb->logcount));
 
 	/* write link: sb -> itree root */
@@ -1344,7 +1344,7 @@ static void draw_sb(struct graph_info *gi, struct sb *sb)
 		otree_btree(sb)->root.block);
 	/* write link: sb -> logchain */
 	fprintf(gi->fp, "tux3_sb:logchain_%llu:e -> logchain_%llu:n;\n\n",
-		be64_to_cpu(txsb->logchain), be64_to_cpu(txsb->logchain));
+		logchain_block(txsb->logchain), logchain_block(txsb->logchain));
 }
 
 static int graph_main(struct sb *sb, const char *volname, int verbose)
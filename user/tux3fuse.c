@@ -51,8 +51,38 @@
 struct tux3fuse {
 	struct sb *sb;
 	char *volname;
+	unsigned xattr_share;	/* -o xattr_share=<size> */
+
+	/* Delta and unify scheduling, TUX3FUSE_UNSET uses default */
+	unsigned delta_blocks;	/* -o delta_blocks=<blocks> */
+	unsigned delta_inodes;	/* -o delta_inodes=<inodes> */
+	unsigned delta_msecs;	/* -o delta_msecs=<msecs> */
+	unsigned unify_logblocks; /* -o unify_logblocks=<blocks> */
+	unsigned unify_replay_msecs; /* -o unify_replay_msecs=<msecs> */
+	unsigned fsync_window_usecs; /* -o fsync_window_usecs=<usecs> */
 };
 
+#define TUX3FUSE_UNSET	(~0U)
+
+/* Override scheduling parameters by mount options */
+static void tux3fuse_setup_sched(struct tux3fuse *tux3fuse, struct sb *sb)
+{
+	struct tux3_sched *sched = &sb->sched;
+
+	if (tux3fuse->delta_blocks != TUX3FUSE_UNSET)
+		sched->delta_blocks = tux3fuse->delta_blocks;
+	if (tux3fuse->delta_inodes != TUX3FUSE_UNSET)
+		sched->delta_inodes = tux3fuse->delta_inodes;
+	if (tux3fuse->delta_msecs != TUX3FUSE_UNSET)
+		sched->delta_msecs = tux3fuse->delta_msecs;
+	if (tux3fuse->unify_logblocks != TUX3FUSE_UNSET)
+		sched->unify_logblocks = tux3fuse->unify_logblocks;
+	if (tux3fuse->unify_replay_msecs != TUX3FUSE_UNSET)
+		sched->unify_replay_msecs = tux3fuse->unify_replay_msecs;
+	if (tux3fuse->fsync_window_usecs != TUX3FUSE_UNSET)
+		sched->fsync_window_usecs = tux3fuse->fsync_window_usecs;
+}
+
 static void tux3fuse_init(void *userdata, struct fuse_conn_info *conn)
 {
 	struct tux3fuse *tux3fuse = userdata;
@@ -88,6 +118,9 @@ static void tux3fuse_init(void *userdata, struct fuse_conn_info *conn)
 	dev->bits = sb->blockbits;
 	init_buffers(dev, 50 << 20, 2);
 
+	sb->xattr_share = tux3fuse->xattr_share;
+	tux3fuse_setup_sched(tux3fuse, sb);
+
 	struct replay *rp = tux3_init_fs(sb);
 	if (IS_ERR(rp)) {
 		err = PTR_ERR(rp);
@@ -100,6 +133,12 @@ static void tux3fuse_init(void *userdata, struct fuse_conn_info *conn)
 
 	tux3fuse->sb = sb;
 
+#ifdef FUSE_CAP_IOCTL_DIR
+	/* "tux3 commitstat <mountpoint>" issues ioctl to directory */
+	if (conn->capable & FUSE_CAP_IOCTL_DIR)
+		conn->want |= FUSE_CAP_IOCTL_DIR;
+#endif
+
 	return;
 
 error:
@@ -119,6 +158,7 @@ static void tux3fuse_destroy(void *userdata)
 		free(tux3fuse->sb->dev);
 	if (tux3fuse->sb)
 		free(tux3fuse->sb);
+	tux3fuse->sb = NULL;
 }
 
 static struct sb *tux3fuse_get_sb(fuse_req_t req)
@@ -636,62 +676,199 @@ static void tux3fuse_releasedir(fuse_req_t req, fuse_ino_t ino,
 	tux3fuse_release(req, ino, fi);
 }
 
-struct fillstate { char *dirent; int done; u64 ino; unsigned type; };
+/* Directory entry collected by tux_readdir() for one reply */
+struct tux3fuse_dirent {
+	u64 ino;
+	loff_t next;			/* f_pos of next entry */
+	unsigned type;
+	const char *name;
+	struct fuse_entry_param ep;	/* for readdirplus */
+};
+
+struct tux3fuse_dirbuf {
+	fuse_req_t req;
+	int plus;			/* readdirplus? */
+	size_t size;			/* size of reply */
+	size_t used;			/* used size of reply */
+	char *names;			/* storage of names */
+	size_t names_used;
+	unsigned count, max;
+	struct tux3fuse_dirent *ents;
+};
+
+/* Add entry to reply. If buf == NULL, just return the size of entry. */
+static size_t tux3fuse_add_direntry(fuse_req_t req, char *buf, size_t size,
+				    struct tux3fuse_dirent *ent, int plus)
+{
+#ifdef FUSE_CAP_READDIRPLUS
+	if (plus) {
+		return fuse_add_direntry_plus(req, buf, size, ent->name,
+					      &ent->ep, ent->next);
+	}
+#endif
+	struct stat stbuf = {
+		.st_ino		= ent->ino,
+		.st_mode	= ent->type << 12, /* DTTOIF() */
+	};
+	return fuse_add_direntry(req, buf, size, ent->name, &stbuf, ent->next);
+}
 
 static int tux3fuse_filler(void *info, const char *name, int namelen,
 			   loff_t offset, u64 ino, unsigned type)
 {
-	struct fillstate *state = info;
-	if (state->done || namelen > TUX_NAME_LEN)
+	struct tux3fuse_dirbuf *db = info;
+	struct tux3fuse_dirent *ent;
+	char *copy = db->names + db->names_used;
+	size_t entsize;
+
+	if (namelen > TUX_NAME_LEN)
 		return -EINVAL;
+	/* Previous entry ends at this entry */
+	if (db->count)
+		db->ents[db->count - 1].next = offset;
+	if (db->count == db->max)
+		return 1;
+
 	trace("'%.*s'\n", namelen, name);
-	memcpy(state->dirent, name, namelen);
-	state->dirent[namelen] = 0;
-	state->ino = ino;
-	state->type = type;
-	state->done = 1;
+	memcpy(copy, name, namelen);
+	copy[namelen] = 0;
+
+	ent = &db->ents[db->count];
+	*ent = (struct tux3fuse_dirent){
+		.ino	= ino,
+		.type	= type,
+		.name	= copy,
+	};
+
+	/* Reply is full? */
+	entsize = tux3fuse_add_direntry(db->req, NULL, 0, ent, db->plus);
+	if (db->used + entsize > db->size)
+		return 1;
+	db->used += entsize;
+	db->names_used += namelen + 1;
+	db->count++;
+
 	return 0;
 }
 
-/* FIXME: this should return more than one dirent per tux_readdir */
-static void tux3fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
-			     off_t offset, struct fuse_file_info *fi)
+static int tux3fuse_dirent_cmp(const void *a, const void *b)
 {
-	trace("(%lx)", ino);
+	const struct tux3fuse_dirent *x = *(struct tux3fuse_dirent **)a;
+	const struct tux3fuse_dirent *y = *(struct tux3fuse_dirent **)b;
+
+	return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+/*
+ * Get attributes of collected entries for readdirplus. To read ileaf
+ * sequentially, iget in inum order instead of directory order.
+ */
+static int tux3fuse_dirbuf_getattr(struct sb *sb, struct tux3fuse_dirbuf *db)
+{
+	struct tux3fuse_dirent **order;
+	unsigned i;
+
+	order = malloc(db->count * sizeof(*order));
+	if (!order)
+		return -ENOMEM;
+	for (i = 0; i < db->count; i++)
+		order[i] = &db->ents[i];
+	qsort(order, db->count, sizeof(*order), tux3fuse_dirent_cmp);
+
+	for (i = 0; i < db->count; i++) {
+		struct tux3fuse_dirent *ent = order[i];
+		struct inode *inode = tux3_iget(sb, ent->ino);
+
+		if (IS_ERR(inode)) {
+			/* Zero ino tells to kernel that no attributes */
+			ent->ep = (struct fuse_entry_param){
+				.attr.st_ino	= ent->ino,
+				.attr.st_mode	= ent->type << 12,
+			};
+			continue;
+		}
+		tux3fuse_fill_ep(&ent->ep, inode);
+		iput(inode);
+	}
+	free(order);
+
+	return 0;
+}
+
+static void __tux3fuse_readdir(fuse_req_t req, size_t size, off_t offset,
+			       struct fuse_file_info *fi, int plus)
+{
+	struct sb *sb = tux3fuse_get_sb(req);
 	struct inode *inode = (struct inode *)(unsigned long)fi->fh;
 	struct file *dirfile = &(struct file){ .f_inode = inode, .f_pos = offset };
-	char dirent[TUX_NAME_LEN + 1];
-	char *buf = malloc(size);
-	if (!buf) {
-		fuse_reply_err(req, ENOMEM);
-		return;
+	/* Each entry has at least 24 bytes header on reply */
+	unsigned max = size / 24 + 1;
+	struct tux3fuse_dirbuf db = {
+		.req	= req,
+		.plus	= plus,
+		.size	= size,
+		.max	= max,
+	};
+	char *buf = NULL;
+	size_t len = 0;
+	unsigned i;
+	int err;
+
+	err = -ENOMEM;
+	db.names = malloc(max * (TUX_NAME_LEN + 1));
+	db.ents = malloc(max * sizeof(*db.ents));
+	buf = malloc(size);
+	if (!db.names || !db.ents || !buf)
+		goto error;
+
+	err = tux_readdir(dirfile, &db, tux3fuse_filler);
+	if (err)
+		goto error;
+	if (!db.count) {
+		fuse_reply_buf(req, NULL, 0);
+		goto out;
 	}
+	/* Last entry ends at current position, if filler didn't stop */
+	if (!db.ents[db.count - 1].next)
+		db.ents[db.count - 1].next = dirfile->f_pos;
 
-	while (dirfile->f_pos < dirfile->f_inode->i_size) {
-		struct fillstate fstate = { .dirent = dirent };
-		int err;
+	if (plus) {
+		err = tux3fuse_dirbuf_getattr(sb, &db);
+		if (err)
+			goto error;
+	}
 
-		err = tux_readdir(dirfile, &fstate, tux3fuse_filler);
-		if (err) {
-			fuse_reply_err(req, -err);
-			free(buf);
-			return;
-		}
-		struct stat stbuf = {
-			.st_ino = fstate.ino,
-			.st_mode = fstate.type,
-		};
-		size_t len = fuse_add_direntry(req, buf, size, dirent, &stbuf,
-					       dirfile->f_pos);
-		fuse_reply_buf(req, buf, len);
-		free(buf);
-		return;
+	for (i = 0; i < db.count; i++) {
+		len += tux3fuse_add_direntry(req, buf + len, size - len,
+					     &db.ents[i], plus);
 	}
+	fuse_reply_buf(req, buf, len);
+	goto out;
 
-	fuse_reply_buf(req, NULL, 0);
+error:
+	fuse_reply_err(req, -err);
+out:
+	free(db.names);
+	free(db.ents);
 	free(buf);
 }
 
+static void tux3fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			     off_t offset, struct fuse_file_info *fi)
+{
+	trace("(%lx)", ino);
+	__tux3fuse_readdir(req, size, offset, fi, 0);
+}
+
+#ifdef FUSE_CAP_READDIRPLUS
+static void tux3fuse_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+				 off_t offset, struct fuse_file_info *fi)
+{
+	trace("(%lx)", ino);
+	__tux3fuse_readdir(req, size, offset, fi, 1);
+}
+#endif
+
 static void tux3fuse_statfs(fuse_req_t req, fuse_ino_t ino)
 {
 	struct sb *sb = tux3fuse_get_sb(req);
@@ -723,8 +900,8 @@ static void tux3fuse_fsyncdir(fuse_req_t req, fuse_ino_t ino,
 {
 	struct sb *sb = tux3fuse_get_sb(req);
 	/* FIXME: we should flush only this dir */
-	sync_super(sb);
-	fuse_reply_err(req, 0);
+	int err = fsync_delta(sb);
+	fuse_reply_err(req, -err);
 }
 
 static void tux3fuse_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
@@ -732,8 +909,8 @@ static void tux3fuse_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
 {
 	struct sb *sb = tux3fuse_get_sb(req);
 	/* FIXME: we should flush only this file */
-	sync_super(sb);
-	fuse_reply_err(req, 0);
+	int err = fsync_delta(sb);
+	fuse_reply_err(req, -err);
 }
 
 /*
@@ -935,6 +1112,36 @@ static void tux3fuse_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
 #endif
 		fuse_reply_err(req, ENOTTY);
 		return;
+
+	case TUX3_IOC_COMMITSTAT: {
+		struct tux3_commitstat *stat;
+
+		if (out_bufsz < sizeof(*stat)) {
+			fuse_reply_err(req, EINVAL);
+			return;
+		}
+		stat = malloc(sizeof(*stat));
+		if (!stat) {
+			fuse_reply_err(req, ENOMEM);
+			return;
+		}
+		tux3_commitstat(tux3fuse_get_sb(req), stat);
+		fuse_reply_ioctl(req, 0, stat, sizeof(*stat));
+		free(stat);
+		return;
+	}
+
+	case TUX3_IOC_DCACHESTAT: {
+		struct tux3_dcachestat stat;
+
+		if (out_bufsz < sizeof(stat)) {
+			fuse_reply_err(req, EINVAL);
+			return;
+		}
+		dcache_stat(tux3fuse_get_sb(req), &stat);
+		fuse_reply_ioctl(req, 0, &stat, sizeof(stat));
+		return;
+	}
 	}
 
 	fuse_reply_err(req, ENOTTY);
@@ -963,6 +1170,9 @@ static struct fuse_lowlevel_ops tux3_ops = {
 	.fsync		= tux3fuse_fsync,
 	.opendir	= tux3fuse_opendir,
 	.readdir	= tux3fuse_readdir,
+#ifdef FUSE_CAP_READDIRPLUS
+	.readdirplus	= tux3fuse_readdirplus,
+#endif
 	.releasedir	= tux3fuse_releasedir,
 	.fsyncdir	= tux3fuse_fsyncdir,
 	.statfs		= tux3fuse_statfs,
@@ -987,6 +1197,15 @@ enum {
 };
 
 static struct fuse_opt tux3fuse_options[] = {
+	{ "xattr_share=%u", offsetof(struct tux3fuse, xattr_share), 0 },
+	{ "delta_blocks=%u", offsetof(struct tux3fuse, delta_blocks), 0 },
+	{ "delta_inodes=%u", offsetof(struct tux3fuse, delta_inodes), 0 },
+	{ "delta_msecs=%u", offsetof(struct tux3fuse, delta_msecs), 0 },
+	{ "unify_logblocks=%u", offsetof(struct tux3fuse, unify_logblocks), 0 },
+	{ "unify_replay_msecs=%u",
+	  offsetof(struct tux3fuse, unify_replay_msecs), 0 },
+	{ "fsync_window_usecs=%u",
+	  offsetof(struct tux3fuse, fsync_window_usecs), 0 },
 	FUSE_OPT_KEY("-h",	FUSE_OPT_KEY_TUX3_HELP),
 	FUSE_OPT_KEY("--help",	FUSE_OPT_KEY_TUX3_HELP),
 	FUSE_OPT_END
@@ -1017,6 +1236,18 @@ static int tux3fuse_parse_options(void *data, const char *arg,
 			"\n"
 			"Options:\n"
 			"    -o opt,[opt...]        mount options\n"
+			"\n"
+			"Tux3 options:\n"
+			"    -o xattr_share=SIZE    share xattr values of SIZE bytes or more\n"
+			"    -o delta_blocks=N      commit delta after N dirty blocks\n"
+			"    -o delta_inodes=N      commit delta after N dirty inodes\n"
+			"    -o delta_msecs=MSECS   commit delta older than MSECS\n"
+			"    -o unify_logblocks=N   unify after N log blocks\n"
+			"    -o unify_replay_msecs=MSECS\n"
+			"                           unify if replay may take MSECS\n"
+			"                           (0 disables each trigger)\n"
+			"    -o fsync_window_usecs=USECS\n"
+			"                           wait USECS to group fsync callers\n"
 			"    -h   --help            print help\n"
 			"    -V   --version         print version\n"
 			"\n", outargs->argv[0]);
@@ -1027,6 +1258,44 @@ static int tux3fuse_parse_options(void *data, const char *arg,
 	return 1;
 }
 
+/*
+ * Same with fuse_session_loop(), but releases the frontend lock while
+ * waiting next request, so the flusher can write delta while idle.
+ */
+static int tux3fuse_session_loop(struct fuse_session *se,
+				 struct tux3fuse *tux3fuse)
+{
+	struct fuse_chan *ch = fuse_session_next_chan(se, NULL);
+	size_t bufsize = fuse_chan_bufsize(ch);
+	char *buf;
+	int res = 0;
+
+	buf = malloc(bufsize);
+	if (!buf)
+		return -1;
+
+	while (!fuse_session_exited(se)) {
+		struct fuse_chan *tmpch = ch;
+
+		if (tux3fuse->sb)
+			tux3_frontend_unlock(tux3fuse->sb);
+		res = fuse_chan_recv(&tmpch, buf, bufsize);
+		if (tux3fuse->sb)
+			tux3_frontend_lock(tux3fuse->sb);
+		if (res == -EINTR)
+			continue;
+		if (res <= 0)
+			break;
+
+		fuse_session_process(se, buf, res, tmpch);
+	}
+
+	free(buf);
+	fuse_session_reset(se);
+
+	return res < 0 ? -1 : 0;
+}
+
 int main(int argc, char *argv[])
 {
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
@@ -1036,7 +1305,14 @@ int main(int argc, char *argv[])
 	int foreground;
 	int err = -1;
 
-	struct tux3fuse tux3fuse = {};
+	struct tux3fuse tux3fuse = {
+		.delta_blocks		= TUX3FUSE_UNSET,
+		.delta_inodes		= TUX3FUSE_UNSET,
+		.delta_msecs		= TUX3FUSE_UNSET,
+		.unify_logblocks	= TUX3FUSE_UNSET,
+		.unify_replay_msecs	= TUX3FUSE_UNSET,
+		.fsync_window_usecs	= TUX3FUSE_UNSET,
+	};
 
 	if (argc < 3) {
 		/* Print usage */
@@ -1068,7 +1344,7 @@ int main(int argc, char *argv[])
 				printf("Running in background\n");
 			fuse_daemonize(foreground);
 
-			err = fuse_session_loop(fs);
+			err = tux3fuse_session_loop(fs, &tux3fuse);
 
 			fuse_remove_signal_handlers(fs);
 			fuse_session_remove_chan(fc);
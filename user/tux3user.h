@@ -10,6 +10,7 @@
 #include <limits.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
 #include <time.h>
 #include <errno.h>
@@ -21,6 +22,7 @@
 #include "libklib/libklib.h"
 #include "libklib/lockdebug.h"
 #include "libklib/atomic.h"
+#include "libklib/percpu-refcount.h"
 #include "libklib/mm.h"
 #include "libklib/slab.h"
 #include "libklib/fs.h"
@@ -57,6 +59,16 @@ static inline struct inode *file_inode(struct file *f)
 	return f->f_inode;
 }
 
+/* Statistics of dentry cache (namei.c), result of TUX3_IOC_DCACHESTAT */
+struct tux3_dcachestat {
+	u64 hits;			/* positive hits */
+	u64 neg_hits;			/* negative hits */
+	u64 misses;			/* lookups searched directory */
+	u64 entries;			/* cached entries */
+};
+
+#define TUX3_IOC_DCACHESTAT	_IOR('T', 2, struct tux3_dcachestat)
+
 #include "kernel/tux3.h"
 
 #define INIT_DISKSB(_bits, _blocks) (struct disksuper){		\
@@ -108,17 +120,21 @@ int page_readlink(struct inode *inode, void *buf, unsigned size);
 
 /* inode.c */
 void inode_leak_check(void);
+void iattr_cache_invalidate(struct sb *sb);
 void remove_inode_hash(struct inode *inode);
 void unlock_new_inode(struct inode *inode);
 void __iget(struct inode *inode);
 void ihold(struct inode *inode);
 loff_t i_size_read(const struct inode *inode);
 void i_size_write(struct inode *inode, loff_t i_size);
+int tux3_truncate_partial_block(struct inode *inode, loff_t newsize);
 void iput(struct inode *inode);
 int __tuxtruncate(struct inode *inode, loff_t size);
 int tuxtruncate(struct inode *inode, loff_t size);
 
 /* namei.c */
+void dcache_invalidate(struct sb *sb);
+void dcache_stat(struct sb *sb, struct tux3_dcachestat *stat);
 struct inode *tuxopen(struct inode *dir, const char *name, unsigned len);
 struct inode *__tuxmknod(struct inode *dir, const char *name, unsigned len,
 			 struct tux_iattr *iattr, dev_t rdev);
@@ -150,8 +166,11 @@ void stacktrace(void);
 int devio(int rw, struct dev *dev, loff_t offset, void *data, unsigned len);
 int devio_vec(int rw, struct dev *dev, loff_t offset, struct iovec *iov,
 	      unsigned iovcnt);
+int devio_readahead(struct dev *dev, loff_t offset, unsigned len);
 int blockio(int rw, struct sb *sb, struct buffer_head *buffer, block_t block);
 int blockio_vec(int rw, struct bufvec *bufvec, block_t block, unsigned count);
+int blockio_multi(int rw, struct sb *sb, struct buffer_head **buffers,
+		  unsigned count, block_t block);
 
 #define tux3_msg(sb, fmt, ...)						\
 	__tux3_msg(sb, "", "", fmt "\n", ##__VA_ARGS__)
@@ -21,6 +21,12 @@ int devio_vec(int rw, struct dev *dev, loff_t offset, struct iovec *iov,
 	return iovabs(dev->fd, iov, iovcnt, rw, offset);
 }
 
+/* Start asynchronous read of range, without waiting I/O */
+int devio_readahead(struct dev *dev, loff_t offset, unsigned len)
+{
+	return diskreadahead(dev->fd, len, offset);
+}
+
 int blockio(int rw, struct sb *sb, struct buffer_head *buffer, block_t block)
 {
 	trace("%s: buffer %p, block %Lx",
@@ -36,6 +42,30 @@ int blockio_vec(int rw, struct bufvec *bufvec, block_t block, unsigned count)
 	return bufvec_io(rw, bufvec, block, count);
 }
 
+/* I/O for count of buffers to physically contiguous blocks at once */
+int blockio_multi(int rw, struct sb *sb, struct buffer_head **buffers,
+		  unsigned count, block_t block)
+{
+	struct iovec *iov;
+	unsigned i;
+	int err;
+
+	trace("%s: count %u, block %Lx",
+	      (rw & WRITE) ? "write" : "read", count, block);
+
+	iov = malloc(sizeof(*iov) * count);
+	if (!iov)
+		return -ENOMEM;
+	for (i = 0; i < count; i++) {
+		iov[i].iov_base = bufdata(buffers[i]);
+		iov[i].iov_len = sb->blocksize;
+	}
+	err = devio_vec(rw, sb_dev(sb), block << sb->blockbits, iov, count);
+	free(iov);
+
+	return err;
+}
+
 /*
  * Message helpers
  */
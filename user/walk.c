@@ -10,6 +10,7 @@
 #define TUX3_WALK_C
 
 #include "tux3user.h"
+#include "diskio.h"
 
 /* walk has to access internal structure */
 #include "kernel/btree.c"
@@ -18,6 +19,58 @@
 #include "kernel/ileaf.c"
 
 
+/*
+ * Readahead for walkers. Walkers read the whole tree in order, one
+ * block at a time, so without a hint each read waits for the
+ * device. Tell the host kernel about blocks we will read soon, to
+ * keep many reads in flight while the walker processes the current
+ * block.
+ *
+ * The walk itself is single threaded: the userland buffer and inode
+ * caches are not thread safe, so walking partitions of the tree in
+ * parallel would need those to be reworked first.
+ *
+ * FIXME: a partitioned walk for read-only users (dump, fsck), with
+ * per-thread buffers, is not implemented yet. This only overlaps the
+ * reads of the single walker.
+ */
+#define WALK_READAHEAD_MAX	256	/* max blocks per hint */
+
+static void walk_readahead(struct sb *sb, block_t block, unsigned count)
+{
+	count = min(count, (unsigned)WALK_READAHEAD_MAX);
+	/* Only a hint, the walker reads blocks anyway */
+	diskreadahead(sb_dev(sb)->fd, (size_t)count << sb->blockbits,
+		      block << sb->blockbits);
+}
+
+/* Readahead children of bnode from the cursor position */
+static void walk_readahead_bnode(struct cursor *cursor)
+{
+	struct btree *btree = cursor->btree;
+	struct buffer_head *buffer = cursor->path[cursor->level].buffer;
+	struct bnode *bnode = bufdata(buffer);
+	struct index_entry *next = cursor->path[cursor->level].next;
+	struct index_entry *limit = bnode->entries + bcount(bnode);
+	block_t start = 0;
+	unsigned count = 0;
+
+	/* Merge physically contiguous children into one hint */
+	for (; next < limit; next++) {
+		block_t block = be64_to_cpu(next->block);
+		if (count && block == start + count) {
+			count++;
+			continue;
+		}
+		if (count)
+			walk_readahead(btree->sb, start, count);
+		start = block;
+		count = 1;
+	}
+	if (count)
+		walk_readahead(btree->sb, start, count);
+}
+
 typedef void (*walk_data_cb)(struct btree *, struct buffer_head *,
 			     struct buffer_head *, block_t,
 			     void *, void *);
@@ -29,6 +82,8 @@ static void walk_extent(struct btree *btree, struct buffer_head *leafbuf,
 {
 	struct buffer_head *buffer;
 
+	walk_readahead(btree->sb, block, count);
+
 	for (unsigned i = 0; i < count; i++) {
 		buffer = blockread(mapping(btree_inode(btree)), index + i);
 		assert(buffer);
@@ -192,6 +247,7 @@ static void walk_btree(struct btree *btree, struct walk_btree_ops *cb,
 	buffer = cursor->path[cursor->level].buffer;
 	if (cb->bnode)
 		cb->bnode(btree, buffer, cursor->level, data);
+	walk_readahead_bnode(cursor);
 
 	while (1) {
 		int ret = cursor_advance_down(cursor);
@@ -203,6 +259,7 @@ static void walk_btree(struct btree *btree, struct walk_btree_ops *cb,
 			buffer = cursor->path[cursor->level].buffer;
 			if (cb->bnode)
 				cb->bnode(btree, buffer, cursor->level, data);
+			walk_readahead_bnode(cursor);
 			continue;
 		}
 
@@ -251,9 +308,34 @@ static const char *log_name[] = {
 	X(LOG_FREEBLOCKS),
 	X(LOG_UNIFY),
 	X(LOG_DELTA),
+	X(LOG_BITMAP_BATCH),
 #undef X
 };
 
+/*
+ * Expand LOG_BITMAP_BATCH to each LOG_BALLOC, LOG_BFREE, etc. in the
+ * fixed size format, so callback doesn't need to know batch.
+ */
+static void walk_log_batch(struct sb *sb, struct walk_logchain_ops *cb,
+			   struct buffer_head *buffer, u8 *p, int obsolete,
+			   void *data)
+{
+	struct log_batch batch;
+	block_t block;
+	unsigned count;
+
+	log_batch_init(&batch, p);
+	while (log_batch_next(&batch, &block, &count) > 0) {
+		u8 log[11], *pos = log;
+
+		*pos++ = batch.intent;
+		pos = encode32(pos, count);
+		pos = encode48(pos, block);
+		cb->log(sb, buffer, batch.intent, log + 1,
+			log_size[batch.intent], obsolete, data);
+	}
+}
+
 static void walk_logchain(struct sb *sb, struct walk_logchain_ops *cb,
 			  void *data)
 {
@@ -265,7 +347,7 @@ static void walk_logchain(struct sb *sb, struct walk_logchain_ops *cb,
 	/* Check whether array is uptodate */
 	BUILD_BUG_ON(ARRAY_SIZE(log_name) != LOG_TYPES);
 
-	nextchain = be64_to_cpu(sb->super.logchain);
+	nextchain = logchain_block(sb->super.logchain);
 	logcount = be32_to_cpu(sb->super.logcount);
 	while (logcount > 0) {
 		struct logblock *log;
@@ -289,7 +371,7 @@ static void walk_logchain(struct sb *sb, struct walk_logchain_ops *cb,
 					break;
 				}
 
-				p += log_size[code];
+				p += log_entry_size(p);
 			}
 		}
 
@@ -301,7 +383,7 @@ static void walk_logchain(struct sb *sb, struct walk_logchain_ops *cb,
 			u8 *p = log->data;
 			while (p < log->data + be16_to_cpu(log->bytes)) {
 				u8 code = *p;
-				unsigned len = log_size[code];
+				unsigned len = log_entry_size(p);
 
 				if (unify_pos) {
 					if (p < unify_pos)
@@ -310,8 +392,13 @@ static void walk_logchain(struct sb *sb, struct walk_logchain_ops *cb,
 						obsolete_log = 0;
 				}
 
-				cb->log(sb, buffer, code, p + sizeof(code),
-					len, obsolete_log, data);
+				if (code == LOG_BITMAP_BATCH)
+					walk_log_batch(sb, cb, buffer, p,
+						       obsolete_log, data);
+				else
+					cb->log(sb, buffer, code,
+						p + sizeof(code), len,
+						obsolete_log, data);
 
 				p += len;
 			}
@@ -322,7 +409,7 @@ static void walk_logchain(struct sb *sb, struct walk_logchain_ops *cb,
 
 		logcount--;
 
-		nextchain = be64_to_cpu(log->logchain);
+		nextchain = logchain_block(log->logchain);
 		blockput(buffer);
 	}
 }